@@ -0,0 +1,170 @@
+#include "arb.h"
+#include "fan.h"
+
+typedef struct {
+    q15_t demand;
+    uint32_t time;          // when the demand was set
+    uint16_t timeout;
+    uint8_t valid;
+}ArbInput;
+
+typedef struct {
+    ArbPolicy policy;
+    uint8_t weights[eARB_NUM_OF_SOURCES];
+    ArbInput inputs[eARB_NUM_OF_SOURCES];
+}ArbFan;
+
+static ArbFan arbFan[NUM_OF_FANS];
+static uint8_t changed = 0;
+
+void ARB_init(void){
+    uint8_t i, j;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        ArbFan *af = &arbFan[i];
+        af->policy = ARB_DEFAULT_POLICY;
+
+        for(j = 0; j < eARB_NUM_OF_SOURCES; j++){
+            af->weights[j] = ARB_DEFAULT_WEIGHT;
+            af->inputs[j].valid = 0;
+        }
+
+        af->inputs[eARB_FAILSAFE].demand = ARB_FAILSAFE_DEMAND;
+        af->inputs[eARB_FAILSAFE].timeout = 0;
+        af->inputs[eARB_FAILSAFE].valid = 1;
+    }
+
+    changed = 1;
+}
+
+void ARB_setPolicy(uint8_t fan, ArbPolicy policy, const uint8_t *weights){
+    if((fan >= NUM_OF_FANS) || (policy >= eARB_NUM_OF_POLICIES))
+        return;
+
+    ArbFan *af = &arbFan[fan];
+    af->policy = policy;
+
+    uint8_t i;
+    if(weights != 0){
+        for(i = 0; i < eARB_NUM_OF_SOURCES; i++)
+            af->weights[i] = weights[i];
+    }
+
+    changed = 1;
+}
+
+void ARB_set(ArbSource source, uint8_t fanMask, q15_t demand, uint16_t timeout, uint32_t now){
+    if(source >= eARB_NUM_OF_SOURCES)
+        return;
+
+    if(demand < 0)
+        demand = 0;
+
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        if((fanMask & (1 << i)) == 0)
+            continue;
+
+        ArbInput *in = &arbFan[i].inputs[source];
+        if(!in->valid || ((source != eARB_MOTHERBOARD) && (in->demand != demand)))
+            changed = 1;
+
+        in->demand = demand;
+        in->time = now;
+        in->timeout = timeout;
+        in->valid = 1;
+    }
+}
+
+void ARB_clear(ArbSource source, uint8_t fanMask){
+    /* the failsafe is always there to fall back to */
+    if(source >= eARB_FAILSAFE)
+        return;
+
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        ArbInput *in = &arbFan[i].inputs[source];
+        if((fanMask & (1 << i)) && in->valid){
+            in->valid = 0;
+            changed = 1;
+        }
+    }
+}
+
+uint8_t ARB_service(uint32_t now){
+    uint8_t i, j;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        for(j = 0; j < eARB_FAILSAFE; j++){
+            ArbInput *in = &arbFan[i].inputs[j];
+            if(in->valid && (in->timeout != 0) && ((now - in->time) > in->timeout)){
+                in->valid = 0;
+                changed = 1;
+            }
+        }
+    }
+
+    uint8_t result = changed;
+    changed = 0;
+
+    return result;
+}
+
+/* a fixed number of sources per fan, so the time taken is bounded */
+q15_t ARB_resolve(uint8_t fan){
+    if(fan >= NUM_OF_FANS)
+        return 0;
+
+    const ArbFan *af = &arbFan[fan];
+    uint8_t found = 0;
+    q15_t demand = 0;
+    int32_t sum = 0;
+    uint16_t weights = 0;
+
+    uint8_t i;
+    for(i = 0; i < eARB_FAILSAFE; i++){
+        const ArbInput *in = &af->inputs[i];
+        if(!in->valid)
+            continue;
+
+        switch(af->policy){
+            case eARB_MAX:
+                if(!found || (in->demand > demand))
+                    demand = in->demand;
+                break;
+
+            case eARB_BLEND:
+                sum += (int32_t)in->demand * af->weights[i];
+                weights += af->weights[i];
+                break;
+
+            case eARB_PRIORITY:
+            default:
+                demand = in->demand;
+                break;
+        }
+        found = 1;
+    }
+
+    /* sources that all carry no weight leave only the failsafe */
+    if(af->policy == eARB_BLEND){
+        if(weights > 0)
+            demand = (q15_t)(sum / weights);
+        else
+            found = 0;
+    }
+
+    return found ? demand : af->inputs[eARB_FAILSAFE].demand;
+}
+
+uint8_t ARB_getValid(uint8_t fan){
+    if(fan >= NUM_OF_FANS)
+        return 0;
+
+    uint8_t valid = 0;
+    uint8_t i;
+    for(i = 0; i < eARB_NUM_OF_SOURCES; i++){
+        if(arbFan[fan].inputs[i].valid)
+            valid |= 1 << i;
+    }
+
+    return valid;
+}
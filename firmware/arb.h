@@ -0,0 +1,47 @@
+#ifndef ARB_H
+#define ARB_H
+
+#include <stdint.h>
+#include "libmathq15.h"
+
+/* arbitration between the sources of each fan's demand, the fraction of
+ * full speed that the fan's target duty cycle is scaled by */
+typedef enum {
+    eARB_MOTHERBOARD,       // PWM input, or the master's input on a follower
+    eARB_TEMPERATURE,       // temperature curve
+    eARB_HOST,              // host command over telemetry
+    eARB_FAILSAFE,          // applies alone when no other source is valid
+    eARB_NUM_OF_SOURCES
+}ArbSource;
+
+/* max: the highest demand of the valid sources
+ * blend: the valid sources averaged by their weights
+ * priority: the valid source latest in ArbSource before the failsafe */
+typedef enum {eARB_MAX, eARB_BLEND, eARB_PRIORITY, eARB_NUM_OF_POLICIES} ArbPolicy;
+
+#define ARB_ALL_FANS            0x0f
+#define ARB_DEFAULT_POLICY      eARB_MAX
+#define ARB_DEFAULT_WEIGHT      1
+#define ARB_FAILSAFE_DEMAND     32767
+
+/* ms that a demand stays valid after it was set, 0 never goes stale */
+#define ARB_MOTHERBOARD_TIMEOUT 100
+
+void ARB_init(void);
+void ARB_setPolicy(uint8_t fan, ArbPolicy policy, const uint8_t *weights);
+
+/* sets or clears the demand of a source for each fan in the mask; sources
+ * other than the motherboard mark the outputs dirty when they change, as
+ * the motherboard input has its own hysteresis */
+void ARB_set(ArbSource source, uint8_t fanMask, q15_t demand, uint16_t timeout, uint32_t now);
+void ARB_clear(ArbSource source, uint8_t fanMask);
+
+/* run once per control period, expires the stale demands and returns
+ * non-zero when the valid sources of any fan, or the demand of one other
+ * than the motherboard, have changed */
+uint8_t ARB_service(uint32_t now);
+
+q15_t ARB_resolve(uint8_t fan);
+uint8_t ARB_getValid(uint8_t fan);
+
+#endif
@@ -0,0 +1,349 @@
+#include "blackbox.h"
+#include "eeprom.h"
+#include "persist.h"
+
+#define BBOX_QUEUE_SIZE     4
+#define BBOX_ERASED         0xffff
+
+#if BLACKBOX_ENABLED || (!defined(__XC16) && !defined(XC16))
+static uint8_t check(const uint16_t *words);
+static uint8_t isEmpty(uint16_t header);
+#endif
+
+#if BLACKBOX_ENABLED
+/* records waiting to be written, only queued from background tasks */
+static uint16_t queue[BBOX_QUEUE_SIZE][BBOX_SLOT_WORDS];
+static uint8_t queueHead = 0;
+static uint8_t queued = 0;
+static uint8_t step = 0;        // of the record being written
+static uint8_t slot = 0;        // where the next record goes, always erased
+static uint16_t dropped = 0;
+static uint8_t frozen = 0;
+
+static uint16_t hour = 0;
+static uint16_t seconds = 0;    // into the hour, kept across a warm reset
+static uint16_t samples = 0;    // summed since the start-up or the last summary
+static uint32_t rpmSum[NUM_OF_FANS];
+static uint32_t dcSum[NUM_OF_FANS];
+static uint8_t lastRpm[NUM_OF_FANS];
+static uint8_t lastDc[NUM_OF_FANS];
+static uint8_t summaries = 0;   // since the last absolute one, 0 for none yet
+
+static uint16_t slotAddress(uint8_t s);
+static void summarize(void);
+static uint8_t queueRecord(BboxType type, uint8_t detail, uint16_t first, uint16_t second);
+static uint8_t toByte(uint32_t value, uint8_t shift);
+
+void BBOX_init(void){
+    uint8_t corrupt = 0;
+    uint8_t firstCorrupt = 0;
+    uint8_t found = 0;
+
+    queueHead = queued = step = 0;
+    frozen = 0;
+    slot = 0;
+    hour = 0;
+    seconds = 0;
+    samples = 0;
+    summaries = 0;
+
+    uint8_t i, j;
+    for(i = 0; i < NUM_OF_FANS; i++)
+        rpmSum[i] = dcSum[i] = 0;
+
+    for(i = 0; i < BBOX_SLOTS; i++){
+        uint16_t words[BBOX_SLOT_WORDS];
+        for(j = 0; j < BBOX_SLOT_WORDS; j++)
+            words[j] = EEPROM_read(slotAddress(i) + j);
+
+        /* the first erased slot after a record follows the newest one */
+        if(isEmpty(words[0])){
+            uint8_t previous = (i == 0) ? (BBOX_SLOTS - 1) : (i - 1);
+            if(!found && !isEmpty(EEPROM_read(slotAddress(previous)))){
+                slot = i;
+                found = 1;
+            }
+            continue;
+        }
+
+        if(check(words) != (words[0] & 0xff)){
+            if(corrupt++ == 0)
+                firstCorrupt = i;
+            continue;
+        }
+
+        /* the run hours carry on from the newest record, a summary
+         * covers the hour before the one it was written in */
+        uint16_t h = words[1];
+        if((words[0] >> 12) >= eBBOX_KEY_RPM)
+            h++;
+        if(h > hour)
+            hour = h;
+    }
+    
+    /* after a warm reset the part hour carries on too */
+    uint16_t keptHour, keptSeconds;
+    if(PERSIST_getClock(&keptHour, &keptSeconds) && (keptHour >= hour)
+            && (keptSeconds < BBOX_SAMPLES_PER_HOUR)){
+        hour = keptHour;
+        seconds = keptSeconds;
+    }
+
+    if(corrupt > 0)
+        BBOX_event(eBBOX_CHECK_FAIL, (corrupt > 15) ? 15 : corrupt, firstCorrupt);
+}
+
+void BBOX_event(BboxType type, uint8_t detail, uint16_t value){
+    if(!queueRecord(type, detail, value, 0))
+        dropped++;
+}
+
+/* called every second, logs the mean RPM and duty cycle of each fan once
+ * an hour as changes from the last summary where they are small */
+void BBOX_sample(const q15_t *dc, const uint16_t *rpm){
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        rpmSum[i] += rpm[i];
+        dcSum[i] += (dc[i] > 0) ? dc[i] : 0;
+    }
+    samples++;
+
+    /* the summary is stamped with the hour it covers */
+    if(++seconds >= BBOX_SAMPLES_PER_HOUR){
+        summarize();
+        samples = 0;
+        seconds = 0;
+        hour++;
+    }
+    PERSIST_saveClock(hour, seconds);
+}
+
+/* the means are over the samples of the hour since the start-up, the sums
+ * of a part hour before a reset are lost */
+static void summarize(void){
+    uint8_t i;
+    uint8_t small = (summaries > 0) && (summaries < BBOX_KEY_INTERVAL);
+    uint16_t rpmNibbles = 0;
+    uint16_t dcNibbles = 0;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        uint8_t r = toByte(rpmSum[i] / samples, BBOX_RPM_SHIFT);
+        uint8_t d = toByte(dcSum[i] / samples, BBOX_DC_SHIFT);
+        rpmSum[i] = dcSum[i] = 0;
+
+        int16_t rpmDelta = (int16_t)r - lastRpm[i];
+        int16_t dcDelta = (int16_t)d - lastDc[i];
+        if((rpmDelta < -8) || (rpmDelta > 7) || (dcDelta < -8) || (dcDelta > 7))
+            small = 0;
+
+        rpmNibbles |= (uint16_t)(rpmDelta & 0x0f) << (i << 2);
+        dcNibbles |= (uint16_t)(dcDelta & 0x0f) << (i << 2);
+        lastRpm[i] = r;
+        lastDc[i] = d;
+    }
+
+    if(small){
+        if(queueRecord(eBBOX_DELTA, 0, rpmNibbles, dcNibbles))
+            summaries++;
+        else
+            summaries = 0;
+        return;
+    }
+
+    /* an absolute summary takes two records, and the deltas that follow
+     * are only of use if both are written */
+    if(queued > (BBOX_QUEUE_SIZE - 2)){
+        summaries = 0;
+        dropped++;
+        return;
+    }
+    queueRecord(eBBOX_KEY_RPM, 0, lastRpm[0] | ((uint16_t)lastRpm[1] << 8), lastRpm[2] | ((uint16_t)lastRpm[3] << 8));
+    queueRecord(eBBOX_KEY_DC, 0, lastDc[0] | ((uint16_t)lastDc[1] << 8), lastDc[2] | ((uint16_t)lastDc[3] << 8));
+    summaries = 1;
+}
+
+/* writes the oldest queued record a word per run, each word an erase and
+ * a write in the background: first the header of the next slot is erased
+ * to mark the new head, then the payload is written and the header last,
+ * so that a reset part way through leaves the record empty */
+void BBOX_service(void){
+    /* a record part way through is left so, it is in the head slot and
+     * not part of a dump */
+    if(frozen || (queued == 0) || EEPROM_busy())
+        return;
+
+    const uint16_t *words = queue[queueHead];
+    uint8_t next = (slot + 1 < BBOX_SLOTS) ? (slot + 1) : 0;
+
+    if(step == 0){
+        EEPROM_startWrite(slotAddress(next), BBOX_ERASED);
+    }else if(step < BBOX_SLOT_WORDS){
+        EEPROM_startWrite(slotAddress(slot) + step, words[step]);
+    }else{
+        EEPROM_startWrite(slotAddress(slot), words[0]);
+
+        slot = next;
+        queueHead = (queueHead + 1 < BBOX_QUEUE_SIZE) ? (queueHead + 1) : 0;
+        queued--;
+        step = 0;
+        return;
+    }
+
+    step++;
+}
+
+void BBOX_freeze(uint8_t freeze){
+    frozen = freeze;
+}
+
+uint16_t BBOX_getHour(void){
+    return hour;
+}
+
+uint16_t BBOX_getDropped(void){
+    return dropped;
+}
+
+/* the head slot is always erased and left out */
+uint16_t BBOX_read(uint16_t offset, uint8_t *data, uint16_t length){
+    uint16_t n;
+    for(n = 0; (n < length) && (offset < BBOX_DUMP_SIZE); n++, offset++){
+        uint8_t s = slot + 1 + (offset / BBOX_RECORD_SIZE);
+        if(s >= BBOX_SLOTS)
+            s -= BBOX_SLOTS;
+
+        uint16_t word = EEPROM_read(slotAddress(s) + ((offset % BBOX_RECORD_SIZE) >> 1));
+        data[n] = (offset & 1) ? (word >> 8) : (word & 0xff);
+    }
+
+    return n;
+}
+
+static uint16_t slotAddress(uint8_t s){
+    return BBOX_EEPROM + ((uint16_t)s * BBOX_SLOT_WORDS);
+}
+
+static uint8_t queueRecord(BboxType type, uint8_t detail, uint16_t first, uint16_t second){
+    if(queued >= BBOX_QUEUE_SIZE)
+        return 0;
+
+    uint8_t i = queueHead + queued;
+    if(i >= BBOX_QUEUE_SIZE)
+        i -= BBOX_QUEUE_SIZE;
+
+    uint16_t *words = queue[i];
+    words[0] = ((uint16_t)type << 12) | ((uint16_t)(detail & 0x0f) << 8);
+    words[1] = hour;
+    words[2] = first;
+    words[3] = second;
+    words[0] |= check(words);
+
+    queued++;
+
+    return 1;
+}
+
+static uint8_t toByte(uint32_t value, uint8_t shift){
+    value = (value + (1UL << (shift - 1))) >> shift;
+
+    return (value > 255) ? 255 : (uint8_t)value;
+}
+#endif
+
+/* the decoder is left out of firmware built without the black box, the
+ * simulator always has it */
+#if BLACKBOX_ENABLED || (!defined(__XC16) && !defined(XC16))
+uint8_t BBOX_decode(const uint8_t *data, uint16_t length, uint16_t *position,
+        BboxState *state, BboxRecord *record){
+    while((*position + BBOX_RECORD_SIZE) <= length){
+        const uint8_t *p = &data[*position];
+        *position += BBOX_RECORD_SIZE;
+
+        uint16_t words[BBOX_SLOT_WORDS];
+        uint8_t i;
+        for(i = 0; i < BBOX_SLOT_WORDS; i++)
+            words[i] = (uint16_t)p[i << 1] | ((uint16_t)p[(i << 1) + 1] << 8);
+
+        if(isEmpty(words[0]))
+            continue;
+
+        record->type = (BboxType)(words[0] >> 12);
+        record->detail = (words[0] >> 8) & 0x0f;
+        record->hour = words[1];
+        record->value = words[2];
+        record->valid = (check(words) == (words[0] & 0xff));
+        record->complete = 0;
+
+        /* a corrupt record may have been a delta, so the summaries wait
+         * for the next absolute one */
+        if(!record->valid){
+            state->haveRpm = state->haveDc = 0;
+            return 1;
+        }
+
+        switch(record->type){
+            case eBBOX_KEY_RPM:
+            {
+                for(i = 0; i < NUM_OF_FANS; i++)
+                    state->rpm[i] = words[2 + (i >> 1)] >> ((i & 1) << 3);
+                state->haveRpm = 1;
+                break;
+            }
+
+            case eBBOX_KEY_DC:
+            {
+                for(i = 0; i < NUM_OF_FANS; i++)
+                    state->dc[i] = words[2 + (i >> 1)] >> ((i & 1) << 3);
+                state->haveDc = 1;
+                break;
+            }
+
+            case eBBOX_DELTA:
+            {
+                if(!state->haveRpm || !state->haveDc)
+                    return 1;
+
+                /* the nibbles sign extended */
+                for(i = 0; i < NUM_OF_FANS; i++){
+                    state->rpm[i] += (int8_t)((words[2] >> (i << 2)) << 4) >> 4;
+                    state->dc[i] += (int8_t)((words[3] >> (i << 2)) << 4) >> 4;
+                }
+                break;
+            }
+
+            default:
+                return 1;
+        }
+
+        record->complete = state->haveRpm && state->haveDc;
+        for(i = 0; i < NUM_OF_FANS; i++){
+            record->rpm[i] = (uint16_t)state->rpm[i] << BBOX_RPM_SHIFT;
+            record->dc[i] = (q15_t)state->dc[i] << BBOX_DC_SHIFT;
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+/* CRC-8, polynomial 0x07, over the type and detail, the hour and the
+ * payload */
+static uint8_t check(const uint16_t *words){
+    uint8_t bytes[7] = {words[0] >> 8, words[1] & 0xff, words[1] >> 8,
+            words[2] & 0xff, words[2] >> 8, words[3] & 0xff, words[3] >> 8};
+    uint8_t crc = 0xff;
+
+    uint8_t i, bit;
+    for(i = 0; i < sizeof(bytes); i++){
+        crc ^= bytes[i];
+        for(bit = 0; bit < 8; bit++)
+            crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+    }
+
+    return crc;
+}
+
+/* erased, or cleared as the configuration records may be */
+static uint8_t isEmpty(uint16_t header){
+    return (header == BBOX_ERASED) || (header == 0);
+}
+#endif
@@ -0,0 +1,93 @@
+#ifndef BLACKBOX_H
+#define BLACKBOX_H
+
+#include <stdint.h>
+#include "libmathq15.h"
+#include "fan.h"
+
+/* the black box log is compiled out unless enabled */
+#ifndef BLACKBOX_ENABLED
+#define BLACKBOX_ENABLED    0
+#endif
+
+/* the log is a ring of fixed size records in the upper half of the EEPROM,
+ * clear of the configuration records below 0x80 */
+#define BBOX_EEPROM         0x80
+#define BBOX_SLOTS          32
+#define BBOX_SLOT_WORDS     4
+#define BBOX_RECORD_SIZE    (BBOX_SLOT_WORDS << 1)
+#define BBOX_DUMP_SIZE      ((BBOX_SLOTS - 1) * BBOX_RECORD_SIZE)
+
+#define BBOX_SAMPLES_PER_HOUR   3600    // BBOX_sample() is called every second
+#define BBOX_KEY_INTERVAL       8       // summaries between absolute ones
+#define BBOX_RPM_SHIFT          5       // summary RPM in units of 32
+#define BBOX_DC_SHIFT           7       // summary duty cycle in 1/256
+
+/* each record is four words:
+ *  [type:4][detail:4][check:8] [run hour] [value or payload] [payload]
+ * the check is a CRC-8 over the other seven bytes.  A header of 0xffff is
+ * an erased slot, and the slot after the newest record is always erased so
+ * that the ring can be walked from its oldest record after a reset.  Types
+ * start at 1 so that a cleared slot reads as empty too. */
+typedef enum {
+    eBBOX_RESET = 1,    // detail 1 if warm, value the RCON flags
+    eBBOX_STALL,        // detail the fan, value its duty cycle
+    eBBOX_INPUT_LOSS,   // the motherboard source lapsed, value the last input
+    eBBOX_CHECK_FAIL,   // records found corrupt at start-up, detail their count, value the first slot
+    eBBOX_KEY_RPM,      // summary: mean RPM of each fan in a byte each
+    eBBOX_KEY_DC,       // summary: mean duty cycle of each fan in a byte each
+    eBBOX_DELTA,        // summary: RPM then duty cycle changes as signed nibbles
+    eBBOX_NUM_OF_TYPES
+}BboxType;
+
+/* the summary that deltas are applied to */
+typedef struct {
+    uint8_t haveRpm;
+    uint8_t haveDc;
+    uint8_t rpm[NUM_OF_FANS];
+    uint8_t dc[NUM_OF_FANS];
+}BboxState;
+
+typedef struct {
+    BboxType type;
+    uint8_t detail;
+    uint16_t hour;
+    uint16_t value;
+    uint8_t valid;              // the check passed
+    uint8_t complete;           // a summary with both halves known
+    uint16_t rpm[NUM_OF_FANS];
+    q15_t dc[NUM_OF_FANS];
+}BboxRecord;
+
+#if BLACKBOX_ENABLED
+/* finds the newest record and the run hour, logs any corrupt records */
+void BBOX_init(void);
+
+/* queues an event, the records are written by BBOX_service() a word at a
+ * time so that the fan task is never held up by the EEPROM */
+void BBOX_event(BboxType type, uint8_t detail, uint16_t value);
+void BBOX_sample(const q15_t *dc, const uint16_t *rpm);
+void BBOX_service(void);
+
+/* holds the queued records back so that a dump is consistent */
+void BBOX_freeze(uint8_t freeze);
+
+uint16_t BBOX_getHour(void);
+uint16_t BBOX_getDropped(void);
+
+/* the ring from its oldest record, as little endian words */
+uint16_t BBOX_read(uint16_t offset, uint8_t *data, uint16_t length);
+#else
+#define BBOX_init()
+#define BBOX_event(type, detail, value)
+#define BBOX_sample(dc, rpm)
+#endif
+
+/* decodes one record of a dump, also used by the simulator; returns 0 at
+ * the end, erased slots are skipped */
+#if BLACKBOX_ENABLED || (!defined(__XC16) && !defined(XC16))
+uint8_t BBOX_decode(const uint8_t *data, uint16_t length, uint16_t *position,
+        BboxState *state, BboxRecord *record);
+#endif
+
+#endif
@@ -0,0 +1,217 @@
+#include "control.h"
+#include "curve.h"
+#include "eeprom.h"
+#include "fan.h"
+
+#define MAX_ERROR       8191                // RPM, keeps the products in 32 bits
+#define MAX_INTEGRAL    ((int32_t)32767 << CONTROL_KI_SHIFT)
+
+typedef struct {
+    TuneState state;
+    uint8_t fan;
+    uint32_t startTime;
+    uint32_t stateTime;
+    uint16_t setpoint;
+    uint16_t hysteresis;
+    uint8_t high;           // relay output
+    uint16_t peak;
+    uint16_t trough;
+    uint8_t rises;          // switches to the high output
+    uint32_t lastRise;
+    uint32_t periodSum;
+    uint32_t amplitudeSum;
+}Tune;
+
+static ControlGains gains[NUM_OF_FANS];
+static int32_t integral[NUM_OF_FANS];
+static uint8_t lastWindow[NUM_OF_FANS];    // of the reading last integrated
+static Tune tune = {eTUNE_IDLE};
+
+static void computeGains(void);
+
+void CONTROL_init(void){
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        uint16_t kp = EEPROM_read(CONTROL_GAINS_EEPROM + (i << 1));
+        uint16_t ki = EEPROM_read(CONTROL_GAINS_EEPROM + (i << 1) + 1);
+        
+        /* an erased or cleared pair has not been tuned */
+        if((kp == 0xffff) || (ki == 0xffff) || (kp == 0)){
+            kp = CONTROL_DEFAULT_KP;
+            ki = CONTROL_DEFAULT_KI;
+        }
+        gains[i].kp = kp;
+        gains[i].ki = ki;
+        integral[i] = 0;
+    }
+}
+
+const ControlGains *CONTROL_getGains(uint8_t fan){
+    return &gains[(fan < NUM_OF_FANS) ? fan : 0];
+}
+
+void CONTROL_reset(uint8_t fan, q15_t dc){
+    if(fan >= NUM_OF_FANS)
+        return;
+    
+    if(CURVE_isValid(fan))
+        integral[fan] = 0;
+    else
+        integral[fan] = (dc > 0) ? ((int32_t)dc << CONTROL_KI_SHIFT) : 0;
+    lastWindow[fan] = TACH_getWindow();
+}
+
+q15_t CONTROL_update(uint8_t fan, uint16_t targetRpm, uint16_t rpm){
+    if(fan >= NUM_OF_FANS)
+        return 0;
+    
+    int32_t error = (int32_t)targetRpm - (int32_t)rpm;
+    if(error > MAX_ERROR)
+        error = MAX_ERROR;
+    else if(error < -MAX_ERROR)
+        error = -MAX_ERROR;
+    
+    int32_t ff = CURVE_dutyCycleFor(fan, targetRpm);
+    int32_t p = (error * gains[fan].kp) >> CONTROL_KP_SHIFT;
+    int32_t step = error * gains[fan].ki;
+    q15_t minDc = CURVE_getSustainDc(fan);
+    
+    /* a reading already integrated only sets the proportional term */
+    uint8_t window = TACH_getWindow();
+    if(window == lastWindow[fan])
+        step = 0;
+    lastWindow[fan] = window;
+    
+    /* the integrator is held while the output is saturated in the
+     * direction it would move, so it does not wind up */
+    int32_t i = integral[fan];
+    int32_t dc = ff + p + (i >> CONTROL_KI_SHIFT);
+    if(!((dc >= 32767) && (step > 0)) && !((dc <= minDc) && (step < 0))){
+        if((step > 0) && (i > (MAX_INTEGRAL - step)))
+            i = MAX_INTEGRAL;
+        else if((step < 0) && (i < (-MAX_INTEGRAL - step)))
+            i = -MAX_INTEGRAL;
+        else
+            i += step;
+        integral[fan] = i;
+        dc = ff + p + (i >> CONTROL_KI_SHIFT);
+    }
+    
+    if(dc > 32767)
+        dc = 32767;
+    else if(dc < minDc)
+        dc = minDc;
+    
+    return (q15_t)dc;
+}
+
+void CONTROL_startTune(uint8_t fan, uint32_t now){
+    tune.state = eTUNE_SETTLE;
+    tune.fan = fan;
+    tune.startTime = now;
+    tune.stateTime = now;
+}
+
+q15_t CONTROL_tune(uint32_t now, uint16_t rpm){
+    switch(tune.state){
+        case eTUNE_SETTLE:
+        {
+            if((now - tune.stateTime) < TUNE_SETTLE_TIME)
+                return (TUNE_DC_LOW + TUNE_DC_HIGH) >> 1;
+            
+            /* a fan that does not turn at the mid duty cycle cannot
+             * be tuned */
+            if(rpm == 0){
+                tune.state = eTUNE_FAILED;
+                return 0;
+            }
+            
+            tune.setpoint = rpm;
+            tune.hysteresis = rpm >> 5;
+            tune.high = 1;
+            tune.peak = tune.trough = rpm;
+            tune.rises = 0;
+            tune.periodSum = 0;
+            tune.amplitudeSum = 0;
+            tune.state = eTUNE_RELAY;
+            tune.stateTime = now;
+            
+            return TUNE_DC_HIGH;
+        }
+        
+        case eTUNE_RELAY:
+        {
+            if((now - tune.startTime) > TUNE_TIMEOUT){
+                tune.state = eTUNE_FAILED;
+                return 0;
+            }
+            
+            if(rpm > tune.peak)
+                tune.peak = rpm;
+            if(rpm < tune.trough)
+                tune.trough = rpm;
+            
+            if(tune.high && (rpm > (tune.setpoint + tune.hysteresis))){
+                tune.high = 0;
+            }else if(!tune.high && (rpm < (tune.setpoint - tune.hysteresis))){
+                /* a full cycle runs from one switch to the high output
+                 * to the next, the first is only part of a cycle */
+                tune.high = 1;
+                if(tune.rises > 0){
+                    tune.periodSum += now - tune.lastRise;
+                    tune.amplitudeSum += tune.peak - tune.trough;
+                }
+                tune.rises++;
+                tune.lastRise = now;
+                tune.peak = tune.trough = rpm;
+                
+                if(tune.rises > TUNE_CYCLES){
+                    computeGains();
+                    return 0;
+                }
+            }
+            
+            return tune.high ? TUNE_DC_HIGH : TUNE_DC_LOW;
+        }
+        
+        default:
+            return 0;
+    }
+}
+
+TuneState CONTROL_getTuneState(void){
+    return tune.state;
+}
+
+void CONTROL_endTune(void){
+    tune.state = eTUNE_IDLE;
+}
+
+/* the relay of amplitude d gives an oscillation of amplitude a at the
+ * ultimate period Tu, and the ultimate gain is 4d / (pi a); the
+ * Tyreus-Luyben rule, kp = Ku / 3.2 and Ti = 2.2 Tu, trades a slower
+ * response for little overshoot */
+static void computeGains(void){
+    uint32_t period = tune.periodSum / TUNE_CYCLES;                 // ms
+    uint32_t amplitude = tune.amplitudeSum / (2 * TUNE_CYCLES);     // RPM
+    
+    if((period == 0) || (amplitude == 0)){
+        tune.state = eTUNE_FAILED;
+        return;
+    }
+    
+    /* kp = 4 / (pi * 3.2) * d / a with 8 fractional bits, 102 / 256 */
+    uint32_t d = (TUNE_DC_HIGH - TUNE_DC_LOW) >> 1;
+    uint32_t kp = (d * 102) / amplitude;
+    if(kp > 0xffff)
+        kp = 0xffff;
+    
+    /* ki = kp * CONTROL_PERIOD / Ti, from 8 to 12 fractional bits */
+    uint32_t ki = (kp * ((160UL * CONTROL_PERIOD) / 22)) / period;
+    if(ki > 0xffff)
+        ki = 0xffff;
+    
+    gains[tune.fan].kp = (uint16_t)kp;
+    gains[tune.fan].ki = (uint16_t)ki;
+    tune.state = eTUNE_DONE;
+}
@@ -0,0 +1,61 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdint.h>
+#include "libmathq15.h"
+#include "tach.h"
+
+/* closed-loop RPM control for fans given an RPM target, with gains found
+ * per fan by a relay-feedback experiment; the loop runs with the fan state
+ * task, but the RPM is only measured once a tach window, so the integrator
+ * only moves on a new reading */
+#define CONTROL_PERIOD          TACH_WINDOW_MS  // ms between integrator steps
+#define CONTROL_GAINS_EEPROM    0x20    // kp then ki for each fan in turn
+
+/* kp is q15 duty cycle per RPM of error with CONTROL_KP_SHIFT fractional
+ * bits, ki is the same per CONTROL_PERIOD with CONTROL_KI_SHIFT; the
+ * defaults suit a fan of about 2400 RPM at full duty, settling in a few
+ * seconds, and faster fans settle sooner */
+#define CONTROL_KP_SHIFT        8
+#define CONTROL_KI_SHIFT        12
+#ifndef CONTROL_DEFAULT_KP
+#define CONTROL_DEFAULT_KP      2800
+#endif
+#ifndef CONTROL_DEFAULT_KI
+#define CONTROL_DEFAULT_KI      16000
+#endif
+
+/* relay experiment: the fan settles at the mid duty cycle to find its
+ * setpoint, then the duty cycle switches between the two limits as the
+ * RPM crosses it; the cycles after the first are measured */
+#define TUNE_DC_LOW             9830    // 30%
+#define TUNE_DC_HIGH            22938   // 70%
+#define TUNE_SETTLE_TIME        5000    // ms
+#define TUNE_CYCLES             4
+#define TUNE_TIMEOUT            90000   // ms for the whole experiment
+
+typedef enum {eTUNE_IDLE, eTUNE_SETTLE, eTUNE_RELAY, eTUNE_DONE, eTUNE_FAILED} TuneState;
+
+typedef struct {
+    uint16_t kp;
+    uint16_t ki;
+}ControlGains;
+
+void CONTROL_init(void);
+const ControlGains *CONTROL_getGains(uint8_t fan);
+
+/* the duty cycle is the feed-forward from the fan's curve for the target
+ * plus the PI correction; a fan without a curve has no feed-forward and
+ * its integrator starts from the duty cycle the fan is running at */
+void CONTROL_reset(uint8_t fan, q15_t dc);
+q15_t CONTROL_update(uint8_t fan, uint16_t targetRpm, uint16_t rpm);
+
+/* one fan is tuned at a time: CONTROL_tune() is called every run of the
+ * fan state task and returns the duty cycle for the fan until the state
+ * is eTUNE_DONE, when the new gains are in place, or eTUNE_FAILED */
+void CONTROL_startTune(uint8_t fan, uint32_t now);
+q15_t CONTROL_tune(uint32_t now, uint16_t rpm);
+TuneState CONTROL_getTuneState(void);
+void CONTROL_endTune(void);
+
+#endif
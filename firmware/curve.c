@@ -0,0 +1,285 @@
+#include "curve.h"
+#include "eeprom.h"
+#include "fan.h"
+
+typedef struct {
+    CurveState state;
+    uint8_t fan;
+    uint32_t startTime;
+    uint32_t stateTime;
+    uint16_t wait;          // ms at the current step
+    q15_t dc;
+    uint8_t point;
+    uint16_t lastRpm;
+    uint8_t startDc;        // results, kept until the sweep is done
+    uint8_t sustainDc;
+    uint8_t points[CURVE_POINTS];
+}Sweep;
+
+/* duty cycles in 1/256 of full scale as they are saved */
+static uint8_t startDc[NUM_OF_FANS];
+static uint8_t sustainDc[NUM_OF_FANS];
+static uint8_t points[NUM_OF_FANS][CURVE_POINTS];
+static uint8_t valid = 0;
+static uint32_t startTime[NUM_OF_FANS];
+static Sweep sweep = {eCURVE_IDLE};
+
+static q15_t pointDc(uint8_t point);
+static uint8_t toByte(int32_t dc);
+static void finish(q15_t lowestDc);
+
+void CURVE_init(void){
+    valid = 0;
+
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        uint16_t address = CURVE_EEPROM + (i * CURVE_WORDS);
+        uint16_t limits = EEPROM_read(address);
+
+        /* an erased or cleared record has not been swept */
+        if((limits == 0xffff) || (limits == 0))
+            continue;
+
+        startDc[i] = limits >> 8;
+        sustainDc[i] = limits & 0xff;
+
+        uint8_t j;
+        for(j = 0; j < CURVE_POINTS; j += 2){
+            uint16_t pair = EEPROM_read(address + 1 + (j >> 1));
+            points[i][j] = pair & 0xff;
+            points[i][j + 1] = pair >> 8;
+        }
+
+        valid |= 1 << i;
+    }
+}
+
+q15_t CURVE_getStartDc(uint8_t fan){
+    if(!CURVE_isValid(fan))
+        return MIN_FAN_DC;
+
+    return (q15_t)startDc[fan] << CURVE_DC_SHIFT;
+}
+
+q15_t CURVE_getSustainDc(uint8_t fan){
+    if(!CURVE_isValid(fan))
+        return MIN_FAN_DC;
+
+    return (q15_t)sustainDc[fan] << CURVE_DC_SHIFT;
+}
+
+uint8_t CURVE_isValid(uint8_t fan){
+    return (fan < NUM_OF_FANS) && (valid & (1 << fan));
+}
+
+uint16_t CURVE_getPointRpm(uint8_t fan, uint8_t point){
+    if(!CURVE_isValid(fan) || (point >= CURVE_POINTS))
+        return 0;
+
+    return (uint16_t)points[fan][point] << CURVE_RPM_SHIFT;
+}
+
+q15_t CURVE_kick(uint8_t fan, q15_t dc, q15_t lastDc, uint32_t now){
+    if(!CURVE_isValid(fan) || (dc == 0))
+        return dc;
+
+    /* the tach of a coasting fan says nothing of whether it would start,
+     * so the kick is timed from the duty cycle alone */
+    if(lastDc < CURVE_getSustainDc(fan))
+        startTime[fan] = now;
+
+    if(((now - startTime[fan]) < CURVE_START_TIME) && (dc < CURVE_getStartDc(fan)))
+        return CURVE_getStartDc(fan);
+
+    return dc;
+}
+
+q15_t CURVE_dutyCycleFor(uint8_t fan, uint16_t rpm){
+    if(!CURVE_isValid(fan) || (rpm == 0))
+        return 0;
+
+    /* from the origin through each point that is faster than the one
+     * before it; a point at which the fan stopped moves the origin */
+    uint16_t lowRpm = 0;
+    q15_t lowDc = 0;
+
+    uint8_t i;
+    for(i = 0; i < CURVE_POINTS; i++){
+        uint16_t pointRpm = (uint16_t)points[fan][i] << CURVE_RPM_SHIFT;
+        q15_t dc = pointDc(i);
+
+        if(pointRpm == 0){
+            lowDc = dc;
+            continue;
+        }
+        if(pointRpm <= lowRpm)
+            continue;
+
+        if(rpm <= pointRpm)
+            return lowDc + (q15_t)(((uint32_t)(dc - lowDc) * (rpm - lowRpm)) / (pointRpm - lowRpm));
+
+        lowRpm = pointRpm;
+        lowDc = dc;
+    }
+
+    return 32767;
+}
+
+void CURVE_startSweep(uint8_t fan, uint32_t now){
+    sweep.state = eCURVE_STOP;
+    sweep.fan = fan;
+    sweep.startTime = now;
+    sweep.stateTime = now;
+}
+
+q15_t CURVE_sweep(uint32_t now, uint16_t rpm){
+    if((sweep.state != eCURVE_IDLE) && (sweep.state != eCURVE_DONE)
+            && ((now - sweep.startTime) > CURVE_TIMEOUT)){
+        sweep.state = eCURVE_FAILED;
+    }
+
+    switch(sweep.state){
+        case eCURVE_STOP:
+        {
+            if(((now - sweep.stateTime) < CURVE_STOP_TIME) || (rpm > 0))
+                return 0;
+
+            sweep.dc = CURVE_SEARCH_STEP;
+            sweep.state = eCURVE_START;
+            sweep.stateTime = now;
+
+            return sweep.dc;
+        }
+
+        case eCURVE_START:
+        {
+            if((now - sweep.stateTime) < CURVE_DWELL_TIME)
+                return sweep.dc;
+
+            if(rpm > 0){
+                /* points from the top down, the fan keeps turning below
+                 * the duty cycle it started at */
+                sweep.startDc = toByte((int32_t)sweep.dc + CURVE_MARGIN);
+                sweep.point = CURVE_POINTS - 1;
+                sweep.dc = pointDc(sweep.point);
+                sweep.wait = 2 * CURVE_SETTLE_TIME;     // the longest step
+                sweep.state = eCURVE_POINTS;
+            }else if(sweep.dc >= CURVE_SEARCH_LIMIT){
+                sweep.state = eCURVE_FAILED;
+                return 0;
+            }else{
+                sweep.dc += CURVE_SEARCH_STEP;
+            }
+            sweep.stateTime = now;
+
+            return sweep.dc;
+        }
+
+        case eCURVE_POINTS:
+        {
+            if((now - sweep.stateTime) < sweep.wait)
+                return sweep.dc;
+
+            uint16_t point = rpm >> CURVE_RPM_SHIFT;
+            sweep.points[sweep.point] = (point > 0xff) ? 0xff : (uint8_t)point;
+
+            if(sweep.point > 0){
+                sweep.point--;
+                sweep.dc = pointDc(sweep.point);
+                sweep.wait = CURVE_SETTLE_TIME;
+            }else{
+                /* settle at the start duty cycle, a fan that stopped at
+                 * the lowest point starts again from there */
+                sweep.dc = (q15_t)sweep.startDc << CURVE_DC_SHIFT;
+                sweep.wait = CURVE_SETTLE_TIME;
+                sweep.lastRpm = 0;
+                sweep.state = eCURVE_SUSTAIN;
+            }
+            sweep.stateTime = now;
+
+            return sweep.dc;
+        }
+
+        case eCURVE_SUSTAIN:
+        {
+            if((now - sweep.stateTime) < sweep.wait)
+                return sweep.dc;
+
+            /* a fan that has stopped is still coasting down, well below
+             * the RPM of the step before */
+            if((rpm == 0) || (rpm < ((sweep.lastRpm >> 1) + (sweep.lastRpm >> 2)))){
+                if(sweep.lastRpm == 0){
+                    sweep.state = eCURVE_FAILED;
+                    return 0;
+                }
+
+                finish(sweep.dc + CURVE_SEARCH_STEP);
+                return 0;
+            }
+
+            if(sweep.dc <= CURVE_SEARCH_STEP){
+                finish(sweep.dc);
+                return 0;
+            }
+
+            sweep.lastRpm = rpm;
+            sweep.dc -= CURVE_SEARCH_STEP;
+            sweep.wait = CURVE_DWELL_TIME;
+            sweep.stateTime = now;
+
+            return sweep.dc;
+        }
+
+        default:
+            return 0;
+    }
+}
+
+CurveState CURVE_getSweepState(void){
+    return sweep.state;
+}
+
+void CURVE_endSweep(void){
+    sweep.state = eCURVE_IDLE;
+}
+
+uint16_t CURVE_getWord(uint8_t fan, uint8_t index){
+    if(!CURVE_isValid(fan) || (index >= CURVE_WORDS))
+        return 0xffff;
+
+    if(index == 0)
+        return ((uint16_t)startDc[fan] << 8) | sustainDc[fan];
+
+    uint8_t j = (index - 1) << 1;
+    return ((uint16_t)points[fan][j + 1] << 8) | points[fan][j];
+}
+
+static q15_t pointDc(uint8_t point){
+    return (point >= (CURVE_POINTS - 1)) ? 32767 : (q15_t)((point + 1) * CURVE_POINT_DC);
+}
+
+/* rounded up so that the saved duty cycle is never below the one found */
+static uint8_t toByte(int32_t dc){
+    dc = (dc + (1 << CURVE_DC_SHIFT) - 1) >> CURVE_DC_SHIFT;
+
+    return (dc > 0xff) ? 0xff : (uint8_t)dc;
+}
+
+/* the lowest duty cycle at which the fan kept turning ends the sweep */
+static void finish(q15_t lowestDc){
+    uint8_t fan = sweep.fan;
+
+    sweep.sustainDc = toByte((int32_t)lowestDc + CURVE_MARGIN);
+    if(sweep.sustainDc > sweep.startDc)
+        sweep.sustainDc = sweep.startDc;
+
+    startDc[fan] = sweep.startDc;
+    sustainDc[fan] = sweep.sustainDc;
+
+    uint8_t i;
+    for(i = 0; i < CURVE_POINTS; i++)
+        points[fan][i] = sweep.points[i];
+
+    valid |= 1 << fan;
+    sweep.state = eCURVE_DONE;
+}
@@ -0,0 +1,68 @@
+#ifndef CURVE_H
+#define CURVE_H
+
+#include <stdint.h>
+#include "libmathq15.h"
+
+/* per-fan characterization: the lowest duty cycles at which each fan
+ * starts and keeps turning, and its RPM at evenly spaced duty cycles */
+#define CURVE_EEPROM            0x30    // CURVE_WORDS for each fan in turn
+#define CURVE_WORDS             5
+#define CURVE_POINTS            8       // RPM at 1/8, 2/8 ... 8/8 duty cycle
+#define CURVE_POINT_DC          4096
+#define CURVE_RPM_SHIFT         5       // a point holds RPM / 32 in a byte
+
+/* the duty cycles are kept in EEPROM to 1/256 of full scale */
+#define CURVE_DC_SHIFT          7
+
+#define CURVE_START_TIME        2000    // ms at the start duty cycle
+
+/* sweep: the fan is stopped and the duty cycle raised until it starts,
+ * the points are taken on the way down from full speed and the duty
+ * cycle then lowered from the start duty cycle until the fan stops */
+#define CURVE_SEARCH_STEP       328     // 1%
+#define CURVE_SEARCH_LIMIT      16384   // a fan that has not started by 50% is missing
+#define CURVE_MARGIN            655     // 2% added to the duty cycles found
+#define CURVE_STOP_TIME         2000    // ms for the fan to stop before the search
+#define CURVE_DWELL_TIME        1000    // ms at each search step, two tach windows
+#define CURVE_SETTLE_TIME       4000    // ms at each point
+#define CURVE_TIMEOUT           180000  // ms for the whole sweep
+
+typedef enum {
+    eCURVE_IDLE,
+    eCURVE_STOP,
+    eCURVE_START,
+    eCURVE_POINTS,
+    eCURVE_SUSTAIN,
+    eCURVE_DONE,
+    eCURVE_FAILED
+}CurveState;
+
+void CURVE_init(void);
+
+/* fans that have not been characterized start and run at MIN_FAN_DC and
+ * have no curve, so CURVE_dutyCycleFor() returns 0 for them */
+q15_t CURVE_getStartDc(uint8_t fan);
+q15_t CURVE_getSustainDc(uint8_t fan);
+uint8_t CURVE_isValid(uint8_t fan);
+uint16_t CURVE_getPointRpm(uint8_t fan, uint8_t point);
+
+/* a fan that was off, lastDc being the duty cycle last applied to it, runs
+ * at no less than its start duty cycle for CURVE_START_TIME from when it is
+ * turned on; returns the duty cycle to apply */
+q15_t CURVE_kick(uint8_t fan, q15_t dc, q15_t lastDc, uint32_t now);
+
+/* duty cycle expected to give the RPM, interpolated between the points */
+q15_t CURVE_dutyCycleFor(uint8_t fan, uint16_t rpm);
+
+/* one fan is swept at a time: CURVE_sweep() is called every control period
+ * and returns the duty cycle for the fan until the state is eCURVE_DONE,
+ * when the new values are in place and CURVE_getWord() gives the record
+ * to save, or eCURVE_FAILED */
+void CURVE_startSweep(uint8_t fan, uint32_t now);
+q15_t CURVE_sweep(uint32_t now, uint16_t rpm);
+CurveState CURVE_getSweepState(void);
+void CURVE_endSweep(void);
+uint16_t CURVE_getWord(uint8_t fan, uint8_t index);
+
+#endif
@@ -2,6 +2,7 @@
 #define _DIO_H
 
 #include <stdint.h>
+#include <xc.h>
 
 typedef enum port{DIO_PORT_A, DIO_PORT_B}Port;
 
@@ -14,4 +15,45 @@ uint8_t DIO_readPin(Port port, uint8_t pin);
 void DIO_setPin(Port port, uint8_t pin);
 void DIO_clearPin(Port port, uint8_t pin);
 
+/* pins known at compile time are described by their port letter and number,
+ * for instance
+ *
+ *     #define SWITCH_PIN  B, 3
+ *
+ * and the macros below resolve to the register bit itself, a single bset,
+ * bclr or btst, where the functions above must build a mask and select the
+ * port at run time */
+#define DIO_READ(pin)               DIO_READ_(pin)
+#define DIO_SET(pin)                DIO_SET_(pin)
+#define DIO_CLEAR(pin)              DIO_CLEAR_(pin)
+#define DIO_WRITE(pin, value)       DIO_WRITE_(pin, value)
+
+#define DIO_MAKE_INPUT(pin)         DIO_MAKE_INPUT_(pin)
+#define DIO_MAKE_OUTPUT(pin)        DIO_MAKE_OUTPUT_(pin)
+#define DIO_MAKE_ANALOG(pin)        DIO_MAKE_ANALOG_(pin)
+#define DIO_MAKE_DIGITAL(pin)       DIO_MAKE_DIGITAL_(pin)
+
+/* several pins of one port in a single access: the port of a pin is read
+ * whole and each pin then picked out of the value */
+#define DIO_READ_PORT(pin)          DIO_READ_PORT_(pin)
+#define DIO_BIT(value, pin)         DIO_BIT_(value, pin)
+#define DIO_MASK(pin)               DIO_MASK_(pin)
+#define DIO_WRITE_PORT(pin, mask, value)    DIO_WRITE_PORT_(pin, mask, value)
+
+/* the descriptor is only split into its port and number once expanded */
+#define DIO_READ_(port, n)          (PORT##port##bits.R##port##n)
+#define DIO_SET_(port, n)           (LAT##port##bits.LAT##port##n = 1)
+#define DIO_CLEAR_(port, n)         (LAT##port##bits.LAT##port##n = 0)
+#define DIO_WRITE_(port, n, value)  (LAT##port##bits.LAT##port##n = (value))
+
+#define DIO_MAKE_INPUT_(port, n)    (TRIS##port##bits.TRIS##port##n = 1)
+#define DIO_MAKE_OUTPUT_(port, n)   (TRIS##port##bits.TRIS##port##n = 0)
+#define DIO_MAKE_ANALOG_(port, n)   (ANS##port |= (1 << (n)))     // not every pin has an ANS bit
+#define DIO_MAKE_DIGITAL_(port, n)  (ANS##port &= ~(1 << (n)))
+
+#define DIO_READ_PORT_(port, n)     (PORT##port)
+#define DIO_BIT_(value, port, n)    (((value) >> (n)) & 1)
+#define DIO_MASK_(port, n)          (1 << (n))
+#define DIO_WRITE_PORT_(port, n, mask, value)   (LAT##port = (LAT##port & ~(mask)) | ((value) & (mask)))
+
 #endif
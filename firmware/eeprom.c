@@ -1,34 +1,67 @@
 #include "eeprom.h"
 #include <xc.h>
+#include "profile.h"
 
 uint16_t __attribute__((space(eedata))) eedata[__EEDATA_LENGTH >> 1];
 
-void EEPROM_erase(uint16_t address){
-    NVMCON = 0x4058;
+/* a non-blocking write is an erase followed by a write, the second
+ * operation is started from EEPROM_busy() once the first completes */
+static uint8_t pendingOp = 0;   // 0 = none, 1 = erasing, 2 = writing
+static uint16_t pendingAddress;
+static uint16_t pendingValue;
+
+static void startNvm(uint16_t nvmcon, uint16_t address, uint16_t value);
+
+static void startNvm(uint16_t nvmcon, uint16_t address, uint16_t value){
+    NVMCON = nvmcon;
     
     /* Set up a pointer to the EEPROM location to be written */
     TBLPAG = __builtin_tblpage(eedata);
     uint16_t offset = __builtin_tbloffset(eedata) + (address << 1);
-    __builtin_tblwtl(offset, offset);
+    __builtin_tblwtl(offset, value);
     
     asm volatile ("disi #5");
     __builtin_write_NVM();
+}
+
+void EEPROM_erase(uint16_t address){
+    startNvm(0x4058, address, address);
     while(NVMCONbits.WR == 1);  // wait for write sequence to complete
 }
 
 void EEPROM_write(uint16_t address, uint16_t value){
+    PROFILE_BEGIN(ePROF_EEPROM_WRITE);
+    
+    while(EEPROM_busy());       // finish a non-blocking write first
     EEPROM_erase(address);
     
-    NVMCON = 0x4004;
+    startNvm(0x4004, address, value);
+    while(NVMCONbits.WR == 1);  // wait for write sequence to complete
     
-    /* Set up a pointer to the EEPROM location to be written */
-    TBLPAG = __builtin_tblpage(eedata);
-    uint16_t offset = __builtin_tbloffset(eedata) + (address << 1);
-    __builtin_tblwtl(offset, value);
+    PROFILE_END(ePROF_EEPROM_WRITE);
+}
+
+void EEPROM_startWrite(uint16_t address, uint16_t value){
+    while(EEPROM_busy());       // only one write may be in progress
     
-    asm volatile ("disi #5");
-    __builtin_write_NVM();
-    while(NVMCONbits.WR == 1);  // wait for write sequence to complete
+    pendingAddress = address;
+    pendingValue = value;
+    pendingOp = 1;
+    startNvm(0x4058, address, address);
+}
+
+uint8_t EEPROM_busy(void){
+    if(NVMCONbits.WR == 1)
+        return 1;
+    
+    if(pendingOp == 1){
+        pendingOp = 2;
+        startNvm(0x4004, pendingAddress, pendingValue);
+        return 1;
+    }
+    
+    pendingOp = 0;
+    return 0;
 }
 
 uint16_t EEPROM_read(uint16_t address){
@@ -7,4 +7,9 @@ void EEPROM_erase(uint16_t address);
 void EEPROM_write(uint16_t address, uint16_t value);
 uint16_t EEPROM_read(uint16_t address);
 
+/* starts a write and returns, EEPROM_busy() must then be polled until it
+ * returns 0 as it also sequences the write after the erase */
+void EEPROM_startWrite(uint16_t address, uint16_t value);
+uint8_t EEPROM_busy(void);
+
 #endif
@@ -0,0 +1,246 @@
+#include "expander.h"
+#include "i2c.h"
+#include "task.h"
+
+#if EXPANDER_ENABLED
+#define EXP_CONFIG_LENGTH   (1 + 2 * EXP_CHANNELS_PER_DEVICE)
+#define EXP_FRAME_LENGTH    (1 + 2 * EXP_CHANNELS_PER_DEVICE)
+
+typedef enum {eEXP_IDLE, eEXP_CONFIG, eEXP_BURST, eEXP_POINT, eEXP_READ} ExpStep;
+
+typedef struct {
+    uint8_t channels;       // in use, from the first
+    uint8_t configured;
+    uint8_t pending;        // the frame holds duty cycles not yet sent
+    uint8_t missed;
+    uint8_t stalled;
+    uint8_t frame[EXP_FRAME_LENGTH];    // register pointer and PWMOUT words
+}Expander;
+
+static Expander expanders[EXP_DEVICES];
+
+/* background */
+static uint16_t staged[EXP_MAX_CHANNELS];
+
+/* written by the I2C interrupt */
+static uint16_t rpm[EXP_MAX_CHANNELS];
+static uint16_t turningAt[EXP_MAX_CHANNELS];
+static volatile uint8_t busy = 0;       // a chain of transfers is running
+static ExpStep step = eEXP_IDLE;
+static uint8_t device;                  // of the transfer in progress
+static uint8_t skipped;                 // expanders that failed during the chain
+static uint8_t polled;
+static uint8_t pollDevice = EXP_DEVICES - 1;
+static uint8_t tachFrame[2 * EXP_CHANNELS_PER_DEVICE];
+
+static void run(void);
+static void transferDone(I2cStatus status);
+static void readTach(Expander *e, uint8_t first);
+
+void EXP_init(uint8_t channels){
+    uint8_t d, i;
+    for(d = 0; d < EXP_DEVICES; d++){
+        Expander *e = &expanders[d];
+        e->channels = (channels > EXP_CHANNELS_PER_DEVICE) ? EXP_CHANNELS_PER_DEVICE : channels;
+        channels -= e->channels;
+        e->configured = 0;
+        e->pending = 1;
+        e->missed = 0;
+        e->stalled = 0;
+
+        e->frame[0] = EXP_REG_PWMOUT;
+        for(i = 1; i < EXP_FRAME_LENGTH; i++)
+            e->frame[i] = 0;
+    }
+
+    for(i = 0; i < EXP_MAX_CHANNELS; i++){
+        rpm[i] = 0;
+        turningAt[i] = 0;
+    }
+
+    I2C_initMaster();
+}
+
+/* the duty cycle is only staged, EXP_flush() sends it */
+void EXP_set(uint8_t channel, q15_t dutyCycle){
+    if(channel >= EXP_MAX_CHANNELS)
+        return;
+
+    staged[channel] = (dutyCycle > 0) ? ((uint16_t)dutyCycle >> 6) : 0;
+}
+
+/* called once a control period: each expander whose duty cycles changed
+ * gets them all in one burst, then one expander in turn has its tach
+ * counts read; returns 0 when the bus was still busy with the previous
+ * period's transfers, which then send the changes too */
+uint8_t EXP_flush(void){
+    uint16_t lock = I2C_lock();
+
+    uint8_t d, i;
+    for(d = 0; d < EXP_DEVICES; d++){
+        Expander *e = &expanders[d];
+        const uint16_t *dc = &staged[d * EXP_CHANNELS_PER_DEVICE];
+
+        for(i = 0; i < e->channels; i++){
+            uint16_t word = dc[i] << EXP_PWM_SHIFT;
+            uint8_t *p = &e->frame[1 + (i << 1)];
+            if((p[0] != (uint8_t)(word >> 8)) || (p[1] != (uint8_t)word)){
+                p[0] = (uint8_t)(word >> 8);
+                p[1] = (uint8_t)word;
+                e->pending = 1;
+            }
+        }
+    }
+
+    uint8_t idle = !busy;
+    if(idle){
+        busy = 1;
+        skipped = 0;
+        polled = 0;
+    }
+    I2C_unlock(lock);
+
+    if(idle)
+        run();
+
+    return idle;
+}
+
+uint16_t EXP_getRpm(uint8_t channel){
+    if(channel >= EXP_MAX_CHANNELS)
+        return 0;
+
+    uint16_t lock = I2C_lock();
+    uint16_t r = rpm[channel];
+    I2C_unlock(lock);
+
+    return r;
+}
+
+/* bit n is set for expander n when a channel has stalled or the expander
+ * has stopped answering */
+uint8_t EXP_getFaults(void){
+    uint8_t faults = 0;
+    uint8_t d;
+
+    for(d = 0; d < EXP_DEVICES; d++){
+        const Expander *e = &expanders[d];
+        if(e->channels && (e->stalled || (e->missed >= EXP_MAX_MISSED)))
+            faults |= 1 << d;
+    }
+
+    return faults;
+}
+
+/* starts the next transfer of the chain, first from the background and
+ * then from each completion: the configurations, the bursts, and a read
+ * of the tach counts, a write of the register pointer and then the read */
+static void run(void){
+    uint8_t d;
+    uint8_t started = 0;
+
+    for(d = 0; (d < EXP_DEVICES) && !started; d++){
+        Expander *e = &expanders[d];
+        if((e->channels == 0) || (skipped & (1 << d)))
+            continue;
+
+        device = d;
+        if(!e->configured){
+            uint8_t config[EXP_CONFIG_LENGTH];
+            uint8_t i;
+            config[0] = EXP_REG_FAN_CONFIG;
+            for(i = 0; i < EXP_CHANNELS_PER_DEVICE; i++){
+                config[1 + i] = EXP_FAN_CONFIG_TACH;
+                config[1 + EXP_CHANNELS_PER_DEVICE + i] = EXP_FAN_DYNAMICS;
+            }
+            step = eEXP_CONFIG;
+            started = I2C_write(EXP_BASE_ADDRESS + d, config, EXP_CONFIG_LENGTH, &transferDone);
+        }else if(e->pending){
+            /* cleared as the frame is copied, so that a change made
+             * while it is on the bus is sent again */
+            e->pending = 0;
+            step = eEXP_BURST;
+            started = I2C_write(EXP_BASE_ADDRESS + d, e->frame, 1 + (e->channels << 1), &transferDone);
+            if(!started)
+                e->pending = 1;
+        }
+    }
+
+    /* the tach counts of one expander per period */
+    if(!started && !polled){
+        polled = 1;
+        for(d = 0; d < EXP_DEVICES; d++){
+            pollDevice = (pollDevice + 1 < EXP_DEVICES) ? (pollDevice + 1) : 0;
+            if(expanders[pollDevice].channels)
+                break;
+        }
+
+        uint8_t reg = EXP_REG_TACH_COUNT;
+        device = pollDevice;
+        step = eEXP_POINT;
+        started = I2C_write(EXP_BASE_ADDRESS + device, &reg, 1, &transferDone);
+    }
+
+    if(!started){
+        step = eEXP_IDLE;
+        busy = 0;
+    }
+}
+
+static void transferDone(I2cStatus status){
+    Expander *e = &expanders[device];
+    uint8_t ok = (status == eI2C_DONE);
+
+    if(ok){
+        e->missed = 0;
+    }else{
+        if(e->missed < EXP_MAX_MISSED)
+            e->missed++;
+        skipped |= 1 << device;
+    }
+
+    switch(step){
+        case eEXP_CONFIG:   e->configured = ok;                     break;
+        case eEXP_BURST:    e->pending |= !ok;                      break;
+        case eEXP_POINT:
+        {
+            if(ok){
+                step = eEXP_READ;
+                if(I2C_read(EXP_BASE_ADDRESS + device, tachFrame, e->channels << 1, &transferDone))
+                    return;
+            }
+            break;
+        }
+        case eEXP_READ:
+        {
+            if(ok)
+                readTach(e, device * EXP_CHANNELS_PER_DEVICE);
+            break;
+        }
+        default:                                                    break;
+    }
+
+    run();
+}
+
+/* a channel stalls once it has read stopped for the timeout while driven */
+static void readTach(Expander *e, uint8_t first){
+    uint16_t now = (uint16_t)TASK_getTime();
+    uint8_t stalled = 0;
+
+    uint8_t i;
+    for(i = 0; i < e->channels; i++){
+        uint8_t ch = first + i;
+        uint16_t count = (((uint16_t)tachFrame[i << 1] << 8) | tachFrame[(i << 1) + 1]) >> EXP_TACH_SHIFT;
+        rpm[ch] = ((count == 0) || (count >= EXP_TACH_FULL)) ? 0 : (uint16_t)(EXP_RPM_FACTOR / count);
+
+        uint8_t driven = e->frame[1 + (i << 1)] | e->frame[2 + (i << 1)];
+        if(!driven || (rpm[ch] != 0))
+            turningAt[ch] = now;
+        else if((uint16_t)(now - turningAt[ch]) > EXP_STALL_TIMEOUT)
+            stalled = 1;
+    }
+
+    e->stalled = stalled;
+}
+#endif
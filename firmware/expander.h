@@ -0,0 +1,59 @@
+#ifndef EXPANDER_H
+#define EXPANDER_H
+
+#include <stdint.h>
+#include "libmathq15.h"
+#include "sync.h"
+#include "smbus.h"
+
+/* PWM and tach expanders on I2C1, which takes the fan2 pins, driving fans
+ * beyond those of the board; each channel follows one of the board's fans */
+#ifndef EXPANDER_ENABLED
+#define EXPANDER_ENABLED    0
+#endif
+
+#if EXPANDER_ENABLED && (SYNC_ENABLED || SMBUS_ENABLED)
+#error "fan expanders, SMBus and chassis synchronization all need I2C1"
+#endif
+
+/* expanders laid out like the MAX31790, six channels each; channel n is
+ * channel n % 6 of the expander at EXP_BASE_ADDRESS + n / 6 */
+#ifndef EXP_DEVICES
+#define EXP_DEVICES         3
+#endif
+#define EXP_BASE_ADDRESS    0x20
+#define EXP_CHANNELS_PER_DEVICE 6
+#define EXP_MAX_CHANNELS    (EXP_DEVICES * EXP_CHANNELS_PER_DEVICE)
+#define EXP_MAX_MISSED      3       // transfers before an expander counts as lost
+
+/* registers: the fan configurations followed by the fan dynamics, then
+ * the tach counts and the target duty cycles, a big-endian word per
+ * channel and left justified */
+#define EXP_REG_FAN_CONFIG  0x02
+#define EXP_REG_TACH_COUNT  0x18
+#define EXP_REG_PWMOUT      0x40
+#define EXP_FAN_CONFIG_TACH 0x08    // PWM mode, tach input enabled
+#define EXP_FAN_DYNAMICS    0x0c    // a tach period a count, rate of change as at reset
+#define EXP_PWM_SHIFT       7       // 9-bit duty cycle
+#define EXP_TACH_SHIFT      5       // 11-bit count
+
+/* counts of the 8192Hz clock over a tach period at 2 pulses a revolution,
+ * RPM = EXP_RPM_FACTOR / count; a full count, under 120 RPM, reads as a
+ * stopped fan */
+#define EXP_RPM_FACTOR      245760UL
+#define EXP_TACH_FULL       0x7ff
+
+/* a driven channel that has read stopped for this long has stalled */
+#define EXP_STALL_TIMEOUT   3000    // ms
+
+#if EXPANDER_ENABLED
+void EXP_init(uint8_t channels);
+void EXP_set(uint8_t channel, q15_t dutyCycle);
+uint8_t EXP_flush(void);
+uint16_t EXP_getRpm(uint8_t channel);
+uint8_t EXP_getFaults(void);
+#else
+#define EXP_getFaults()     0
+#endif
+
+#endif
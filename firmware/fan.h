@@ -0,0 +1,23 @@
+#ifndef FAN_H
+#define FAN_H
+
+#include "sync.h"
+#include "smbus.h"
+#include "expander.h"
+
+/* definitions shared between the modules that deal with the fan channels */
+#define NUM_OF_FANS         4
+#ifndef MIN_FAN_DC
+#define MIN_FAN_DC          3277
+#endif
+
+/* fan2's pins carry I2C1 on boards that synchronize over it, answer on
+ * SMBus or drive fan expanders */
+#if SYNC_ENABLED || SMBUS_ENABLED || EXPANDER_ENABLED
+#define FAN_PRESENT_MASK    0x0b
+#else
+#define FAN_PRESENT_MASK    0x0f
+#endif
+#define FAN_PRESENT(fan)    ((FAN_PRESENT_MASK >> (fan)) & 1)
+
+#endif
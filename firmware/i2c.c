@@ -0,0 +1,312 @@
+#include "i2c.h"
+#include <xc.h>
+#include "dio.h"
+
+#define FCY 16000000UL
+
+#define SCL1_PIN    B, 8
+#define SDA1_PIN    B, 9
+
+typedef enum {
+    eMASTER_IDLE,
+    eMASTER_START,
+    eMASTER_ADDRESS,
+    eMASTER_WRITE,
+    eMASTER_RECEIVE,
+    eMASTER_ACK,
+    eMASTER_STOP
+}MasterState;
+
+typedef struct {
+    uint8_t length;
+    uint8_t data[I2C_MAX_LENGTH];
+}Response;
+
+static uint8_t isMaster = 0;
+
+/* master transfer */
+static volatile MasterState masterState = eMASTER_IDLE;
+static volatile I2cStatus status = eI2C_IDLE;
+static uint8_t address;
+static uint8_t reading;
+static uint8_t buffer[I2C_MAX_LENGTH];
+static uint8_t *destination;
+static uint8_t length;
+static uint8_t position;
+static void (*doneCallback)(I2cStatus status);
+
+/* follower */
+static void (*receivedCallback)(const uint8_t *data, uint8_t length);
+static Response response[2];
+static volatile uint8_t activeResponse = 0;
+static volatile uint8_t sendingResponse = 0xff;    // latched for the read in progress
+static uint8_t rxBuf[I2C_MAX_LENGTH];
+static uint8_t rxLength = 0;
+static uint8_t txIndex = 0;
+static uint8_t (*readHandler)(uint8_t reg, uint8_t first) = 0;
+static uint8_t pointer = 0;         // register pointer for the read handler
+static uint8_t generalCall = 0;
+
+static void initPins(void);
+static uint8_t start(uint8_t addr, uint8_t len, void (*done)(I2cStatus status));
+static void stop(I2cStatus result);
+static void masterInterrupt(void);
+static void followerInterrupt(void);
+
+static void initPins(void){
+    /* SCL1 on RB8 and SDA1 on RB9, the fan2 tach and PWM pins, which
+     * are given up to the bus on boards that synchronize */
+    DIO_MAKE_INPUT(SCL1_PIN);
+    DIO_MAKE_INPUT(SDA1_PIN);
+    DIO_CLEAR(SCL1_PIN);
+    DIO_CLEAR(SDA1_PIN);
+}
+
+void I2C_initMaster(void){
+    initPins();
+    isMaster = 1;
+    
+    SSP1CON1 = 0x0008;      // I2C master, clock = FCY / (2 * (SSP1ADD + 1))
+    SSP1CON2 = 0x0000;
+    SSP1CON3 = 0x0000;
+    SSP1STAT = 0x0000;
+    SSP1ADD = (FCY / (2UL * I2C_CLOCK)) - 1;
+    
+    IFS1bits.SSP1IF = 0;
+    IFS1bits.BCL1IF = 0;
+    IEC1bits.SSP1IE = 1;
+    IEC1bits.BCL1IE = 1;
+    
+    SSP1CON1bits.SSPEN = 1;
+}
+
+void I2C_initFollower(uint8_t addr, void (*received)(const uint8_t *data, uint8_t length)){
+    initPins();
+    isMaster = 0;
+    receivedCallback = received;
+    
+    SSP1CON1 = 0x0016;      // I2C follower, 7-bit address, clock released
+    SSP1CON2 = 0x0081;      // general call enabled, clock stretching
+    SSP1CON3 = 0x0040;      // interrupt on the stop condition
+    SSP1STAT = 0x0000;
+    SSP1ADD = addr << 1;
+    SSP1MSK = 0x00fe;
+    
+    IFS1bits.SSP1IF = 0;
+    IEC1bits.SSP1IE = 1;
+    
+    SSP1CON1bits.SSPEN = 1;
+}
+
+uint8_t I2C_write(uint8_t addr, const uint8_t *data, uint8_t len, void (*done)(I2cStatus status)){
+    if((len > I2C_MAX_LENGTH) || (masterState != eMASTER_IDLE))
+        return 0;
+    
+    uint8_t i;
+    for(i = 0; i < len; i++)
+        buffer[i] = data[i];
+    
+    reading = 0;
+    return start(addr, len, done);
+}
+
+uint8_t I2C_read(uint8_t addr, uint8_t *data, uint8_t len, void (*done)(I2cStatus status)){
+    if((len == 0) || (len > I2C_MAX_LENGTH) || (masterState != eMASTER_IDLE))
+        return 0;
+    
+    destination = data;
+    reading = 1;
+    return start(addr, len, done);
+}
+
+I2cStatus I2C_getStatus(void){
+    return status;
+}
+
+uint8_t I2C_setResponse(const uint8_t *data, uint8_t len){
+    uint16_t lock = I2C_lock();
+    
+    uint8_t spare = activeResponse ^ 1;
+    if(sendingResponse == spare){
+        I2C_unlock(lock);
+        return 0;
+    }
+    I2C_unlock(lock);
+    
+    /* the spare buffer is not visible to the interrupt until swapped */
+    if(len > I2C_MAX_LENGTH)
+        len = I2C_MAX_LENGTH;
+    uint8_t i;
+    for(i = 0; i < len; i++)
+        response[spare].data[i] = data[i];
+    response[spare].length = len;
+    
+    activeResponse = spare;
+    
+    return 1;
+}
+
+void I2C_setReadHandler(uint8_t (*readRegister)(uint8_t reg, uint8_t first)){
+    uint16_t lock = I2C_lock();
+    readHandler = readRegister;
+    I2C_unlock(lock);
+}
+
+uint8_t I2C_readInProgress(void){
+    return sendingResponse != 0xff;
+}
+
+uint16_t I2C_lock(void){
+    uint16_t ie = IEC1bits.SSP1IE;
+    IEC1bits.SSP1IE = 0;
+    
+    return ie;
+}
+
+void I2C_unlock(uint16_t lock){
+    IEC1bits.SSP1IE = lock;
+}
+
+static uint8_t start(uint8_t addr, uint8_t len, void (*done)(I2cStatus status)){
+    address = addr;
+    length = len;
+    position = 0;
+    doneCallback = done;
+    status = eI2C_BUSY;
+    
+    masterState = eMASTER_START;
+    SSP1CON2bits.SEN = 1;
+    
+    return 1;
+}
+
+static void stop(I2cStatus result){
+    status = result;
+    masterState = eMASTER_STOP;
+    SSP1CON2bits.PEN = 1;
+}
+
+static void masterInterrupt(void){
+    switch(masterState){
+        case eMASTER_START:
+        {
+            SSP1BUF = (address << 1) | reading;
+            masterState = eMASTER_ADDRESS;
+            break;
+        }
+        
+        case eMASTER_ADDRESS:
+        case eMASTER_WRITE:
+        {
+            /* a general call is acknowledged by any follower that hears it */
+            if(SSP1CON2bits.ACKSTAT){
+                stop(eI2C_NACK);
+            }else if(reading){
+                SSP1CON2bits.RCEN = 1;
+                masterState = eMASTER_RECEIVE;
+            }else if(position < length){
+                SSP1BUF = buffer[position++];
+                masterState = eMASTER_WRITE;
+            }else{
+                stop(eI2C_DONE);
+            }
+            break;
+        }
+        
+        case eMASTER_RECEIVE:
+        {
+            destination[position++] = SSP1BUF;
+            
+            /* the last byte is not acknowledged */
+            SSP1CON2bits.ACKDT = (position >= length);
+            SSP1CON2bits.ACKEN = 1;
+            masterState = eMASTER_ACK;
+            break;
+        }
+        
+        case eMASTER_ACK:
+        {
+            if(position < length){
+                SSP1CON2bits.RCEN = 1;
+                masterState = eMASTER_RECEIVE;
+            }else{
+                stop(eI2C_DONE);
+            }
+            break;
+        }
+        
+        case eMASTER_STOP:
+        {
+            masterState = eMASTER_IDLE;
+            if(doneCallback != 0)
+                (*doneCallback)(status);
+            break;
+        }
+        
+        default:
+            break;
+    }
+}
+
+static void followerInterrupt(void){
+    if(SSP1STATbits.P){
+        /* stop: a complete write is handed over */
+        if((rxLength > 0) && (receivedCallback != 0))
+            (*receivedCallback)(rxBuf, rxLength);
+        rxLength = 0;
+        sendingResponse = 0xff;
+    }else if(SSP1STATbits.D_A == 0){
+        /* our address or a general call */
+        generalCall = (SSP1BUF == 0);
+        rxLength = 0;
+        
+        if(SSP1STATbits.R_W){
+            sendingResponse = activeResponse;
+            txIndex = 0;
+            if(readHandler != 0){
+                SSP1BUF = (*readHandler)(pointer++, 1);
+            }else{
+                const Response *r = &response[sendingResponse];
+                SSP1BUF = (txIndex < r->length) ? r->data[txIndex++] : 0xff;
+            }
+        }
+    }else if(SSP1STATbits.R_W == 0){
+        uint8_t data = SSP1BUF;
+        
+        /* the first byte of an addressed write selects the register, and
+         * takes effect at once for a read after a repeated start */
+        if((rxLength == 0) && !generalCall)
+            pointer = data;
+        if(rxLength < I2C_MAX_LENGTH)
+            rxBuf[rxLength++] = data;
+    }else if(readHandler != 0){
+        SSP1BUF = (*readHandler)(pointer++, 0);
+    }else{
+        const Response *r = &response[sendingResponse];
+        SSP1BUF = (txIndex < r->length) ? r->data[txIndex++] : 0xff;
+    }
+    
+    SSP1CON1bits.CKP = 1;   // release the clock
+}
+
+void _ISR _MSSP1Interrupt(void){
+    IFS1bits.SSP1IF = 0;
+    
+    if(isMaster)
+        masterInterrupt();
+    else
+        followerInterrupt();
+}
+
+void _ISR _MSSP1BCInterrupt(void){
+    IFS1bits.BCL1IF = 0;
+    
+    /* another master or noise took the bus, abandon the transfer */
+    SSP1CON1bits.SSPEN = 0;
+    status = eI2C_ERROR;
+    masterState = eMASTER_IDLE;
+    SSP1CON1bits.SSPEN = 1;
+    
+    if(doneCallback != 0)
+        (*doneCallback)(status);
+}
@@ -0,0 +1,48 @@
+#ifndef I2C_H
+#define I2C_H
+
+#include <stdint.h>
+#include "expander.h"
+
+/* the 16 fan expander table takes up to 8.2ms of each 10ms control period
+ * at 100kHz, 2.0ms at 400kHz */
+#ifndef I2C_CLOCK
+#if EXPANDER_ENABLED
+#define I2C_CLOCK           400000UL
+#else
+#define I2C_CLOCK           100000UL
+#endif
+#endif
+#define I2C_MAX_LENGTH      16      // longest transfer in either direction
+#define I2C_GENERAL_CALL    0x00
+
+typedef enum {eI2C_IDLE, eI2C_BUSY, eI2C_DONE, eI2C_NACK, eI2C_ERROR} I2cStatus;
+
+/* master: transfers run from the MSSP1 interrupt and the callback, if any,
+ * is called from there when the transfer completes; a transfer is only
+ * started when the bus is free and then returns 1 */
+void I2C_initMaster(void);
+uint8_t I2C_write(uint8_t address, const uint8_t *data, uint8_t length, void (*done)(I2cStatus status));
+uint8_t I2C_read(uint8_t address, uint8_t *data, uint8_t length, void (*done)(I2cStatus status));
+I2cStatus I2C_getStatus(void);
+
+/* follower: received writes, including general calls, are passed to the
+ * callback from the interrupt once the stop condition arrives; reads by
+ * the master are answered from a double-buffered response that is swapped
+ * in whole, 0 is returned when a read still holds the spare buffer */
+void I2C_initFollower(uint8_t address, void (*received)(const uint8_t *data, uint8_t length));
+uint8_t I2C_setResponse(const uint8_t *data, uint8_t length);
+
+/* register-based followers (SMBus): the first byte of each addressed write
+ * sets the register pointer, and reads are answered a byte at a time by the
+ * handler from the pointer on, first being 1 for the first byte of a read;
+ * I2C_readInProgress() is 1 from then until the stop condition */
+void I2C_setReadHandler(uint8_t (*readRegister)(uint8_t reg, uint8_t first));
+uint8_t I2C_readInProgress(void);
+
+/* background code sharing data with the callbacks masks the interrupt
+ * around the access, the lock restores the previous state */
+uint16_t I2C_lock(void);
+void I2C_unlock(uint16_t lock);
+
+#endif
@@ -0,0 +1,116 @@
+#include "libfilterq15.h"
+
+/***************** local function declarations *****************/
+q15_t q15_saturate(int32_t value);
+
+/***************** function implementations *****************/
+void q15_ema_init(FilterEma *filter, q15_t alpha, q15_t initial){
+    filter->alpha = alpha;
+    filter->acc = (int32_t)initial << 15;
+}
+
+q15_t q15_ema_update(FilterEma *filter, q15_t sample){
+    /* the difference may be 17 bits wide, but alpha * diff still fits
+     * within 32 bits because alpha is always less than 1.0 */
+    int32_t diff = (int32_t)sample - (filter->acc >> 15);
+    filter->acc += (int32_t)filter->alpha * diff;
+
+    return q15_ema_value(filter);
+}
+
+q15_t q15_ema_value(FilterEma *filter){
+    /* round to the nearest value rather than truncating */
+    return q15_saturate((filter->acc + 0x4000) >> 15);
+}
+
+void q15_biquad_init(FilterBiquad *filter,
+        int16_t b0, int16_t b1, int16_t b2, int16_t a1, int16_t a2){
+    filter->b0 = b0;
+    filter->b1 = b1;
+    filter->b2 = b2;
+    filter->a1 = a1;
+    filter->a2 = a2;
+
+    q15_biquad_reset(filter, 0);
+}
+
+void q15_biquad_reset(FilterBiquad *filter, q15_t initial){
+    /* start in the steady state for a constant input, which is only
+     * exact for filters that have a DC gain of 1.0 */
+    filter->x1 = filter->x2 = initial;
+    filter->y1 = filter->y2 = initial;
+}
+
+q15_t q15_biquad_update(FilterBiquad *filter, q15_t sample){
+    int32_t acc;
+
+    acc = (int32_t)filter->b0 * sample;
+    acc += (int32_t)filter->b1 * filter->x1;
+    acc += (int32_t)filter->b2 * filter->x2;
+    acc -= (int32_t)filter->a1 * filter->y1;
+    acc -= (int32_t)filter->a2 * filter->y2;
+
+    /* Q14 coefficients, so round and shift by 14 */
+    q15_t output = q15_saturate((acc + 0x2000) >> 14);
+
+    filter->x2 = filter->x1;
+    filter->x1 = sample;
+    filter->y2 = filter->y1;
+    filter->y1 = output;
+
+    return output;
+}
+
+void q15_median_init(FilterMedian *filter, uint8_t size, q15_t initial){
+    /* only 3 and 5 are supported, anything else falls back to 3 */
+    if(size != 5)
+        size = 3;
+
+    filter->size = size;
+    filter->head = 0;
+
+    uint8_t i;
+    for(i = 0; i < MEDIAN_MAX_SIZE; i++){
+        filter->window[i] = initial;
+        filter->sorted[i] = initial;
+    }
+}
+
+q15_t q15_median_update(FilterMedian *filter, q15_t sample){
+    uint8_t size = filter->size;
+    q15_t oldest = filter->window[filter->head];
+    uint8_t i;
+
+    /* replace the oldest sample in the circular window */
+    filter->window[filter->head] = sample;
+    filter->head++;
+    if(filter->head >= size)
+        filter->head = 0;
+
+    /* find the oldest sample within the sorted array... */
+    for(i = 0; i < size; i++){
+        if(filter->sorted[i] == oldest)
+            break;
+    }
+
+    /* ...then slide the new sample into its place, moving
+     * toward whichever end keeps the array in order */
+    while((i > 0) && (filter->sorted[i - 1] > sample)){
+        filter->sorted[i] = filter->sorted[i - 1];
+        i--;
+    }
+    while((i < (size - 1)) && (filter->sorted[i + 1] < sample)){
+        filter->sorted[i] = filter->sorted[i + 1];
+        i++;
+    }
+    filter->sorted[i] = sample;
+
+    return filter->sorted[size >> 1];
+}
+
+q15_t q15_saturate(int32_t value){
+    if(value > 32767)           value = 32767;
+    else if(value < -32768)     value = -32768;
+
+    return (q15_t)value;
+}
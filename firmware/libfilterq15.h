@@ -0,0 +1,55 @@
+#ifndef _Q15_FILTER
+#define _Q15_FILTER
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "libmathq15.h"
+
+#define MEDIAN_MAX_SIZE 5
+
+/* first-order exponential moving average, y += alpha * (x - y)
+ *  the state is kept with 15 extra fractional bits so that small values
+ *  of alpha do not create a dead band around the output */
+typedef struct {
+    q15_t alpha;
+    int32_t acc;
+}FilterEma;
+
+/* direct-form I biquad, coefficients are in Q14 format so that values
+ * between -2.0 and +1.99994 may be represented:
+ *  y[n] = b0*x[n] + b1*x[n-1] + b2*x[n-2] - a1*y[n-1] - a2*y[n-2]
+ * the output saturates, but coefficient sets whose magnitudes sum to more
+ * than 4.0 may still overflow the 32-bit accumulator */
+typedef struct {
+    int16_t b0, b1, b2, a1, a2;
+    q15_t x1, x2, y1, y2;
+}FilterBiquad;
+
+/* running median of 3 or 5 samples */
+typedef struct {
+    uint8_t size;
+    uint8_t head;
+    q15_t window[MEDIAN_MAX_SIZE];  // samples in order of arrival
+    q15_t sorted[MEDIAN_MAX_SIZE];  // the same samples, sorted
+}FilterMedian;
+
+void q15_ema_init(FilterEma *filter, q15_t alpha, q15_t initial);
+q15_t q15_ema_update(FilterEma *filter, q15_t sample);
+q15_t q15_ema_value(FilterEma *filter);
+
+void q15_biquad_init(FilterBiquad *filter,
+        int16_t b0, int16_t b1, int16_t b2, int16_t a1, int16_t a2);
+void q15_biquad_reset(FilterBiquad *filter, q15_t initial);
+q15_t q15_biquad_update(FilterBiquad *filter, q15_t sample);
+
+void q15_median_init(FilterMedian *filter, uint8_t size, q15_t initial);
+q15_t q15_median_update(FilterMedian *filter, q15_t sample);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
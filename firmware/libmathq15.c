@@ -92,6 +92,12 @@
 
 #endif
 
+/* libmathq15_xc16.s interpolates the 8-bit table */
+#if (defined(__XC16) || defined(XC16)) && (defined(SINE_TABLE_4BIT) || defined(SINE_TABLE_5BIT) \
+        || defined(SINE_TABLE_6BIT) || defined(SINE_TABLE_7BIT))
+#error "q15_sin90() in libmathq15_xc16.s needs the 8-bit sine table"
+#endif
+
 const q16angle_t NINETY_DEG = 16384;
 const q16angle_t ONE_EIGHTY_DEG = 32768;
 const q16angle_t TWO_SEVENTY_DEG = 49152;
@@ -101,6 +107,10 @@ q15_t q15_sin90(q16angle_t theta);
 q15_t q15_fast_sin90(q16angle_t theta);
 
 /***************** function implementations *****************/
+/* the routines that libmathq15_xc16.s replaces on XC16 are left out there;
+ * elsewhere they are the bit-exact models that tools/q15check.py checks the
+ * assembly against */
+#if !LIBMATHQ15_NO_FLOAT
 double q15_to_dbl(q15_t num){
     return ((double)num)/((double)32768.0);
 }
@@ -109,17 +119,6 @@ float q15_to_float(q15_t num){
     return ((float)num)/((float)32768.0);
 }
 
-int16_t q15_to_int(q15_t num){
-    int16_t value = 0;
-
-    if(num > 16383)
-        value = 1;
-    else if(num < -16383)
-        value = -1;
-
-    return value;
-}
-
 q15_t q15_from_dbl(double num){
     q15_t value;
 
@@ -147,6 +146,18 @@ q15_t q15_from_float(float num){
 
     return value;
 }
+#endif
+
+int16_t q15_to_int(q15_t num){
+    int16_t value = 0;
+
+    if(num > 16383)
+        value = 1;
+    else if(num < -16383)
+        value = -1;
+
+    return value;
+}
 
 q15_t q15_from_int(int num){
     q15_t value = 0;
@@ -171,10 +182,14 @@ q15_t q15_mul(q15_t multiplicand, q15_t multiplier){
 #if !defined(__XC16) && !defined(XC16)
 q15_t q15_div(q15_t dividend, q15_t divisor){
     q15_t quotient;
+    
+    /* the magnitudes unsaturated, so that -32768 is 32768 */
+    uint16_t dividendMag = (dividend < 0) ? (uint16_t)-dividend : (uint16_t)dividend;
+    uint16_t divisorMag = (divisor < 0) ? (uint16_t)-divisor : (uint16_t)divisor;
 
     /* check to ensure dividend is smaller in magnitude
-     * than the divisor */
-    if((q15_abs(divisor) < q15_abs(dividend)) || (divisor == 0)){
+     * than the divisor, which also rules out a divisor of 0 */
+    if(divisorMag <= dividendMag){
         /* saturation: if signs are different,
          * then saturate negative */
 	if((divisor & 0x8000) ^ (dividend & 0x8000)){
@@ -183,7 +198,7 @@ q15_t q15_div(q15_t dividend, q15_t divisor){
 	    quotient = 32767;
 	}
     }else{
-        quotient = 32768 * dividend/divisor;
+        quotient = ((int32_t)dividend * 32768) / divisor;
     }
 
     return quotient;
@@ -218,6 +233,7 @@ q15_t q15_abs(q15_t num){
 }
 #endif
 
+#if !defined(__XC16) && !defined(XC16)
 q15_t q15_sqrt(q15_t num){
     q15_t value;
     if(num < 0){
@@ -240,6 +256,7 @@ q15_t q15_sqrt(q15_t num){
 
     return value;
 }
+#endif
 
 q15_t q15_sin(q16angle_t theta){
     q15_t value;
@@ -268,6 +285,7 @@ q15_t q15_sin(q16angle_t theta){
     return value;
 }
 
+#if !defined(__XC16) && !defined(XC16)
 /* a helper function for the sin that only works between 0 and 89.99 degrees (0 to 16383) */
 q15_t q15_sin90(q16angle_t theta){
     uint16_t value;
@@ -300,6 +318,7 @@ q15_t q15_sin90(q16angle_t theta){
 
     return value;
 }
+#endif
 
 q15_t q15_fast_sin(q16angle_t theta){
     q15_t value;
@@ -15,14 +15,22 @@ extern "C" {
 #undef SINE_TABLE_7BIT
 #undef SINE_TABLE_8BIT
 
+/* define LIBMATHQ15_NO_FLOAT as 1 to leave out the conversions to and from
+ * double and float, so that the soft-float routines are not linked in */
+#ifndef LIBMATHQ15_NO_FLOAT
+#define LIBMATHQ15_NO_FLOAT 0
+#endif
+
 typedef int16_t q15_t;
 typedef uint16_t q16angle_t;
 
+#if !LIBMATHQ15_NO_FLOAT
 double q15_to_dbl(q15_t num);
 float q15_to_float(q15_t num);
-int16_t q15_to_int(q15_t num);
 q15_t q15_from_dbl(double num);
 q15_t q15_from_float(float num);
+#endif
+int16_t q15_to_int(q15_t num);
 q15_t q15_from_int(int num);
 
 q15_t q15_mul(q15_t multiplicand, q15_t multiplier);
@@ -3,15 +3,26 @@
 ;   q15_div()
 ;   q15_add()
 ;   q15_abs()
+;   q15_sqrt()
+;   q15_sin90()
+;
+; each gives the same result as its C version in libmathq15.c for every
+; input, which tools/q15check.py checks by running this file on a model of
+; the instructions it uses; the cycles of each routine, from the call to
+; the return, are as it reports them
 
     .include "xc.inc"
 
-    .text
+    ; each function has a section of its own, so that the linker can
+    ; remove those that are not called (--gc-sections)
     .global _q15_mul
     .global _q15_div
     .global _q15_add
     .global _q15_abs
+    .global _q15_sqrt
+    .global _q15_sin90
     
+    .section .text.q15_mul, code
 _q15_mul:
     ; w3:w2 = w1 * w0
     mul.ss  w0, w1, w2
@@ -25,74 +36,38 @@ _q15_mul:
     
     return
     
+    .section .text.q15_div, code
 _q15_div:
-    ; w2 = w0
-    ; w3 = w1
-    mov	    w0, w2
-    mov	    w1, w3
-    
-    ; w4 = abs(w0)
-    call    _q15_abs
-    mov	    w0, w4
-    
-    ; w5 = abs(w1)
-    mov	    w3, w0
-    call    _q15_abs
-    mov	    w0, w5
-    
-    ; if w4 >= w5, then goto saturate
-    cpslt   w4, w5
-    goto    _q15_div_saturate
-    
-    ; if w2 == 0, then goto saturate
-    clr	    w4
-    cpsne   w4, w3
-    goto    _q15_div_saturate
-    
-    ; otherwise, arrange and goto divide
-    mov	    w2, w0
-    mov	    w3, w1
-    goto    _q15_div_div
-    
-_q15_div_saturate:
-    ; mask = 0x8000
-    mov	    #32768, w4
-    
-    ; w2 &= mask
-    and	    w2, w4, w2
-    
-    ; w3 &= mask
-    and	    w3, w4, w3
-    
-    ; w2 = w2 ^ w3
-    xor	    w2, w3, w2
-    
-    ; if w2 == 0, return 32767, otherwise, return -32768
-    mov	    #32767, w0
-    clr	    w1
-    cpseq   w2, w1
-    mov	    #32768, w0
+    ; w2 = abs(w0), w3 = abs(w1), unsaturated so that -32768 is 32768
+    mov     w0, w2
+    btsc    w0, #15
+    neg     w0, w2
+    mov     w1, w3
+    btsc    w1, #15
+    neg     w1, w3
+    
+    ; if w2 >= w3, which includes a divisor of 0, then goto saturate
+    cp      w2, w3
+    bra     geu, _q15_div_saturate
+    
+    ; w3:w2 = w0 << 15, then w0 = w3:w2 / w1
+    sl      w0, #15, w2
+    asr     w0, #1, w3
+    repeat  #17
+    div.sd  w2, w1
     
     return
     
-_q15_div_div:
-    ; at this point w1 = divisor, w0 = dividend
-    
-    ; w2 = w1
-    ; w5:w4 = w0 << 16
-    mov	    w1, w2
-    mov	    w0, w5
-    clr	    w4
-    
-    ; w5:w4 = w5:w4 >> 1
-    asr	    w5, #1, w5
-    
-    ; w0 = w5:w4 / w2
-    repeat  #17
-    div.sd  w4, w2
+_q15_div_saturate:
+    ; return 32767 if the signs are the same, otherwise -32768
+    xor     w0, w1, w0
+    asr     w0, #15, w0
+    mov     #32767, w1
+    xor     w0, w1, w0
     
     return
     
+    .section .text.q15_add, code
 _q15_add:
     add	    w0, w1, w2
     btsc    SR, #2	; check the overflow bit
@@ -115,6 +90,7 @@ _q15_add_neg_sat:
     mov	    #32768, w0
     return
     
+    .section .text.q15_abs, code
 _q15_abs:
     btss    w0, #15
     return
@@ -130,7 +106,71 @@ _q15_abs:
     
     return
     
-
+    .section .text.q15_sqrt, code
+_q15_sqrt:
+    ; the root of a negative number is invalid, -1
+    btsc    w0, #15
+    bra     _q15_sqrt_invalid
+    
+    ; w2 = root, w3 = increment, halved each pass down to 1
+    mov     #16383, w2
+    mov     #8192, w3
+    
+_q15_sqrt_loop:
+    ; w5 = (w2 * w2) >> 15
+    mul.ss  w2, w2, w4
+    rlc     w4, w4
+    rlc     w5, w5
+    
+    ; w2 -= w3 if w5 > w0, otherwise w2 += w3, without a branch
+    add     w2, w3, w1
+    sub     w2, w3, w2
+    cpsgt   w5, w0
+    mov     w1, w2
+    
+    lsr     w3, w3
+    bra     nz, _q15_sqrt_loop
+    
+    mov     w2, w0
+    return
+    
+_q15_sqrt_invalid:
+    setm    w0
+    return
+    
+    .section .text.q15_sin90, code
+_q15_sin90:
+    ; from 90 degrees (16384) up, return the 90 degree value
+    lsr     w0, #14, w1
+    bra     nz, _q15_sin90_saturate
+    
+    ; w1 = index of the table entry below theta, w0 = theta past it
+    lsr     w0, #6, w1
+    and     #63, w0
+    
+    ; w4 = sine_table[w1], w5 = the next entry, or the 90 degree value
+    ; after the last entry; the table is read through the PSV window
+    sl      w1, #1, w3
+    mov     #psvoffset(_sine_table), w4
+    add     w3, w4, w3
+    mov     [w3++], w4
+    mov     #32767, w5
+    mov     #255, w6
+    cpseq   w1, w6
+    mov     [w3], w5
+    
+    ; w0 = w4 + (((w5 - w4) * w0) >> 6), the interpolation of the C version
+    ; with the q15_div() and q15_mul() worked out, as w0 < 64
+    sub     w5, w4, w5
+    mul.uu  w0, w5, w2
+    lsr     w2, #6, w2
+    add     w4, w2, w0
+    
+    return
+    
+_q15_sin90_saturate:
+    mov     #32767, w0
+    return
     
     .end
     
@@ -7,33 +7,148 @@
 #include "task.h"
 #include "dio.h"
 #include "eeprom.h"
+#include "fan.h"
+#include "tach.h"
+#include "stall.h"
+#include "telemetry.h"
+#include "trace.h"
+#include "profile.h"
+#include "sync.h"
+#include "smbus.h"
+#include "expander.h"
+#include "control.h"
+#include "curve.h"
+#include "arb.h"
+#include "persist.h"
+#include "blackbox.h"
 
 /*********** Useful defines and macros ****************************************/
-typedef enum {eINIT, eFAN_START, eNORMAL, eFAN_ADJ} FanState;
+typedef enum {eINIT, eFAN_START, eNORMAL, eFAN_ADJ, eFAN_TUNE, eFAN_SWEEP} FanState;
 
 #define FAN_ADJUST_TIMEOUT  5000
+#define SWITCH_HOLD_TIME    3000    // holding the switch this long tunes every fan
+#define SWITCH_SWEEP_TIME   10000   // and this long characterizes every fan
+#ifndef MIN_INPUT_DC
 #define MIN_INPUT_DC        2500
-#define MIN_FAN_DC          3277
-#define NUM_OF_FANS         4
+#endif
+
+#ifndef INPUT_DC_HYSTERESIS
+#define INPUT_DC_HYSTERESIS 64      // input must move more than this to recompute
+#endif
+
+/* define INPUT_EVENTS as 1 to convert the input every 1ms from the timer
+ * interrupt and run the fan task once it has stayed outside the hysteresis
+ * band for INPUT_EVENT_SAMPLES conversions in a row, so that ADC noise
+ * reaching past the band does not; a quiet fan task then runs only every
+ * INPUT_SAFETY_PERIOD */
+#ifndef INPUT_EVENTS
+#define INPUT_EVENTS        0
+#endif
+#define INPUT_SAFETY_PERIOD 50      // ms, below ARB_MOTHERBOARD_TIMEOUT
+#ifndef INPUT_EVENT_SAMPLES
+#define INPUT_EVENT_SAMPLES 3
+#endif
+
+#ifndef RAMP_INCREMENT
+#define RAMP_INCREMENT      50      // soft-start duty cycle step per control period
+#endif
 #define MILLISECONDS_AFTER_PWM_TO_FULL_SPEED 100
 
-#define SWITCH_PORT DIO_PORT_B
-#define SWITCH_PIN  3
-#define SWITCH      PORTBbits.RB3
+#define PWM_PERIOD          640     // timer counts 0 to PWM_PERIOD, 25kHz from Fcy
+
+/* define PWM_STAGGER as 1 to start each fan's PWM timer part way through its
+ * period so that the fans turn on in turn rather than all on the same edge */
+#ifndef PWM_STAGGER
+#define PWM_STAGGER         0
+#endif
+
+/* each PWM output, on chip or on a fan expander, and the fan whose duty
+ * cycle it follows */
+typedef enum {eCH_CCP, eCH_EXPANDER} ChannelBackend;
+
+typedef struct {
+    uint8_t fan;
+    ChannelBackend backend;
+    volatile uint16_t *compare;     // CCPxRB of an on-chip output
+    uint8_t channel;                // of an expander output, numbered from 0
+}FanChannel;
+
+/* pin descriptors, see dio.h */
+#define SWITCH_PIN      B, 3
+#define ENC_A_PIN       A, 0
+#define ENC_B_PIN       B, 2    // on the same port as the switch
 
-#define ENC_A_PORT  DIO_PORT_A
-#define ENC_A_PIN   0
-#define ENC_B_PORT  DIO_PORT_B
-#define ENC_B_PIN   2
+#define PWM_FAN0_PIN    B, 12
+#define PWM_FAN1_PIN    A, 7
+#define PWM_FAN2_PIN    B, 9
+#define PWM_FAN3_PIN    B, 5
+
+/* the tach inputs are all on port B and read in one access */
+#define TACH_FAN0_PIN   B, 13
+#define TACH_FAN1_PIN   B, 10
+#define TACH_FAN2_PIN   B, 8
+#define TACH_FAN3_PIN   B, 6
+
+#define INPUT_PWM_PIN   A, 1
+#define MB_TACH_PIN     B, 14
 
 /*********** Variable Declarations ********************************************/
 FanState fanState = eINIT;
-uint32_t lastEncoderTime = 0;
-uint8_t switchPressed = 0;
-q15_t encoderTurned = 0;
+
+static const FanChannel fanChannels[] = {
+    {0, eCH_CCP, &CCP2RB, 0},
+    {1, eCH_CCP, &CCP5RB, 0},
+#if FAN_PRESENT(2)
+    {2, eCH_CCP, &CCP4RB, 0},
+#endif
+    {3, eCH_CCP, &CCP1RB, 0},
+#if EXPANDER_ENABLED
+    /* a chassis of sixteen fans, the other thirteen shared out over the
+     * three fans of the board */
+    {0, eCH_EXPANDER, 0, 0},
+    {1, eCH_EXPANDER, 0, 1},
+    {3, eCH_EXPANDER, 0, 2},
+    {0, eCH_EXPANDER, 0, 3},
+    {1, eCH_EXPANDER, 0, 4},
+    {3, eCH_EXPANDER, 0, 5},
+    {0, eCH_EXPANDER, 0, 6},
+    {1, eCH_EXPANDER, 0, 7},
+    {3, eCH_EXPANDER, 0, 8},
+    {0, eCH_EXPANDER, 0, 9},
+    {1, eCH_EXPANDER, 0, 10},
+    {3, eCH_EXPANDER, 0, 11},
+    {0, eCH_EXPANDER, 0, 12},
+#endif
+};
+#define NUM_OF_CHANNELS     (sizeof(fanChannels) / sizeof(fanChannels[0]))
+
+/* written by the input sampling fast tasks */
+volatile uint32_t lastEncoderTime = 0;
+volatile uint8_t switchPressed = 0;
+volatile q15_t encoderTurned = 0;
+volatile uint8_t tuneRequest = 0;       // mask of fans to tune
+volatile uint8_t sweepRequest = 0;      // mask of fans to characterize
+q15_t inputPwmDutyCycle = 0;
+volatile q15_t appliedInputDc = 0;      // input the outputs were last computed from
+#if INPUT_EVENTS
+volatile q15_t inputSample = 0;         // latest conversion by serviceInput()
+#endif
 
 q15_t dcFan[NUM_OF_FANS] = {0};
 q15_t targetDcFan[NUM_OF_FANS] = {0};
+q15_t outputDcFan[NUM_OF_FANS] = {0};   // duty cycle last applied to each fan
+uint16_t rpmTargetFan[NUM_OF_FANS] = {0};   // closed-loop RPM, 0 follows the input
+
+/* set whenever the outputs must be recomputed regardless of the input
+ * hysteresis (state entry, target changes) */
+uint8_t outputsDirty = 1;
+
+/* counters of control updates and PWM compare register writes that were
+ * performed or skipped because nothing changed */
+uint32_t controlUpdates = 0;
+uint32_t controlUpdatesSkipped = 0;
+uint32_t pwmWrites = 0;
+uint32_t pwmWritesSkipped = 0;
 
 /*********** Function Declarations ********************************************/
 void initOsc(void);
@@ -41,34 +156,91 @@ void initInterrupts(void);
 void initIO(void);
 void initPwm(void);
 void initAdc(void);
+#if TACH_PASSTHROUGH
+void initTachPassthrough(void);
+void holdTachOutput(uint8_t hold);
+#endif
 
 void serviceFanState(void);
 void serviceSwitch(void);
 void serviceEncoder(void);
+void serviceTelemetry(void);
+void serviceCommands(void);
+void serviceSmbus(void);
+void serviceInput(void);
+void serviceBlackbox(void);
+uint8_t fanStateQuiet(void);
 
 void setDutyCycleFan(uint8_t fan, q15_t dutyCycle);
-void setDutyCycleFan0(q15_t dutyCycle);
-void setDutyCycleFan1(q15_t dutyCycle);
-void setDutyCycleFan2(q15_t dutyCycle);
-void setDutyCycleFan3(q15_t dutyCycle);
-q15_t rampDc(q15_t dc, q15_t targetDc);
+uint16_t dutyCycleToCompare(q15_t dutyCycle, uint16_t period);
+uint16_t pwmPhase(uint8_t fan);
+void setRpmTarget(uint8_t fan, uint16_t rpm);
+q15_t rampDc(uint8_t fan, q15_t dc, q15_t targetDc);
 
 /*********** Function Implementations *****************************************/
 int main(void) {
-    /* setup the hardware */
+    /* setup the hardware; the reset cause decides whether the fans resume
+     * at once or soft-start */
     initOsc();
+    PERSIST_init();
     initInterrupts();
     initIO();
     initPwm();
     initAdc();
+#if TACH_PASSTHROUGH
+    initTachPassthrough();
+#endif
     
     /* initialize the task manager */
     TASK_init();
+    PROFILE_init();
+    TACH_init();
+    TRACE_init();
+    CONTROL_init();
+    CURVE_init();
+    ARB_init();
+    BBOX_init();
+    BBOX_event(eBBOX_RESET, PERSIST_isWarm(), PERSIST_getResetCause());
     
     /* add tasks */
     TASK_add(&serviceFanState, 10);
-    TASK_add(&serviceSwitch, 1);
-    TASK_add(&serviceEncoder, 1);
+#if TELEMETRY_ENABLED
+    /* headless boards are adjusted by commands rather than the encoder */
+    TELEM_init();
+    TASK_add(&serviceTelemetry, TELEMETRY_PERIOD);
+    TASK_add(&serviceCommands, 10);
+#else
+    /* the inputs are sampled from the timer interrupt so that slow
+     * background passes (ADC waits, EEPROM writes) do not delay them */
+    TASK_addFast(&serviceEncoder, 1, 2);
+    TASK_addFast(&serviceSwitch, 1, 1);
+#endif
+    TASK_add(&TACH_service, TACH_WINDOW_MS);
+#if INPUT_EVENTS
+    TASK_addFast(&serviceInput, 1, 3);
+#endif
+#if SYNC_ENABLED
+    SYNC_init(&serviceFanState);
+#endif
+#if SMBUS_ENABLED
+    SMBUS_init();
+    TASK_add(&serviceSmbus, 10);
+#endif
+#if BLACKBOX_ENABLED
+    TASK_add(&serviceBlackbox, 10);
+#endif
+#if PROFILE_ENABLED
+    TASK_add(&PROFILE_service, 10);
+#endif
+#if EXPANDER_ENABLED
+    /* the duty cycles set so far are sent on the first control period */
+    uint8_t i, expanded = 0;
+    for(i = 0; i < NUM_OF_CHANNELS; i++){
+        if(fanChannels[i].backend == eCH_EXPANDER)
+            expanded++;
+    }
+    EXP_init(expanded);
+#endif
     
     TASK_manage();
     
@@ -79,29 +251,84 @@ int main(void) {
 /* Tasks below this line */
 void serviceFanState(void){
     static uint8_t lastFanAdjusted = 0;
+    static FanState lastFanState = eINIT;
     
     /* ADC conversion to determine the input duty cycle */
+#if INPUT_EVENTS
+    inputPwmDutyCycle = inputSample;
+#else
     AD1CON1bits.SAMP = 0;
     while(!AD1CON1bits.DONE);   // ...wait for the ADC to finish...
-    q15_t inputPwmDutyCycle = (q15_t)(ADC1BUF0 >> 1);
+    inputPwmDutyCycle = (q15_t)(ADC1BUF0 >> 1);
+#endif
+    uint8_t inputValid = 1;
+#if SYNC_ENABLED
+    /* followers run from the master's input, the master shares its own */
+    if(SYNC_isFollower()){
+        inputValid = SYNC_followInput(&inputPwmDutyCycle);
+    }else{
+        SYNC_publish(inputPwmDutyCycle);
+    }
+#endif
+    TRACE_adc(inputPwmDutyCycle, 0);
+    
+#if TACH_PASSTHROUGH
+    /* the interrupt no longer drives the motherboard tach, so a fault
+     * holds it low from here */
+    holdTachOutput(STALL_getFaults() || SYNC_getFaults() || EXP_getFaults());
+#endif
+    
+    /* a follower that has lost the master falls back to the failsafe */
+    if(inputValid)
+        ARB_set(eARB_MOTHERBOARD, ARB_ALL_FANS, inputPwmDutyCycle, ARB_MOTHERBOARD_TIMEOUT, TASK_getTime());
+    else
+        ARB_clear(eARB_MOTHERBOARD, ARB_ALL_FANS);
+    
+    /* EEPROM writes yield until complete, the input is still sampled on
+     * each run while they are in progress */
+    /* only a board running normally resumes where it was after a reset */
+    if(fanState == eNORMAL)
+        PERSIST_save(outputDcFan, rpmTargetFan);
+    else
+        PERSIST_invalidate();
+    
+    TASK_BEGIN();
     
     switch(fanState){
         case eINIT:
         {
-            uint8_t i;
+            static uint8_t i;   // static as the loop yields
             for(i = 0; i < NUM_OF_FANS; i++){
-                dcFan[i] = 0;
-                setDutyCycleFan(i, 0);
+                /* after a warm reset the fans are already running at the
+                 * duty cycles restored by initPwm() */
+                if(!PERSIST_isResuming())
+                    setDutyCycleFan(i, 0);
+                
+                /* a return here from eFAN_ADJ keeps the RPM targets the
+                 * host has set */
+                if(PERSIST_isResuming())
+                    setRpmTarget(i, PERSIST_getRpmTarget(i));
                 
                 targetDcFan[i] = EEPROM_read(i);
+                TRACE_target(i, targetDcFan[i]);
                 
                 if(targetDcFan[i] == 0){
                     targetDcFan[i] = 32767;
-                    EEPROM_write(i, 32767);
+                    EEPROM_startWrite(i, 32767);
+                    TASK_WAIT_UNTIL(!EEPROM_busy());
                 }
+                
+                /* the adjust and soft-start base is the target, which a
+                 * resumed fan has already reached; the restored duty cycle
+                 * is scaled by the input */
+                dcFan[i] = PERSIST_isResuming() ? targetDcFan[i] : 0;
             }
             
-            fanState = eFAN_START;
+            STALL_init();
+            
+            fanState = PERSIST_isResuming() ? eNORMAL : eFAN_START;
+            PERSIST_consumeWarm();
+            outputsDirty = 1;
             switchPressed = 0;
             lastFanAdjusted = 0;
             
@@ -114,8 +341,8 @@ void serviceFanState(void){
             uint8_t i;
             for(i = 0; i < NUM_OF_FANS; i++){
                 if(dcFan[i] != targetDcFan[i]){
-                    dcFan[i] = rampDc(dcFan[i], targetDcFan[i]);
-                    setDutyCycleFan(i, dcFan[i]);
+                    dcFan[i] = rampDc(i, dcFan[i], targetDcFan[i]);
+                    setDutyCycleFan(i, CURVE_kick(i, dcFan[i], outputDcFan[i], TASK_getTime()));
                     break;
                 }
             }
@@ -126,8 +353,10 @@ void serviceFanState(void){
                 if(dcFan[i] != targetDcFan[i])
                     exitCondition = 0;
             }
-            if(exitCondition)
+            if(exitCondition){
                 fanState = eNORMAL;
+                outputsDirty = 1;
+            }
             
             /* deal with the adjust button being pressed */
             if(switchPressed){
@@ -150,21 +379,71 @@ void serviceFanState(void){
             }
             switchPressed = 0;
             
-
-            /* scale the target duty cycle to the input duty cycle */
+            if(sweepRequest){
+                fanState = eFAN_SWEEP;
+                break;
+            }
+            if(tuneRequest){
+                fanState = eFAN_TUNE;
+                break;
+            }
+            
+            /* a change in the stall recovery of any fan, or in the
+             * sources of its demand, forces an update */
+            if(STALL_service(TASK_getTime()))
+                outputsDirty = 1;
+            if(ARB_service(TASK_getTime()))
+                outputsDirty = 1;
+            
+            /* closed-loop fans are updated on every run */
             uint8_t i;
+            for(i = 0; i < NUM_OF_FANS; i++){
+                if(rpmTargetFan[i] != 0)
+                    outputsDirty = 1;
+            }
+            
+            /* only recompute the outputs when the input has moved outside
+             * of the hysteresis band, this keeps ADC noise from chattering
+             * the PWM outputs */
+            q15_t inputDiff = q15_abs(q15_add(inputPwmDutyCycle, -appliedInputDc));
+            if((outputsDirty == 0) && (inputDiff <= INPUT_DC_HYSTERESIS)){
+                controlUpdatesSkipped++;
+                break;
+            }
+            appliedInputDc = inputPwmDutyCycle;
+            TRACE_adc(appliedInputDc, 1);
+            outputsDirty = 0;
+            controlUpdates++;
+
+            /* scale the target duty cycle to the demand arbitrated
+             * between the fan's sources */
             for(i = 0; i < NUM_OF_FANS; i++){
                 q15_t dc;
                 
-                dc = q15_mul(inputPwmDutyCycle, targetDcFan[i]);
-
-                if(dc < MIN_FAN_DC)
-                    dc = MIN_FAN_DC;
+                if(rpmTargetFan[i] != 0){
+                    dc = CONTROL_update(i, rpmTargetFan[i], TACH_getRpm(i));
+                }else{
+                    q15_t demand = ARB_resolve(i);
+                    dc = q15_mul(demand, targetDcFan[i]);
+                    
+                    if(dc < CURVE_getSustainDc(i))
+                        dc = CURVE_getSustainDc(i);
+                    
+                    if(demand < MIN_INPUT_DC)
+                        dc = 0;
+                }
                 
-                if(inputPwmDutyCycle < MIN_INPUT_DC)
+                if(!FAN_PRESENT(i))
                     dc = 0;
                 
-                setDutyCycleFan(i, dc);
+                /* a fan being started is recomputed until the kick ends */
+                q15_t kicked = CURVE_kick(i, dc, outputDcFan[i], TASK_getTime());
+                if(kicked != dc){
+                    dc = kicked;
+                    outputsDirty = 1;
+                }
+                
+                setDutyCycleFan(i, STALL_dutyCycle(i, dc));
             }
             
             break;
@@ -176,10 +455,18 @@ void serviceFanState(void){
              * duty cycle quickly, else when the encoder is being turned
              * slowly, then move the duty cycle slowly */
             q15_t increment, dc;
-            if((encoderTurned < 4) && (encoderTurned > -4))
-                increment = 10 * encoderTurned;
+            
+            /* take the turns counted by the encoder fast task */
+            uint16_t lock = TASK_lockFast();
+            q15_t turned = encoderTurned;
+            uint32_t lastTurnTime = lastEncoderTime;
+            encoderTurned = 0;
+            TASK_unlockFast(lock);
+            
+            if((turned < 4) && (turned > -4))
+                increment = 10 * turned;
             else
-                increment = 100 * encoderTurned;
+                increment = 100 * turned;
             
             /* dc = inc + lastDc */
             dc = q15_add(increment, dcFan[lastFanAdjusted]);
@@ -187,27 +474,27 @@ void serviceFanState(void){
             /* place limits on the duty cycle */
             if(dc < 0)
                 dc = 0;
-            else if((dcFan[lastFanAdjusted] > 0) && (dc < MIN_FAN_DC))
+            else if((dcFan[lastFanAdjusted] > 0) && (dc < CURVE_getSustainDc(lastFanAdjusted)))
                 dc = 0;
             else if((dcFan[lastFanAdjusted] == 0) && (dc > 0))
-                dc = MIN_FAN_DC;
+                dc = CURVE_getStartDc(lastFanAdjusted);
             
             dcFan[lastFanAdjusted] = dc;
             
-            encoderTurned = 0;
-            
             /* deal with a timeout */
-            if(TASK_getTime() > (lastEncoderTime + FAN_ADJUST_TIMEOUT)){
+            if(TASK_getTime() > (lastTurnTime + FAN_ADJUST_TIMEOUT)){
                 fanState = eINIT;
                 
                 targetDcFan[lastFanAdjusted] = dcFan[lastFanAdjusted];
-                EEPROM_write(lastFanAdjusted, dcFan[lastFanAdjusted]);
+                EEPROM_startWrite(lastFanAdjusted, dcFan[lastFanAdjusted]);
+                TASK_WAIT_UNTIL(!EEPROM_busy());
             }
             
             /* deal with the adjust button being pressed */
             if(switchPressed){
                 targetDcFan[lastFanAdjusted] = dcFan[lastFanAdjusted];
-                EEPROM_write(lastFanAdjusted, dcFan[lastFanAdjusted]);
+                EEPROM_startWrite(lastFanAdjusted, dcFan[lastFanAdjusted]);
+                TASK_WAIT_UNTIL(!EEPROM_busy());
                 
                 lastFanAdjusted++;
                 if(lastFanAdjusted > NUM_OF_FANS)
@@ -229,21 +516,133 @@ void serviceFanState(void){
             break;
         }
         
+        case eFAN_TUNE:
+        {
+            /* static as the state yields */
+            static uint8_t fan = 0;
+            static q15_t savedDc = 0;
+            static TuneState tuneState;
+            
+            if(CONTROL_getTuneState() == eTUNE_IDLE){
+                /* the next fan still to be tuned, the others keep
+                 * running at their last duty cycle */
+                uint8_t mask = tuneRequest & FAN_PRESENT_MASK;
+                if(mask == 0){
+                    tuneRequest = 0;
+                    fanState = eNORMAL;
+                    outputsDirty = 1;
+                    break;
+                }
+                
+                for(fan = 0; (mask & (1 << fan)) == 0; fan++);
+                tuneRequest &= ~(1 << fan);
+                savedDc = outputDcFan[fan];
+                CONTROL_startTune(fan, TASK_getTime());
+            }
+            
+            setDutyCycleFan(fan, CONTROL_tune(TASK_getTime(), TACH_getRpm(fan)));
+            
+            tuneState = CONTROL_getTuneState();
+            if(tuneState == eTUNE_DONE){
+                EEPROM_startWrite(CONTROL_GAINS_EEPROM + (fan << 1), CONTROL_getGains(fan)->kp);
+                TASK_WAIT_UNTIL(!EEPROM_busy());
+                EEPROM_startWrite(CONTROL_GAINS_EEPROM + (fan << 1) + 1, CONTROL_getGains(fan)->ki);
+                TASK_WAIT_UNTIL(!EEPROM_busy());
+            }
+            if((tuneState == eTUNE_DONE) || (tuneState == eTUNE_FAILED) || switchPressed){
+                setDutyCycleFan(fan, savedDc);
+                CONTROL_endTune();
+            }
+            
+            /* the switch abandons the remaining fans */
+            if(switchPressed)
+                tuneRequest = 0;
+            switchPressed = 0;
+            
+            break;
+        }
+        
+        case eFAN_SWEEP:
+        {
+            /* static as the state yields */
+            static uint8_t fan = 0;
+            static uint8_t word;
+            static q15_t savedDc = 0;
+            static CurveState curveState;
+            
+            if(CURVE_getSweepState() == eCURVE_IDLE){
+                uint8_t mask = sweepRequest & FAN_PRESENT_MASK;
+                if(mask == 0){
+                    sweepRequest = 0;
+                    fanState = eNORMAL;
+                    outputsDirty = 1;
+                    break;
+                }
+                
+                for(fan = 0; (mask & (1 << fan)) == 0; fan++);
+                sweepRequest &= ~(1 << fan);
+                savedDc = outputDcFan[fan];
+                CURVE_startSweep(fan, TASK_getTime());
+            }
+            
+            setDutyCycleFan(fan, CURVE_sweep(TASK_getTime(), TACH_getRpm(fan)));
+            
+            curveState = CURVE_getSweepState();
+            if(curveState == eCURVE_DONE){
+                for(word = 0; word < CURVE_WORDS; word++){
+                    EEPROM_startWrite(CURVE_EEPROM + (fan * CURVE_WORDS) + word, CURVE_getWord(fan, word));
+                    TASK_WAIT_UNTIL(!EEPROM_busy());
+                }
+            }
+            if((curveState == eCURVE_DONE) || (curveState == eCURVE_FAILED) || switchPressed){
+                /* the fan was left stopped, it may need more than its
+                 * last duty cycle to start again */
+                if((savedDc > 0) && (savedDc < CURVE_getStartDc(fan)))
+                    savedDc = CURVE_getStartDc(fan);
+                setDutyCycleFan(fan, savedDc);
+                CURVE_endSweep();
+            }
+            
+            if(switchPressed)
+                sweepRequest = 0;
+            switchPressed = 0;
+            
+            break;
+        }
+        
         default:
         {
             while(1);   // programmer's trap
         }
         
     }
+    
+#if EXPANDER_ENABLED
+    /* one burst to each expander with changes, whatever the state set */
+    EXP_flush();
+#endif
+    
+    if(fanState != lastFanState){
+        TRACE_state(fanState);
+        lastFanState = fanState;
+    }
+    
+#if INPUT_EVENTS
+    /* serviceInput() runs a quiet fan task as soon as the input moves, so
+     * the period only remains as a safety net */
+    if(fanStateQuiet())
+        TASK_delay(INPUT_SAFETY_PERIOD);
+#endif
 }
 
 void serviceSwitch(void){
     static uint8_t switchArray = 0;
     static uint8_t state = 0;
+    static uint32_t pressTime = 0;
     
     /* debounce */
     switchArray <<= 1;
-    if(SWITCH){
+    if(DIO_READ(SWITCH_PIN)){
         switchArray |= 0x01;
     }else{
         switchArray &= 0xfe;
@@ -251,18 +650,106 @@ void serviceSwitch(void){
     
     /* edge detector */
     if((switchArray == 0xff) && (state == 0)){
-        /* switch just released */
+        /* switch just pressed (the input is pulled down) */
         state = 1;
         lastEncoderTime = TASK_getTime();
-        
-        switchPressed = 1;
+        pressTime = lastEncoderTime;
     }else if((switchArray == 0x00) && (state == 1)){
-        /* switch just pressed */
+        /* switch just released; the press counts on release so that a
+         * long press is not also a click */
         state = 0;
         lastEncoderTime = TASK_getTime();
+        
+        uint32_t heldTime = lastEncoderTime - pressTime;
+        if(heldTime >= SWITCH_SWEEP_TIME)
+            sweepRequest = FAN_PRESENT_MASK;
+        else if(heldTime >= SWITCH_HOLD_TIME)
+            tuneRequest = FAN_PRESENT_MASK;
+        else
+            switchPressed = 1;
+        
+#if INPUT_EVENTS
+        TASK_trigger(&serviceFanState);
+#endif
+    }
+}
+
+#if INPUT_EVENTS
+/* a fast task that converts the input each 1ms in place of the wait at the
+ * top of serviceFanState(), and runs the fan task at the next pass when the
+ * input has stayed outside the hysteresis band around the value last
+ * applied for INPUT_EVENT_SAMPLES conversions */
+void serviceInput(void){
+    static uint8_t outside = 0;
+    
+    if(!AD1CON1bits.DONE)
+        return;
+    
+    q15_t sample = (q15_t)(ADC1BUF0 >> 1);
+    AD1CON1bits.SAMP = 0;       // auto-sampling, this starts the next conversion
+    inputSample = sample;
+    
+    if((fanState != eNORMAL) || (q15_abs(q15_add(sample, -appliedInputDc)) <= INPUT_DC_HYSTERESIS)){
+        outside = 0;
+    }else if(outside < INPUT_EVENT_SAMPLES){
+        outside++;
     }
+    
+    if(outside >= INPUT_EVENT_SAMPLES)
+        TASK_trigger(&serviceFanState);
 }
 
+/* the fan task need not run until the input moves when it is in eNORMAL
+ * with nothing changing under it: no closed-loop fan, stall recovery or
+ * kick in progress and no update pending */
+uint8_t fanStateQuiet(void){
+    if((fanState != eNORMAL) || outputsDirty)
+        return 0;
+    
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        if((rpmTargetFan[i] != 0) || (STALL_getState(i) != eSTALL_OK))
+            return 0;
+    }
+    
+    return 1;
+}
+#endif
+
+#if BLACKBOX_ENABLED
+/* writes the log a word per run, and once a second looks for new faults
+ * and samples the fans for the hourly summary */
+void serviceBlackbox(void){
+    static uint32_t lastSample = 0;
+    static uint8_t lastFaults = 0;
+    static uint8_t inputLost = 0;
+    
+    BBOX_service();
+    
+    if((TASK_getTime() - lastSample) < 1000)
+        return;
+    lastSample += 1000;
+    
+    uint16_t rpm[NUM_OF_FANS];
+    uint8_t faults = STALL_getFaults();
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        if((faults & ~lastFaults) & (1 << i))
+            BBOX_event(eBBOX_STALL, i, outputDcFan[i]);
+        rpm[i] = TACH_getRpm(i);
+    }
+    lastFaults = faults;
+    
+    /* the motherboard source lapses when a follower loses its master */
+    uint8_t lost = (ARB_getValid(0) & (1 << eARB_MOTHERBOARD)) == 0;
+    if(lost && !inputLost)
+        BBOX_event(eBBOX_INPUT_LOSS, 0, appliedInputDc);
+    inputLost = lost;
+    
+    BBOX_sample(outputDcFan, rpm);
+}
+#endif
+
 void serviceEncoder(void){
     /* I found this routine at 
      * https://www.circuitsathome.com/mcu/reading-rotary-encoder-on-arduino 
@@ -272,7 +759,9 @@ void serviceEncoder(void){
     static int8_t enc_states[] = {0,-1,1,0,1,0,0,-1,-1,0,0,1,0,1,-1,0};
     static uint8_t old_AB = 0;
     
-    uint8_t new_AB = PORTAbits.RA0 | (PORTBbits.RB2 << 1);
+    uint16_t portb = DIO_READ_PORT(ENC_B_PIN);
+    uint8_t new_AB = DIO_READ(ENC_A_PIN) | (DIO_BIT(portb, ENC_B_PIN) << 1);
+    TRACE_inputs(new_AB | (DIO_BIT(portb, SWITCH_PIN) << 2));
     
     old_AB <<= 2;
     old_AB |= new_AB;
@@ -290,70 +779,394 @@ void serviceEncoder(void){
     }
 }
 
-/******************************************************************************/
-/* Helper functions below this line */
-void setDutyCycleFan(uint8_t fan, q15_t dutyCycle){
-    switch(fan){
-        case 0:     setDutyCycleFan0(dutyCycle);    break;
-        case 1:     setDutyCycleFan1(dutyCycle);    break;
-        case 2:     setDutyCycleFan2(dutyCycle);    break;
-        case 3:     setDutyCycleFan3(dutyCycle);    break;
-        default:                                    break;
+#if TELEMETRY_ENABLED
+#if TRACE_ENABLED
+static uint16_t traceDumpOffset = 0xffff;
+#endif
+#if BLACKBOX_ENABLED
+static uint16_t blackboxDumpOffset = 0xffff;
+#endif
+
+void serviceTelemetry(void){
+    uint8_t payload[TELEM_MAX_PAYLOAD];
+    uint8_t *p = payload;
+    
+#if TRACE_ENABLED
+    /* a trace dump replaces the status stream until it is complete,
+     * chunks are sent as fast as the transmit buffer allows */
+    if(traceDumpOffset != 0xffff){
+        uint16_t total = TRACE_length();
+        
+        while(traceDumpOffset < total){
+            p = TELEM_putU16(payload, traceDumpOffset);
+            p = TELEM_putU16(p, total);
+            uint16_t n = TRACE_read(traceDumpOffset, p, TELEM_MAX_PAYLOAD - 4);
+            
+            if(!TELEM_send(TELEM_MSG_TRACE, payload, n + 4))
+                return;
+            traceDumpOffset += n;
+        }
+        
+        traceDumpOffset = 0xffff;
+        TRACE_freeze(0);
+        return;
+    }
+#endif
+    
+#if BLACKBOX_ENABLED
+    /* the log is read from the EEPROM between the writes of the black box
+     * and fan tasks, so a dump may take a few periods */
+    if(blackboxDumpOffset != 0xffff){
+        while(blackboxDumpOffset < BBOX_DUMP_SIZE){
+            if(EEPROM_busy())
+                return;
+            
+            p = TELEM_putU16(payload, blackboxDumpOffset);
+            p = TELEM_putU16(p, BBOX_DUMP_SIZE);
+            uint16_t n = BBOX_read(blackboxDumpOffset, p, TELEM_MAX_PAYLOAD - 4);
+            
+            if(!TELEM_send(TELEM_MSG_BLACKBOX, payload, n + 4))
+                return;
+            blackboxDumpOffset += n;
+        }
+        
+        blackboxDumpOffset = 0xffff;
+        BBOX_freeze(0);
+        return;
+    }
+#endif
+    
+    /* status: time, state, input duty cycle, faults, then for each fan the
+     * applied duty cycle, target duty cycle, RPM and stall state */
+    p = TELEM_putU32(p, TASK_getTime());
+    *p++ = (uint8_t)fanState;
+    p = TELEM_putU16(p, inputPwmDutyCycle);
+    *p++ = STALL_getFaults();
+    
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        p = TELEM_putU16(p, outputDcFan[i]);
+        p = TELEM_putU16(p, targetDcFan[i]);
+        p = TELEM_putU16(p, TACH_getRpm(i));
+        *p++ = (uint8_t)STALL_getState(i);
+    }
+    TELEM_send(TELEM_MSG_STATUS, payload, p - payload);
+    
+    /* scheduler and control loop statistics, the fast tier worst case
+     * is in us */
+    p = payload;
+    p = TELEM_putU32(p, controlUpdates);
+    p = TELEM_putU32(p, controlUpdatesSkipped);
+    p = TELEM_putU32(p, pwmWrites);
+    p = TELEM_putU32(p, pwmWritesSkipped);
+    p = TELEM_putU32(p, TASK_getLateCount());
+    p = TELEM_putU32(p, TASK_getMaxLateness());
+    p = TELEM_putU16(p, TASK_getFastWcet());
+    TELEM_send(TELEM_MSG_SCHED, payload, p - payload);
+    
+#if PROFILE_ENABLED
+    /* one profiled region per period: id, count, max then the histogram */
+    static uint8_t profileRegion = 0;
+    const ProfileStats *stats = PROFILE_getStats(profileRegion);
+    p = payload;
+    *p++ = profileRegion;
+    p = TELEM_putU32(p, stats->count);
+    p = TELEM_putU16(p, stats->max);
+    for(i = 0; i < PROFILE_NUM_OF_BINS; i++)
+        p = TELEM_putU16(p, stats->bins[i]);
+    if(TELEM_send(TELEM_MSG_PROFILE, payload, p - payload)){
+        if(++profileRegion >= ePROF_NUM_OF_REGIONS)
+            profileRegion = 0;
+    }
+#endif
+}
+
+void serviceCommands(void){
+    uint8_t type, length;
+    uint8_t payload[TELEM_MAX_PAYLOAD];
+    
+    while(TELEM_receive(&type, payload, &length)){
+        uint8_t status = 1;     // 0 = ok, 1 = rejected
+        
+        switch(type){
+            case TELEM_CMD_SET_TARGET:
+            {
+                /* payload: fan, target duty cycle, save to EEPROM */
+                if((length != 4) || (payload[0] >= NUM_OF_FANS))
+                    break;
+                
+                uint8_t fan = payload[0];
+                q15_t dc = (q15_t)TELEM_getU16(&payload[1]);
+                
+                /* same limits as the encoder adjustment */
+                if(dc < 0)
+                    dc = 0;
+                else if((dc > 0) && (dc < CURVE_getSustainDc(fan)))
+                    dc = CURVE_getSustainDc(fan);
+                
+                targetDcFan[fan] = dc;
+                TRACE_target(fan, dc);
+                if(payload[3])
+                    EEPROM_write(fan, dc);
+                
+                outputsDirty = 1;
+                status = 0;
+                break;
+            }
+            
+            case TELEM_CMD_AUTOTUNE:
+            {
+                /* payload: mask of the fans to tune */
+                if((length != 1) || (fanState != eNORMAL))
+                    break;
+                
+                tuneRequest = payload[0] & FAN_PRESENT_MASK;
+                status = 0;
+                break;
+            }
+            
+            case TELEM_CMD_CHARACTERIZE:
+            {
+                /* payload: mask of the fans to sweep */
+                if((length != 1) || (fanState != eNORMAL))
+                    break;
+                
+                sweepRequest = payload[0] & FAN_PRESENT_MASK;
+                status = 0;
+                break;
+            }
+            
+            case TELEM_CMD_SET_DEMAND:
+            {
+                /* payload: fan mask, demand, 0xffff to clear it, and the
+                 * ms it holds for, 0 until replaced */
+                if(length != 5)
+                    break;
+                
+                uint8_t mask = payload[0] & ARB_ALL_FANS;
+                uint16_t demand = TELEM_getU16(&payload[1]);
+                if(demand == 0xffff)
+                    ARB_clear(eARB_HOST, mask);
+                else
+                    ARB_set(eARB_HOST, mask, (q15_t)demand, TELEM_getU16(&payload[3]), TASK_getTime());
+                
+                outputsDirty = 1;
+                status = 0;
+                break;
+            }
+            
+            case TELEM_CMD_SET_POLICY:
+            {
+                /* payload: fan mask, policy, then a blend weight for each
+                 * source */
+                if((length != (2 + eARB_NUM_OF_SOURCES)) || (payload[1] >= eARB_NUM_OF_POLICIES))
+                    break;
+                
+                uint8_t i;
+                for(i = 0; i < NUM_OF_FANS; i++){
+                    if(payload[0] & (1 << i))
+                        ARB_setPolicy(i, (ArbPolicy)payload[1], &payload[2]);
+                }
+                
+                outputsDirty = 1;
+                status = 0;
+                break;
+            }
+            
+            case TELEM_CMD_SET_RPM:
+            {
+                /* payload: fan, RPM target, 0 returns the fan to the input */
+                if((length != 3) || (payload[0] >= NUM_OF_FANS))
+                    break;
+                
+                setRpmTarget(payload[0], TELEM_getU16(&payload[1]));
+                status = 0;
+                break;
+            }
+            
+            case TELEM_CMD_SET_RATE:
+            {
+                /* payload: streaming period in ms, 0 stops streaming */
+                if(length != 2)
+                    break;
+                
+                uint16_t period = TELEM_getU16(payload);
+                if(period == 0)
+                    TASK_remove(&serviceTelemetry);
+                else
+                    TASK_add(&serviceTelemetry, period);
+                
+                status = 0;
+                break;
+            }
+            
+#if TRACE_ENABLED
+            case TELEM_CMD_TRACE_DUMP:
+            {
+                /* the dump is sent in chunks by serviceTelemetry */
+                TRACE_freeze(1);
+                traceDumpOffset = 0;
+                status = 0;
+                break;
+            }
+#endif
+            
+#if BLACKBOX_ENABLED
+            case TELEM_CMD_BLACKBOX_DUMP:
+            {
+                /* the dump is sent in chunks by serviceTelemetry */
+                BBOX_freeze(1);
+                blackboxDumpOffset = 0;
+                status = 0;
+                break;
+            }
+#endif
+            
+            default:
+                break;
+        }
+        
+        uint8_t ack[2] = {type, status};
+        TELEM_send(TELEM_MSG_ACK, ack, 2);
     }
+    
+#if INPUT_EVENTS
+    /* a command takes effect without waiting for a quiet fan task */
+    if(outputsDirty || tuneRequest || sweepRequest)
+        TASK_trigger(&serviceFanState);
+#endif
 }
+#endif
 
-void setDutyCycleFan0(q15_t dutyCycle){
-    CCP2RB = q15_mul(dutyCycle, CCP2PRL);
+#if SMBUS_ENABLED
+void serviceSmbus(void){
+    SmbusWrite write;
     
-    /* when CCPxRB == 0, PWM doesn't update properly */
-    if(CCP2RB < 2)
-        CCP2RB = 2;
-    else if(CCP2RB >= CCP2PRL)
-        CCP2RB = CCP2PRL - 1;
+    /* target writes by the host, with the same limits as the encoder */
+    while(SMBUS_receive(&write)){
+        uint8_t fan = write.fan;
+        if(fan >= NUM_OF_FANS)
+            continue;
+        
+        if(write.type == eSMBUS_SET_RPM){
+            setRpmTarget(fan, write.value);
+            continue;
+        }
+        
+        q15_t dc = (q15_t)write.value;
+        if(dc < 0)
+            dc = 0;
+        else if((dc > 0) && (dc < CURVE_getSustainDc(fan)))
+            dc = CURVE_getSustainDc(fan);
+        
+        targetDcFan[fan] = dc;
+        TRACE_target(fan, dc);
+        if(write.type == eSMBUS_SAVE_TARGET)
+            EEPROM_write(fan, dc);
+        
+        outputsDirty = 1;
+    }
     
-    return;
+#if INPUT_EVENTS
+    if(outputsDirty)
+        TASK_trigger(&serviceFanState);
+#endif
+    
+    /* a snapshot held by a read in progress is refreshed on the next run */
+    SMBUS_publish(fanState, inputPwmDutyCycle, outputDcFan, targetDcFan, rpmTargetFan);
 }
+#endif
 
-void setDutyCycleFan1(q15_t dutyCycle){
-    CCP5RB = q15_mul(dutyCycle, CCP5PRL);
+/******************************************************************************/
+/* Helper functions below this line */
+/* writes every channel that follows the fan */
+void setDutyCycleFan(uint8_t fan, q15_t dutyCycle){
+    if(fan >= NUM_OF_FANS)
+        return;
     
-    /* when CCPxRB == 0, PWM doesn't update properly */
-    if(CCP5RB < 2)
-        CCP5RB = 2;
-    else if(CCP5RB >= CCP5PRL)
-        CCP5RB = CCP5PRL - 1;
+    outputDcFan[fan] = dutyCycle;
+    
+    uint8_t i;
+    for(i = 0; i < NUM_OF_CHANNELS; i++){
+        const FanChannel *ch = &fanChannels[i];
+        if(ch->fan != fan)
+            continue;
+        
+        if(ch->backend == eCH_CCP){
+            uint16_t compare = dutyCycleToCompare(dutyCycle, PWM_PERIOD);
+            
+            /* only write the register when the compare value actually
+             * changes */
+            if(compare != *ch->compare){
+                *ch->compare = compare;
+                pwmWrites++;
+                TRACE_pwm(fan, compare);
+            }else{
+                pwmWritesSkipped++;
+            }
+#if EXPANDER_ENABLED
+        }else{
+            EXP_set(ch->channel, dutyCycle);
+#endif
+        }
+    }
 }
 
-void setDutyCycleFan2(q15_t dutyCycle){
-    CCP4RB = q15_mul(dutyCycle, CCP4PRL);
+void setRpmTarget(uint8_t fan, uint16_t rpm){
+    if(fan >= NUM_OF_FANS)
+        return;
     
-    /* when CCPxRB == 0, PWM doesn't update properly */
-    if(CCP4RB < 2)
-        CCP4RB = 2;
-    else if(CCP4RB >= CCP4PRL)
-        CCP4RB = CCP4PRL - 1;
+    /* the loop takes over from the duty cycle the fan is running at, or
+     * from its curve */
+    if((rpmTargetFan[fan] == 0) && (rpm != 0))
+        CONTROL_reset(fan, outputDcFan[fan]);
+    
+    rpmTargetFan[fan] = rpm;
+    outputsDirty = 1;
 }
 
-void setDutyCycleFan3(q15_t dutyCycle){
-    CCP1RB = q15_mul(dutyCycle, CCP1PRL);
+uint16_t dutyCycleToCompare(q15_t dutyCycle, uint16_t period){
+    uint16_t compare = q15_mul(dutyCycle, period);
     
     /* when CCPxRB < 2, PWM doesn't update properly */
-    if(CCP1RB < 2)
-        CCP1RB = 2;
-    else if(CCP1RB >= CCP1PRL)
-        CCP1RB = CCP1PRL - 1;
+    if(compare < 2)
+        compare = 2;
+    else if(compare >= period)
+        compare = period - 1;
     
-    return;
+    return compare;
+}
+
+/* the count a fan's timer starts from, spacing the fans present evenly
+ * across the period */
+uint16_t pwmPhase(uint8_t fan){
+    uint8_t present = 0;
+    uint8_t before = 0;
+    
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        if(FAN_PRESENT(i)){
+            if(i < fan)
+                before++;
+            present++;
+        }
+    }
+    
+    return (uint16_t)(((uint32_t)before * (PWM_PERIOD + 1)) / present);
 }
 
-q15_t rampDc(q15_t dc, q15_t targetDc){
-    const q15_t rampIncrement = 50;
+q15_t rampDc(uint8_t fan, q15_t dc, q15_t targetDc){
+    const q15_t rampIncrement = RAMP_INCREMENT;
     q15_t newDc = 0;
     
-    if(targetDc < MIN_FAN_DC){
+    /* a fan starts at its start duty cycle, which may be above a target
+     * that it is able to run at once turning */
+    if(targetDc < CURVE_getSustainDc(fan)){
         newDc = 0;
-    }else if((targetDc >= MIN_FAN_DC) && (dc == 0)){
-        newDc = MIN_FAN_DC;
+    }else if(dc == 0){
+        newDc = CURVE_getStartDc(fan);
+    }else if(targetDc < dc){
+        newDc = targetDc;
     }else if(targetDc > dc){
         /* ramp the fan to its target */
         q15_t dcDiff = q15_add(targetDc, -dc);
@@ -388,22 +1201,29 @@ void initInterrupts(void){
     CNEN1bits.CN14IE = 1;
     CNEN1bits.CN13IE = 1;
     
+    /* enable CN interrupt for the remaining tach inputs */
+    CNEN2bits.CN16IE = 1;   /* tach fan1 */
+#if FAN_PRESENT(2)
+    CNEN2bits.CN22IE = 1;   /* tach fan2, RB8 is SCL1 when I2C1 is in use */
+#endif
+    CNEN2bits.CN24IE = 1;   /* tach fan3 */
+    
     return;
 }
 
 void initIO(void){
     /* debugging outputs */
-    DIO_makeOutput(DIO_PORT_A, 2);
-    DIO_makeOutput(DIO_PORT_A, 3);
+    DIO_MAKE_OUTPUT(PROFILE_TASK_PIN);
+    DIO_MAKE_OUTPUT(PROFILE_ISR_PIN);
         
     /* encoder inputs */
-    DIO_makeInput(ENC_A_PORT, ENC_A_PIN);
-    DIO_makeInput(ENC_B_PORT, ENC_B_PIN);
-    DIO_makeInput(SWITCH_PORT, SWITCH_PIN);
+    DIO_MAKE_INPUT(ENC_A_PIN);
+    DIO_MAKE_INPUT(ENC_B_PIN);
+    DIO_MAKE_INPUT(SWITCH_PIN);
     
-    DIO_makeDigital(ENC_A_PORT, ENC_A_PIN);
-    DIO_makeDigital(ENC_B_PORT, ENC_B_PIN);
-    DIO_makeDigital(SWITCH_PORT, SWITCH_PIN);
+    DIO_MAKE_DIGITAL(ENC_A_PIN);
+    DIO_MAKE_DIGITAL(ENC_B_PIN);
+    DIO_MAKE_DIGITAL(SWITCH_PIN);
     
     /* enable switch and encoder pull-down resistors */
     CNPD1bits.CN2PDE = 1;
@@ -411,27 +1231,32 @@ void initIO(void){
     CNPD1bits.CN7PDE = 1;
     
     /* fan PWM outputs */
-    DIO_makeOutput(DIO_PORT_B, 12); /* PWM fan0 */
-    DIO_makeOutput(DIO_PORT_A, 7);  /* PWM fan1 */
-    DIO_makeOutput(DIO_PORT_B, 9);  /* PWM fan2 */
-    DIO_makeOutput(DIO_PORT_B, 5);  /* PWM fan3 */
+    DIO_MAKE_OUTPUT(PWM_FAN0_PIN);
+    DIO_MAKE_OUTPUT(PWM_FAN1_PIN);
+    DIO_MAKE_OUTPUT(PWM_FAN2_PIN);
+    DIO_MAKE_OUTPUT(PWM_FAN3_PIN);
     
     /* fan tach inputs */
-    DIO_makeInput(DIO_PORT_B, 13);  /* tach fan0 */
-    DIO_makeInput(DIO_PORT_B, 10);  /* tach fan1 */
-    DIO_makeInput(DIO_PORT_B, 8);   /* tach fan2 */
-    DIO_makeInput(DIO_PORT_B, 6);   /* tach fan3 */
+    DIO_MAKE_INPUT(TACH_FAN0_PIN);
+    DIO_MAKE_INPUT(TACH_FAN1_PIN);
+    DIO_MAKE_INPUT(TACH_FAN2_PIN);
+    DIO_MAKE_INPUT(TACH_FAN3_PIN);
     
-    DIO_makeDigital(DIO_PORT_B, 13);
-    DIO_makeDigital(DIO_PORT_B, 8);
-    DIO_makeDigital(DIO_PORT_B, 6);
+    DIO_MAKE_DIGITAL(TACH_FAN0_PIN);
+    DIO_MAKE_DIGITAL(TACH_FAN2_PIN);
+    DIO_MAKE_DIGITAL(TACH_FAN3_PIN);
     
     /* PWM input, should be configured as an input */
-    DIO_makeInput(DIO_PORT_A, 1);
-    DIO_makeAnalog(DIO_PORT_A, 1);
+    DIO_MAKE_INPUT(INPUT_PWM_PIN);
+    DIO_MAKE_ANALOG(INPUT_PWM_PIN);
     
-    /* tach output */
-    DIO_makeOutput(DIO_PORT_B, 14);
+    /* tach output, left an input where CLC1O drives the motherboard tach
+     * so that the two do not fight where they are tied together */
+#if TACH_PASSTHROUGH
+    DIO_MAKE_INPUT(MB_TACH_PIN);
+#else
+    DIO_MAKE_OUTPUT(MB_TACH_PIN);
+#endif
 }
 
 void initPwm(void){
@@ -439,7 +1264,7 @@ void initPwm(void){
     
     /* period registers */
     CCP1PRH = CCP2PRH = CCP4PRH = CCP5PRH = 0;
-    CCP1PRL = CCP2PRL = CCP4PRL = CCP5PRL = 640;
+    CCP1PRL = CCP2PRL = CCP4PRL = CCP5PRL = PWM_PERIOD;
     
     CCP1CON1L = CCP2CON1L = CCP4CON1L = CCP5CON1L = 0x0005;
     CCP1CON1H = CCP2CON1H = CCP4CON1H = CCP5CON1H = 0x0000;
@@ -447,7 +1272,11 @@ void initPwm(void){
     
     CCP2CON2H = 0x8200; // enable output 0C2B (fan0)
     CCP5CON2H = 0x8100; // enable output OC5 (fan1)
+#if FAN_PRESENT(2)
     CCP4CON2H = 0x8100; // enable output OC4 (fan2)
+#else
+    CCP4CON2H = 0x0000; // RB9 is SDA1, fan2 is not fitted
+#endif
     CCP1CON2H = 0x9000; // enable output OC1E (fan3)
     
     CCP1CON3L = CCP2CON3L = 0;  // dead time disabled
@@ -457,6 +1286,19 @@ void initPwm(void){
     CCP1CON3Hbits.POLACE = CCP4CON3Hbits.POLACE = CCP5CON3Hbits.POLACE = 1;
     CCP2CON3Hbits.POLBDF = 1;
     
+#if PWM_STAGGER
+    /* each output rises as its timer rolls over, so timers preloaded while
+     * the modules are off spread the rising edges, and the current steps
+     * on the 12V rail, across the period; enabling the modules one after
+     * the other skews them by a cycle or two more.  The compare buffers
+     * still load as each timer rolls over, so a new duty cycle takes
+     * effect at the fan's own period boundary without a glitch. */
+    CCP2TMRL = pwmPhase(0);
+    CCP5TMRL = pwmPhase(1);
+    CCP4TMRL = pwmPhase(2);
+    CCP1TMRL = pwmPhase(3);
+#endif
+    
     CCP1CON1Lbits.CCPON = 
             CCP2CON1Lbits.CCPON = 
             CCP4CON1Lbits.CCPON = 
@@ -466,19 +1308,19 @@ void initPwm(void){
     CCP1RA = CCP2RA = CCP4RA = CCP5RA = 0;
     CCP1RB = CCP2RB = CCP4RB = CCP5RB = 0;
     
-    /* set the initial duty cycles */
-    setDutyCycleFan0(0);
-    setDutyCycleFan1(0);
-    setDutyCycleFan2(0);
-    setDutyCycleFan3(0);
+    /* set the initial duty cycles, those the fans ran at before a warm
+     * reset so that they do not dip */
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++)
+        setDutyCycleFan(i, PERSIST_getDc(i));
     
     return;
 }
 
 void initAdc(void){
     /* set up the analog pin as analog inputs */
-    DIO_makeInput(DIO_PORT_A, 1);
-    DIO_makeAnalog(DIO_PORT_A, 1);
+    DIO_MAKE_INPUT(INPUT_PWM_PIN);
+    DIO_MAKE_ANALOG(INPUT_PWM_PIN);
     
     AD1CON1 = 0x0200;   /* Clear sample bit to trigger conversion
                          * FORM = left justified  */
@@ -494,21 +1336,73 @@ void initAdc(void){
     return;
 }
 
+#if TACH_PASSTHROUGH
+void initTachPassthrough(void){
+    CLC1CONL = 0;
+    
+    /* AND-OR mode, (gate 1 & gate 2) | (gate 3 & gate 4): gate 1 passes
+     * data source 1, the CLCINA pin, gate 2 has no inputs and reads 1
+     * once inverted and gates 3 and 4 read 0 */
+    CLC1SELL = 0x0000;      // DS1 = CLCINA
+    CLC1GLSL = 0x0002;      // G1D1T
+    CLC1GLSH = 0x0000;
+    CLC1CONH = 0x0000;
+    holdTachOutput(0);
+    
+    CLC1CONLbits.LCOE = 1;
+    CLC1CONLbits.LCEN = 1;
+    
+    return;
+}
+
+/* gate 2 gates the output, a hold takes it low in the same way as a stalled
+ * fan would */
+void holdTachOutput(uint8_t hold){
+    CLC1CONHbits.G2POL = hold ? 0 : 1;
+}
+#endif
+
 void _ISR _CNInterrupt(void){
+    PROFILE_BEGIN(ePROF_ISR_CN);
     IFS1bits.CNIF = 0;
     
-    /* reflect FAN0 tach to the motherboard tach */
-    static uint8_t lastTachFan0 = 0;
-    uint8_t tachFan0 = PORTBbits.RB13;
-    if(tachFan0 != lastTachFan0){
+    /* gather the tach inputs and time stamp the rising edges */
+    static uint8_t lastTach = 0;
+    uint16_t portb = DIO_READ_PORT(TACH_FAN0_PIN);
+    uint8_t tach = DIO_BIT(portb, TACH_FAN0_PIN)
+            | (DIO_BIT(portb, TACH_FAN1_PIN) << 1)
+            | (DIO_BIT(portb, TACH_FAN2_PIN) << 2)
+            | (DIO_BIT(portb, TACH_FAN3_PIN) << 3);
+    tach &= FAN_PRESENT_MASK;
+    
+    uint8_t risingEdges = tach & ~lastTach;
+    if(risingEdges){
+        uint32_t now = TASK_getTime();
+        
+        uint8_t i;
+        for(i = 0; i < NUM_OF_FANS; i++){
+            if(risingEdges & (1 << i))
+                TACH_edge(i, now);
+        }
+    }
+    
+#if !TACH_PASSTHROUGH
+    /* reflect FAN0 tach to the motherboard tach; a latched stall fault on
+     * any fan, on any board of the chassis or on an expander, holds the
+     * output low so that the motherboard sees a stopped fan and raises its
+     * own alarm */
+    if(STALL_getFaults() || SYNC_getFaults() || EXP_getFaults()){
+        DIO_CLEAR(MB_TACH_PIN);
+    }else if((tach ^ lastTach) & 0x01){
         /* set the output tach based on fan 0 */
-        if(tachFan0 == 0){
-            LATBbits.LATB14 = 0;
+        if((tach & 0x01) == 0){
+            DIO_CLEAR(MB_TACH_PIN);
         }else{
-            LATBbits.LATB14 = 1;
+            DIO_SET(MB_TACH_PIN);
         }
     }
-    lastTachFan0 = tachFan0;
+#endif
+    lastTach = tach;
     
-    LATAbits.LATA2 = 0;
+    PROFILE_END(ePROF_ISR_CN);
 }
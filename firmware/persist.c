@@ -0,0 +1,110 @@
+#include "persist.h"
+#include <stddef.h>
+#include <xc.h>
+
+#define BLOCK_WORDS     (offsetof(PersistBlock, check) / sizeof(uint16_t))
+#define CLOCK_WORDS     (offsetof(PersistClock, check) / sizeof(uint16_t))
+
+PersistBlock persistBlock _PERSISTENT;
+PersistClock persistClock _PERSISTENT;
+
+static uint16_t resetCause = 0;
+static uint8_t warm = 0;
+static uint8_t resuming = 0;
+static uint8_t clockKept = 0;
+
+static uint16_t checksum(const void *block, uint8_t words);
+
+void PERSIST_init(void){
+    resetCause = RCON;
+    RCON &= ~PERSIST_RCON_FLAGS;
+    
+    uint8_t kept = (resetCause & PERSIST_RCON_COLD) == 0;
+    warm = kept
+            && (persistBlock.magic == PERSIST_MAGIC)
+            && (persistBlock.check == checksum(&persistBlock, BLOCK_WORDS));
+    clockKept = kept
+            && (persistClock.magic == PERSIST_CLOCK_MAGIC)
+            && (persistClock.check == checksum(&persistClock, CLOCK_WORDS));
+    
+    /* a block that was not restored must not be found after the next
+     * reset either */
+    if(!warm)
+        PERSIST_invalidate();
+    if(!clockKept)
+        persistClock.magic = 0;
+    resuming = warm;
+}
+
+uint8_t PERSIST_isWarm(void){
+    return warm;
+}
+
+uint16_t PERSIST_getResetCause(void){
+    return resetCause;
+}
+
+uint8_t PERSIST_isResuming(void){
+    return resuming;
+}
+
+void PERSIST_consumeWarm(void){
+    resuming = 0;
+}
+
+q15_t PERSIST_getDc(uint8_t fan){
+    if(!resuming || (fan >= NUM_OF_FANS))
+        return 0;
+    
+    return persistBlock.dc[fan];
+}
+
+uint16_t PERSIST_getRpmTarget(uint8_t fan){
+    if(!resuming || (fan >= NUM_OF_FANS))
+        return 0;
+    
+    return persistBlock.rpmTarget[fan];
+}
+
+void PERSIST_save(const q15_t *dc, const uint16_t *rpmTarget){
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        persistBlock.dc[i] = dc[i];
+        persistBlock.rpmTarget[i] = rpmTarget[i];
+    }
+    
+    persistBlock.magic = PERSIST_MAGIC;
+    persistBlock.check = checksum(&persistBlock, BLOCK_WORDS);
+}
+
+void PERSIST_invalidate(void){
+    persistBlock.magic = 0;
+}
+
+uint8_t PERSIST_getClock(uint16_t *hour, uint16_t *seconds){
+    if(!clockKept)
+        return 0;
+    
+    *hour = persistClock.hour;
+    *seconds = persistClock.seconds;
+    return 1;
+}
+
+void PERSIST_saveClock(uint16_t hour, uint16_t seconds){
+    persistClock.hour = hour;
+    persistClock.seconds = seconds;
+    persistClock.magic = PERSIST_CLOCK_MAGIC;
+    persistClock.check = checksum(&persistClock, CLOCK_WORDS);
+}
+
+/* rotated so that words which trade places change the sum */
+static uint16_t checksum(const void *block, uint8_t words){
+    const uint16_t *word = (const uint16_t *)block;
+    uint16_t sum = 0;
+    
+    uint8_t i;
+    for(i = 0; i < words; i++)
+        sum = ((sum << 1) | (sum >> 15)) + word[i];
+    
+    return ~sum;
+}
@@ -0,0 +1,64 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdint.h>
+#include "libmathq15.h"
+#include "fan.h"
+
+/* RCON flags; a power-on, brown-out or deep sleep reset loses the RAM and
+ * is cold, any other reset (watchdog, software, MCLR, trap) is warm */
+#define PERSIST_RCON_POR        0x0001
+#define PERSIST_RCON_BOR        0x0002
+#define PERSIST_RCON_WDTO       0x0010
+#define PERSIST_RCON_DPSLP      0x0400
+#define PERSIST_RCON_COLD       (PERSIST_RCON_POR | PERSIST_RCON_BOR | PERSIST_RCON_DPSLP)
+#define PERSIST_RCON_FLAGS      0xc6df  // every reset and wake flag
+
+#define PERSIST_MAGIC           0xfa25
+#define PERSIST_CLOCK_MAGIC     0xc10c
+
+/* RAM that the start-up code leaves alone, written on every run of the fan
+ * task while the fans run normally and invalidated in the other states */
+typedef struct {
+    uint16_t magic;
+    q15_t dc[NUM_OF_FANS];
+    uint16_t rpmTarget[NUM_OF_FANS];
+    uint16_t check;
+}PersistBlock;
+
+extern PersistBlock persistBlock;
+
+/* the black box's run hour and the seconds into it, kept across a warm
+ * reset whatever state the fans were in */
+typedef struct {
+    uint16_t magic;
+    uint16_t hour;
+    uint16_t seconds;
+    uint16_t check;
+}PersistClock;
+
+extern PersistClock persistClock;
+
+/* reads and clears the reset cause, to be called before the outputs are
+ * set up; the block is kept only on a warm reset that finds it intact */
+void PERSIST_init(void);
+uint8_t PERSIST_isWarm(void);
+uint16_t PERSIST_getResetCause(void);
+
+/* after a warm reset the fans resume until the first initialization has
+ * consumed the block, later ones soft-start as after a cold reset */
+uint8_t PERSIST_isResuming(void);
+void PERSIST_consumeWarm(void);
+
+/* the duty cycle and RPM target to resume with, 0 when not resuming */
+q15_t PERSIST_getDc(uint8_t fan);
+uint16_t PERSIST_getRpmTarget(uint8_t fan);
+
+void PERSIST_save(const q15_t *dc, const uint16_t *rpmTarget);
+void PERSIST_invalidate(void);
+
+/* returns 0 when the clock was not kept */
+uint8_t PERSIST_getClock(uint16_t *hour, uint16_t *seconds);
+void PERSIST_saveClock(uint16_t hour, uint16_t seconds);
+
+#endif
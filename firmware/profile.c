@@ -0,0 +1,61 @@
+#include "profile.h"
+
+#if PROFILE_ENABLED
+uint16_t profileStart[ePROF_NUM_OF_REGIONS];
+uint16_t profileLast[ePROF_NUM_OF_REGIONS];     // latest duration
+uint16_t profileMax[ePROF_NUM_OF_REGIONS];
+uint16_t profileEnds[ePROF_NUM_OF_REGIONS];     // runs, wrapping
+static uint16_t binned[ePROF_NUM_OF_REGIONS];   // runs at the last pass
+static ProfileStats stats[ePROF_NUM_OF_REGIONS];
+
+void PROFILE_init(void){
+    uint8_t i, j;
+    for(i = 0; i < ePROF_NUM_OF_REGIONS; i++){
+        profileMax[i] = 0;
+        profileEnds[i] = 0;
+        binned[i] = 0;
+        stats[i].count = 0;
+        stats[i].max = 0;
+        for(j = 0; j < PROFILE_NUM_OF_BINS; j++)
+            stats[i].bins[j] = 0;
+    }
+    
+    /* Timer1 free runs at Fcy/8 so that regions up to 32ms may be timed,
+     * the CCP3 timer used by the scheduler rolls over every 1ms */
+    PR1 = 0xffff;
+    T1CON = 0x8010;
+}
+
+/* the markers may interrupt this pass, each word is read once so that a
+ * run that ends meanwhile is counted at the next pass */
+void PROFILE_service(void){
+    uint8_t id;
+    for(id = 0; id < ePROF_NUM_OF_REGIONS; id++){
+        ProfileStats *s = &stats[id];
+        uint16_t ends = profileEnds[id];
+        uint16_t runs = ends - binned[id];
+        if(runs == 0)
+            continue;
+        binned[id] = ends;
+        
+        s->count += runs;
+        s->max = profileMax[id];
+        
+        uint16_t duration = profileLast[id];
+        uint8_t bin = 0;
+        uint16_t limit = 8;
+        while((bin < (PROFILE_NUM_OF_BINS - 1)) && (duration >= limit)){
+            bin++;
+            limit <<= 1;
+        }
+        
+        /* saturate rather than wrap */
+        uint32_t total = (uint32_t)s->bins[bin] + runs;
+        s->bins[bin] = (total > 0xffff) ? 0xffff : (uint16_t)total;
+    }
+}
+
+const ProfileStats *PROFILE_getStats(uint8_t id){
+    return (id < ePROF_NUM_OF_REGIONS) ? &stats[id] : 0;
+}
+#endif
@@ -0,0 +1,68 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <xc.h>
+#include "dio.h"
+
+/* the profiling layer is compiled out unless enabled */
+#ifndef PROFILE_ENABLED
+#define PROFILE_ENABLED     0
+#endif
+
+#define PROFILE_NUM_OF_BINS 8
+
+/* high while a task runs and while an interrupt runs */
+#define PROFILE_TASK_PIN    A, 2
+#define PROFILE_ISR_PIN     A, 3
+
+/* profiled regions; tasks are numbered by their slot in the scheduler */
+typedef enum {
+    ePROF_TASK0,
+    ePROF_TASK_LAST = ePROF_TASK0 + 9,
+    ePROF_EEPROM_WRITE,
+    ePROF_ISR_CCT3,
+    ePROF_ISR_CN,
+    ePROF_ISR_U1TX,
+    ePROF_ISR_U1RX,
+    ePROF_NUM_OF_REGIONS
+}ProfileRegion;
+
+/* durations are in Timer1 counts of 0.5us, bin n holds the durations
+ * below 4us << n and the last bin holds everything longer; the count and
+ * max are exact, the bins are filled by PROFILE_service() which credits
+ * every run since its last pass with the latest duration */
+typedef struct {
+    uint32_t count;
+    uint16_t max;
+    uint16_t bins[PROFILE_NUM_OF_BINS];
+}ProfileStats;
+
+#if PROFILE_ENABLED
+extern uint16_t profileStart[ePROF_NUM_OF_REGIONS];
+extern uint16_t profileLast[ePROF_NUM_OF_REGIONS];
+extern uint16_t profileMax[ePROF_NUM_OF_REGIONS];
+extern uint16_t profileEnds[ePROF_NUM_OF_REGIONS];
+
+/* EEPROM_write only runs from tasks and so is not given a pin */
+#define PROFILE_PIN_SET(id)     do{ if((id) >= ePROF_ISR_CCT3) DIO_SET(PROFILE_ISR_PIN); \
+                                    else if((id) <= ePROF_TASK_LAST) DIO_SET(PROFILE_TASK_PIN); }while(0)
+#define PROFILE_PIN_CLEAR(id)   do{ if((id) >= ePROF_ISR_CCT3) DIO_CLEAR(PROFILE_ISR_PIN); \
+                                    else if((id) <= ePROF_TASK_LAST) DIO_CLEAR(PROFILE_TASK_PIN); }while(0)
+
+#define PROFILE_BEGIN(id)   do{ PROFILE_PIN_SET(id); profileStart[(id)] = TMR1; }while(0)
+/* only the raw duration is kept here, the binning is left to the background */
+#define PROFILE_END(id)     do{ uint16_t d_ = TMR1 - profileStart[(id)]; profileLast[(id)] = d_; \
+                                if(d_ > profileMax[(id)]) profileMax[(id)] = d_; \
+                                profileEnds[(id)]++; PROFILE_PIN_CLEAR(id); }while(0)
+
+void PROFILE_init(void);
+void PROFILE_service(void);
+const ProfileStats *PROFILE_getStats(uint8_t id);
+#else
+#define PROFILE_BEGIN(id)
+#define PROFILE_END(id)
+#define PROFILE_init()
+#endif
+
+#endif
@@ -0,0 +1,184 @@
+#include "smbus.h"
+#include "i2c.h"
+#include "fan.h"
+#include "tach.h"
+#include "stall.h"
+
+#if SMBUS_ENABLED
+#define QUEUE_LENGTH    4       // writes not yet taken by the control loop
+
+typedef struct {
+    uint8_t setting[NUM_OF_FANS];
+    uint8_t readingHigh[NUM_OF_FANS];
+    uint8_t readingLow[NUM_OF_FANS];
+    uint16_t target[NUM_OF_FANS];
+    uint8_t rpmTargetHigh[NUM_OF_FANS];
+    uint8_t rpmTargetLow[NUM_OF_FANS];
+    uint8_t stall;
+    uint8_t state;
+    uint8_t input;
+    uint16_t updates;
+}Snapshot;
+
+/* the interrupt reads the active snapshot while the control loop fills
+ * the other; a read latches the one it started on until its stop */
+static Snapshot snapshot[2];
+static volatile uint8_t activeSnapshot = 0;
+static volatile uint8_t readingSnapshot = 0;
+static uint16_t updates = 0;
+
+static SmbusWrite queue[QUEUE_LENGTH];
+static volatile uint8_t queueHead = 0;
+static volatile uint8_t queueTail = 0;
+static uint8_t targetLow[NUM_OF_FANS];
+static uint8_t rpmTargetLow[NUM_OF_FANS];
+
+static uint8_t readRegister(uint8_t reg, uint8_t first);
+static void received(const uint8_t *data, uint8_t length);
+static void queueWrite(SmbusWriteType type, uint8_t fan, uint16_t value);
+static uint16_t rpmToCount(uint16_t rpm);
+
+void SMBUS_init(void){
+    I2C_initFollower(SMBUS_ADDRESS, &received);
+    I2C_setReadHandler(&readRegister);
+}
+
+uint8_t SMBUS_publish(uint8_t state, q15_t input, const q15_t *outputDc, const q15_t *targetDc,
+        const uint16_t *targetRpm){
+    uint16_t lock = I2C_lock();
+    uint8_t spare = activeSnapshot ^ 1;
+    uint8_t held = I2C_readInProgress() && (readingSnapshot == spare);
+    I2C_unlock(lock);
+    
+    if(held)
+        return 0;
+    
+    Snapshot *s = &snapshot[spare];
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        /* 0 to 255 as on the EMC230x fan setting */
+        s->setting[i] = (outputDc[i] > 0) ? (uint8_t)((uint16_t)outputDc[i] >> 7) : 0;
+        s->target[i] = targetDc[i];
+        
+        /* the count is split as on the EMC230x, high bits then the low
+         * five bits in the top of the second byte */
+        uint16_t count = rpmToCount(TACH_getRpm(i));
+        s->readingHigh[i] = (uint8_t)(count >> 5);
+        s->readingLow[i] = (uint8_t)(count << 3);
+        
+        count = rpmToCount(targetRpm[i]);
+        s->rpmTargetHigh[i] = (uint8_t)(count >> 5);
+        s->rpmTargetLow[i] = (uint8_t)(count << 3);
+    }
+    s->stall = STALL_getFaults();
+    s->state = state;
+    s->input = (input > 0) ? (uint8_t)((uint16_t)input >> 7) : 0;
+    s->updates = ++updates;
+    
+    activeSnapshot = spare;
+    
+    return 1;
+}
+
+uint8_t SMBUS_receive(SmbusWrite *write){
+    if(queueTail == queueHead)
+        return 0;
+    
+    *write = queue[queueTail];
+    queueTail = (queueTail + 1) % QUEUE_LENGTH;
+    
+    return 1;
+}
+
+/* called from the I2C interrupt */
+static uint8_t readRegister(uint8_t reg, uint8_t first){
+    if(first)
+        readingSnapshot = activeSnapshot;
+    const Snapshot *s = &snapshot[readingSnapshot];
+    
+    if((reg >= SMBUS_REG_FAN_BASE) && (reg < (SMBUS_REG_FAN_BASE + (NUM_OF_FANS << 4)))){
+        uint8_t fan = (reg - SMBUS_REG_FAN_BASE) >> 4;
+        switch(reg & 0x0f){
+            case SMBUS_FAN_SETTING:         return s->setting[fan];
+            case SMBUS_FAN_TARGET_LOW:      return s->rpmTargetLow[fan];
+            case SMBUS_FAN_TARGET_HIGH:     return s->rpmTargetHigh[fan];
+            case SMBUS_FAN_READING_HIGH:    return s->readingHigh[fan];
+            case SMBUS_FAN_READING_LOW:     return s->readingLow[fan];
+            default:                        return 0;
+        }
+    }
+    
+    if((reg >= SMBUS_REG_TARGET_BASE) && (reg < (SMBUS_REG_TARGET_BASE + (NUM_OF_FANS << 1)))){
+        uint16_t target = s->target[(reg - SMBUS_REG_TARGET_BASE) >> 1];
+        return (reg & 1) ? (uint8_t)(target >> 8) : (uint8_t)target;
+    }
+    
+    switch(reg){
+        case SMBUS_REG_FAN_STATUS:      return s->stall ? 0x01 : 0;
+        case SMBUS_REG_STALL_STATUS:    return s->stall;
+        case SMBUS_REG_STATE:           return s->state;
+        case SMBUS_REG_INPUT:           return s->input;
+        case SMBUS_REG_UPDATE_LOW:      return (uint8_t)s->updates;
+        case SMBUS_REG_UPDATE_HIGH:     return (uint8_t)(s->updates >> 8);
+        case SMBUS_REG_PRODUCT_ID:      return 0x34;    // EMC2305
+        case SMBUS_REG_MANUFACTURER:    return 0x5d;
+        case SMBUS_REG_REVISION:        return 0x80;
+        default:                        return 0;
+    }
+}
+
+/* a write is the register followed by its data, with the register
+ * incremented for each byte */
+static void received(const uint8_t *data, uint8_t length){
+    uint8_t reg = data[0];
+    uint8_t i;
+    
+    for(i = 1; i < length; i++, reg++){
+        uint8_t value = data[i];
+        
+        if((reg >= SMBUS_REG_FAN_BASE) && (reg < (SMBUS_REG_FAN_BASE + (NUM_OF_FANS << 4)))){
+            uint8_t fan = (reg - SMBUS_REG_FAN_BASE) >> 4;
+            
+            if((reg & 0x0f) == SMBUS_FAN_SETTING){
+                /* the setting becomes the fan's target, scaled by the input
+                 * as an encoder adjustment is, but is not kept over a reset */
+                uint16_t dc = (value == 0xff) ? 32767 : ((uint16_t)value << 7);
+                queueWrite(eSMBUS_SET_TARGET, fan, dc);
+            }else if((reg & 0x0f) == SMBUS_FAN_TARGET_LOW){
+                rpmTargetLow[fan] = value;
+            }else if((reg & 0x0f) == SMBUS_FAN_TARGET_HIGH){
+                /* the RPM loop runs from the target, 0x1fff stops it */
+                uint16_t count = ((uint16_t)value << 5) | (rpmTargetLow[fan] >> 3);
+                uint16_t rpm = ((count == 0) || (count >= SMBUS_MAX_COUNT)) ? 0 : (uint16_t)(SMBUS_RPM_FACTOR / count);
+                queueWrite(eSMBUS_SET_RPM, fan, rpm);
+            }
+        }else if((reg >= SMBUS_REG_TARGET_BASE) && (reg < (SMBUS_REG_TARGET_BASE + (NUM_OF_FANS << 1)))){
+            uint8_t fan = (reg - SMBUS_REG_TARGET_BASE) >> 1;
+            if((reg & 1) == 0)
+                targetLow[fan] = value;
+            else
+                queueWrite(eSMBUS_SAVE_TARGET, fan, targetLow[fan] | ((uint16_t)value << 8));
+        }
+    }
+}
+
+static void queueWrite(SmbusWriteType type, uint8_t fan, uint16_t value){
+    uint8_t next = (queueHead + 1) % QUEUE_LENGTH;
+    
+    /* a full queue drops the write, the host reads back the target */
+    if(next == queueTail)
+        return;
+    
+    queue[queueHead].type = type;
+    queue[queueHead].fan = fan;
+    queue[queueHead].value = value;
+    queueHead = next;
+}
+
+static uint16_t rpmToCount(uint16_t rpm){
+    if(rpm <= (SMBUS_RPM_FACTOR / SMBUS_MAX_COUNT))
+        return SMBUS_MAX_COUNT;
+    
+    return (uint16_t)(SMBUS_RPM_FACTOR / rpm);
+}
+#endif
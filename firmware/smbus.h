@@ -0,0 +1,71 @@
+#ifndef SMBUS_H
+#define SMBUS_H
+
+#include <stdint.h>
+#include "libmathq15.h"
+#include "sync.h"
+
+/* SMBus target with a register map laid out like the EMC230x fan
+ * controllers, on I2C1, which takes the fan2 pins */
+#ifndef SMBUS_ENABLED
+#define SMBUS_ENABLED       0
+#endif
+
+#ifndef SMBUS_ADDRESS
+#define SMBUS_ADDRESS       0x2e
+#endif
+
+#if SMBUS_ENABLED && SYNC_ENABLED
+#error "SMBus and chassis synchronization both need I2C1"
+#endif
+
+/* EMC230x registers; fan n (0 to 3) is at SMBUS_REG_FAN_BASE + 16 * n */
+#define SMBUS_REG_CONFIG        0x20
+#define SMBUS_REG_FAN_STATUS    0x24
+#define SMBUS_REG_STALL_STATUS  0x25
+#define SMBUS_REG_SPIN_STATUS   0x26
+#define SMBUS_REG_DRIVE_FAIL    0x27
+#define SMBUS_REG_FAN_BASE      0x30
+#define SMBUS_FAN_SETTING       0x00    // duty cycle, 0 to 255
+#define SMBUS_FAN_TARGET_LOW    0x0c    // tach target, 0xfff8 when the input is followed
+#define SMBUS_FAN_TARGET_HIGH   0x0d
+#define SMBUS_FAN_READING_HIGH  0x0e    // tach count, see SMBUS_RPM_FACTOR
+#define SMBUS_FAN_READING_LOW   0x0f
+#define SMBUS_REG_PRODUCT_ID    0xfd
+#define SMBUS_REG_MANUFACTURER  0xfe
+#define SMBUS_REG_REVISION      0xff
+
+/* registers of this board: the target duty cycles, q15 little endian and
+ * saved to EEPROM when written, then the state machine */
+#define SMBUS_REG_TARGET_BASE   0xe0
+#define SMBUS_REG_STATE         0xf0
+#define SMBUS_REG_INPUT         0xf1    // motherboard duty cycle, 0 to 255
+#define SMBUS_REG_UPDATE_LOW    0xf2    // counts snapshot updates
+#define SMBUS_REG_UPDATE_HIGH   0xf3
+
+/* the tach count reads as SMBUS_RPM_FACTOR / RPM, as on the EMC2305 */
+#define SMBUS_RPM_FACTOR        3932160UL
+#define SMBUS_MAX_COUNT         0x1fff
+
+typedef enum {eSMBUS_SET_TARGET, eSMBUS_SAVE_TARGET, eSMBUS_SET_RPM} SmbusWriteType;
+
+typedef struct {
+    SmbusWriteType type;
+    uint8_t fan;
+    uint16_t value;     // q15 target duty cycle or RPM target, 0 for none
+}SmbusWrite;
+
+#if SMBUS_ENABLED
+void SMBUS_init(void);
+
+/* called by the control loop to refresh the registers; returns 0 when a
+ * read still holds the spare snapshot, the update then waits for the
+ * next call */
+uint8_t SMBUS_publish(uint8_t state, q15_t input, const q15_t *outputDc, const q15_t *targetDc,
+        const uint16_t *targetRpm);
+
+/* target writes by the host, returns 0 when there are none */
+uint8_t SMBUS_receive(SmbusWrite *write);
+#endif
+
+#endif
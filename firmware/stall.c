@@ -0,0 +1,175 @@
+#include "stall.h"
+#include "tach.h"
+#include "fan.h"
+#include "curve.h"
+
+typedef struct {
+    uint16_t minRpm;
+    uint16_t timeout;
+}StallBand;
+
+typedef struct {
+    StallState state;
+    uint8_t retries;
+    uint32_t stateTime;     // time that the current state was entered
+    uint16_t lastRpm;       // last non-zero RPM, used to select the band
+    q15_t commandedDc;
+}FanStall;
+
+/* the time that may pass without a tach edge before a fan is considered
+ * stalled, based on the last RPM the fan was running at; slow fans
+ * have longer tach periods and so need longer timeouts */
+static const StallBand stallBands[] = {
+    {3000, 250},
+    {1000, 500},
+    {0, 1000}
+};
+
+static FanStall fanStall[NUM_OF_FANS];
+static uint8_t faults = 0;
+
+uint8_t STALL_isStalled(uint8_t fan, uint32_t now);
+void STALL_setState(uint8_t fan, StallState state, uint32_t now);
+
+void STALL_init(void){
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        fanStall[i].state = eSTALL_OK;
+        fanStall[i].retries = 0;
+        fanStall[i].stateTime = 0;
+        fanStall[i].lastRpm = 0;
+        fanStall[i].commandedDc = 0;
+    }
+    
+    faults = 0;
+}
+
+/* run once per control period, returns non-zero when the duty cycle
+ * override of any fan has changed and the outputs must be rewritten */
+uint8_t STALL_service(uint32_t now){
+    uint8_t changed = 0;
+    
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        FanStall *fs = &fanStall[i];
+        StallState lastState = fs->state;
+        
+        uint16_t rpm = TACH_getRpm(i);
+        if(rpm > 0)
+            fs->lastRpm = rpm;
+        
+        /* a fan that is commanded off cannot stall, but a latched
+         * fault stays latched; the state time keeps moving so that a fan
+         * which is turned on gets the full timeout to spin up */
+        if((fs->commandedDc < CURVE_getSustainDc(i)) && (fs->state != eSTALL_FAULT)){
+            fs->state = eSTALL_OK;
+            fs->retries = 0;
+            fs->stateTime = now;
+            fs->lastRpm = 0;
+            continue;
+        }
+        
+        switch(fs->state){
+            case eSTALL_OK:
+            {
+                if(STALL_isStalled(i, now)){
+                    fs->retries++;
+                    STALL_setState(i, eSTALL_KICK, now);
+                }
+                break;
+            }
+            
+            case eSTALL_KICK:
+            {
+                if((now - fs->stateTime) >= STALL_KICK_TIME)
+                    STALL_setState(i, eSTALL_RECOVER, now);
+                break;
+            }
+            
+            case eSTALL_RECOVER:
+            {
+                /* the fan coasts for a while after the kick, so it has to
+                 * keep producing edges for the whole recovery time */
+                if(STALL_isStalled(i, now)){
+                    if(fs->retries >= STALL_MAX_RETRIES){
+                        STALL_setState(i, eSTALL_FAULT, now);
+                        faults |= (1 << i);
+                    }else{
+                        STALL_setState(i, eSTALL_BACKOFF, now);
+                    }
+                }else if((now - fs->stateTime) >= STALL_RECOVER_TIME){
+                    fs->retries = 0;
+                    STALL_setState(i, eSTALL_OK, now);
+                }
+                break;
+            }
+            
+            case eSTALL_BACKOFF:
+            {
+                uint32_t backoff = (uint32_t)STALL_BACKOFF_TIME << (fs->retries - 1);
+                if((now - fs->stateTime) >= backoff){
+                    fs->retries++;
+                    STALL_setState(i, eSTALL_KICK, now);
+                }
+                break;
+            }
+            
+            case eSTALL_FAULT:
+            default:
+                break;
+        }
+        
+        if(fs->state != lastState)
+            changed = 1;
+    }
+    
+    return changed;
+}
+
+/* records the duty cycle the control loop wants and returns the duty
+ * cycle that should actually be applied to the fan */
+q15_t STALL_dutyCycle(uint8_t fan, q15_t commandedDc){
+    if(fan >= NUM_OF_FANS)
+        return commandedDc;
+    
+    FanStall *fs = &fanStall[fan];
+    fs->commandedDc = commandedDc;
+    
+    if(fs->state == eSTALL_KICK)
+        return 32767;
+    
+    return commandedDc;
+}
+
+StallState STALL_getState(uint8_t fan){
+    return (fan < NUM_OF_FANS) ? fanStall[fan].state : eSTALL_OK;
+}
+
+uint8_t STALL_getFaults(void){
+    return faults;
+}
+
+uint8_t STALL_isStalled(uint8_t fan, uint32_t now){
+    FanStall *fs = &fanStall[fan];
+    
+    uint16_t timeout = 0;
+    uint8_t i;
+    for(i = 0; i < (sizeof(stallBands)/sizeof(StallBand)); i++){
+        timeout = stallBands[i].timeout;
+        if(fs->lastRpm >= stallBands[i].minRpm)
+            break;
+    }
+    
+    /* measure from the later of the last edge and the state entry so that
+     * edges from before a kick or spin-up do not count against the fan */
+    uint32_t reference = TACH_getLastEdgeTime(fan);
+    if(fs->stateTime > reference)
+        reference = fs->stateTime;
+    
+    return ((now > reference) && ((now - reference) > timeout));
+}
+
+void STALL_setState(uint8_t fan, StallState state, uint32_t now){
+    fanStall[fan].state = state;
+    fanStall[fan].stateTime = now;
+}
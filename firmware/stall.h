@@ -0,0 +1,21 @@
+#ifndef STALL_H
+#define STALL_H
+
+#include <stdint.h>
+#include "libmathq15.h"
+
+typedef enum {eSTALL_OK, eSTALL_KICK, eSTALL_RECOVER, eSTALL_BACKOFF, eSTALL_FAULT} StallState;
+
+#define STALL_KICK_TIME         500     // full-duty kick, in ms
+#define STALL_RECOVER_TIME      3000    // tach must be present this long after a kick
+#define STALL_BACKOFF_TIME      1000    // doubled after each failed retry
+#define STALL_MAX_RETRIES       3
+
+void STALL_init(void);
+uint8_t STALL_service(uint32_t now);
+q15_t STALL_dutyCycle(uint8_t fan, q15_t commandedDc);
+
+StallState STALL_getState(uint8_t fan);
+uint8_t STALL_getFaults(void);
+
+#endif
@@ -0,0 +1,197 @@
+#include "sync.h"
+#include "i2c.h"
+#include "task.h"
+#include "eeprom.h"
+#include "fan.h"
+#include "tach.h"
+#include "stall.h"
+
+#if SYNC_ENABLED
+typedef struct {
+    uint8_t present;
+    uint8_t missed;
+    uint8_t seq;
+    uint8_t faults;
+    uint16_t rpm[NUM_OF_FANS];
+}Follower;
+
+static uint8_t role = 0;    // 0 for the master, else the follower number
+static void (*triggerTask)(void) = 0;
+
+/* master */
+static uint8_t seq = 0;
+static uint8_t pollFollower = SYNC_MAX_FOLLOWERS;
+static uint8_t pollFrame[SYNC_STATUS_LENGTH];
+static Follower followers[SYNC_MAX_FOLLOWERS];
+
+/* follower, written by the I2C interrupt */
+static volatile uint8_t rxValid = 0;
+static volatile uint8_t rxSeq;
+static volatile q15_t rxInput;
+static volatile uint32_t rxTime;
+static uint8_t appliedSeq = 0;
+
+static void broadcastDone(I2cStatus status);
+static void pollDone(I2cStatus status);
+static void received(const uint8_t *data, uint8_t length);
+
+void SYNC_init(void (*controlTask)(void)){
+    uint16_t r = EEPROM_read(SYNC_ROLE_EEPROM);
+    role = ((r >= 1) && (r <= SYNC_MAX_FOLLOWERS)) ? r : 0;
+    triggerTask = controlTask;
+    
+    uint8_t i;
+    for(i = 0; i < SYNC_MAX_FOLLOWERS; i++){
+        followers[i].present = 0;
+        followers[i].missed = 0;
+        followers[i].faults = 0;
+    }
+    
+    if(role == 0)
+        I2C_initMaster();
+    else
+        I2C_initFollower(SYNC_BASE_ADDRESS + role, &received);
+}
+
+uint8_t SYNC_isFollower(void){
+    return role != 0;
+}
+
+/* sends the input to every follower at once, returns 0 when the bus was
+ * still busy with the previous period's transfers */
+uint8_t SYNC_publish(q15_t input){
+    uint8_t frame[SYNC_INPUT_LENGTH];
+    frame[0] = SYNC_MSG_INPUT;
+    frame[1] = seq + 1;
+    frame[2] = (uint8_t)input;
+    frame[3] = (uint8_t)((uint16_t)input >> 8);
+    
+    if(!I2C_write(I2C_GENERAL_CALL, frame, SYNC_INPUT_LENGTH, &broadcastDone))
+        return 0;
+    
+    seq++;
+    return 1;
+}
+
+uint8_t SYNC_getSeq(void){
+    return seq;
+}
+
+/* bit n - 1 is set for follower n when it reports a fault or has stopped
+ * answering */
+uint8_t SYNC_getFaults(void){
+    uint8_t faults = 0;
+    uint8_t i;
+    
+    for(i = 0; i < SYNC_MAX_FOLLOWERS; i++){
+        const Follower *f = &followers[i];
+        if(f->present && (f->faults || (f->missed >= SYNC_MAX_MISSED)))
+            faults |= 1 << i;
+    }
+    
+    return faults;
+}
+
+uint8_t SYNC_getPresent(void){
+    uint8_t present = 0;
+    uint8_t i;
+    
+    for(i = 0; i < SYNC_MAX_FOLLOWERS; i++){
+        if(followers[i].present)
+            present |= 1 << i;
+    }
+    
+    return present;
+}
+
+uint16_t SYNC_getRpm(uint8_t follower, uint8_t fan){
+    if((follower < 1) || (follower > SYNC_MAX_FOLLOWERS) || (fan >= NUM_OF_FANS))
+        return 0;
+    
+    uint16_t lock = I2C_lock();
+    uint16_t rpm = followers[follower - 1].rpm[fan];
+    I2C_unlock(lock);
+    
+    return rpm;
+}
+
+/* takes the latest input from the master and reports back the status of
+ * this board, returns 0 when the master has gone quiet */
+uint8_t SYNC_followInput(q15_t *input){
+    uint16_t lock = I2C_lock();
+    uint8_t valid = rxValid;
+    uint8_t s = rxSeq;
+    q15_t in = rxInput;
+    uint32_t t = rxTime;
+    I2C_unlock(lock);
+    
+    uint8_t fresh = valid && ((TASK_getTime() - t) <= SYNC_TIMEOUT);
+    if(fresh){
+        *input = in;
+        appliedSeq = s;
+    }
+    
+    uint8_t frame[SYNC_STATUS_LENGTH];
+    uint8_t *p = frame;
+    *p++ = appliedSeq;
+    *p++ = STALL_getFaults();
+    
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        uint16_t rpm = TACH_getRpm(i);
+        *p++ = (uint8_t)rpm;
+        *p++ = (uint8_t)(rpm >> 8);
+    }
+    I2C_setResponse(frame, SYNC_STATUS_LENGTH);
+    
+    return fresh;
+}
+
+uint8_t SYNC_getAppliedSeq(void){
+    return appliedSeq;
+}
+
+/* the status reads are batched behind the broadcasts, one follower in
+ * turn, so that the bus carries two transfers per control period */
+static void broadcastDone(I2cStatus status){
+    (void)status;
+    
+    pollFollower++;
+    if(pollFollower > SYNC_MAX_FOLLOWERS)
+        pollFollower = 1;
+    
+    I2C_read(SYNC_BASE_ADDRESS + pollFollower, pollFrame, SYNC_STATUS_LENGTH, &pollDone);
+}
+
+static void pollDone(I2cStatus status){
+    Follower *f = &followers[pollFollower - 1];
+    
+    if(status == eI2C_DONE){
+        f->present = 1;
+        f->missed = 0;
+        f->seq = pollFrame[0];
+        f->faults = pollFrame[1];
+        
+        uint8_t i;
+        for(i = 0; i < NUM_OF_FANS; i++)
+            f->rpm[i] = pollFrame[2 + (i << 1)] | ((uint16_t)pollFrame[3 + (i << 1)] << 8);
+    }else if(f->missed < SYNC_MAX_MISSED){
+        f->missed++;
+    }
+}
+
+static void received(const uint8_t *data, uint8_t length){
+    if((length < SYNC_INPUT_LENGTH) || (data[0] != SYNC_MSG_INPUT))
+        return;
+    
+    rxSeq = data[1];
+    rxInput = (q15_t)(data[2] | ((uint16_t)data[3] << 8));
+    rxTime = TASK_getTime();
+    rxValid = 1;
+    
+    /* run the control task now rather than at its next period so the
+     * whole chassis answers the same input together */
+    if(triggerTask != 0)
+        TASK_trigger(triggerTask);
+}
+#endif
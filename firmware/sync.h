@@ -0,0 +1,52 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdint.h>
+#include "libmathq15.h"
+
+/* chassis synchronization over I2C1, which takes the fan2 pins */
+#ifndef SYNC_ENABLED
+#define SYNC_ENABLED        0
+#endif
+
+/* the role is read from EEPROM at start-up: 1 to SYNC_MAX_FOLLOWERS makes
+ * the board that follower, anything else makes it the master */
+#define SYNC_ROLE_EEPROM    0x10
+#define SYNC_MAX_FOLLOWERS  7
+#define SYNC_BASE_ADDRESS   0x30    // follower n answers at base + n
+
+/* a follower that has not heard the master for this long falls back to
+ * the failsafe demand, which runs its fans at their targets */
+#define SYNC_TIMEOUT        500     // ms
+#define SYNC_MAX_MISSED     3       // polls before a follower counts as lost
+
+/* master to all followers by general call:
+ *  [SYNC_MSG_INPUT][seq][input low][input high]
+ * only the input is shared, each follower runs its own state machine,
+ * targets and curves from it
+ * follower status, read by the master after each broadcast, one follower
+ * in turn:
+ *  [last applied seq][faults][rpm low][rpm high] x NUM_OF_FANS */
+#define SYNC_MSG_INPUT      0x51
+#define SYNC_INPUT_LENGTH   4
+#define SYNC_STATUS_LENGTH  10
+
+#if SYNC_ENABLED
+void SYNC_init(void (*controlTask)(void));
+uint8_t SYNC_isFollower(void);
+
+/* master */
+uint8_t SYNC_publish(q15_t input);
+uint8_t SYNC_getSeq(void);
+uint8_t SYNC_getFaults(void);
+uint8_t SYNC_getPresent(void);
+uint16_t SYNC_getRpm(uint8_t follower, uint8_t fan);
+
+/* follower */
+uint8_t SYNC_followInput(q15_t *input);
+uint8_t SYNC_getAppliedSeq(void);
+#else
+#define SYNC_getFaults()    0
+#endif
+
+#endif
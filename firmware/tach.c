@@ -0,0 +1,82 @@
+#include "tach.h"
+#include "fan.h"
+#include "trace.h"
+#include <xc.h>
+
+typedef struct {
+    uint16_t edgeCount;
+    uint32_t firstEdgeTime;
+    uint32_t lastEdgeTime;
+}TachEdges;
+
+static volatile TachEdges edges[NUM_OF_FANS];
+static uint16_t rpm[NUM_OF_FANS];
+static uint8_t window = 0;
+
+void TACH_init(void){
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        edges[i].edgeCount = 0;
+        edges[i].firstEdgeTime = 0;
+        edges[i].lastEdgeTime = 0;
+        rpm[i] = 0;
+    }
+}
+
+/* called from the change notification interrupt on each rising tach edge */
+void TACH_edge(uint8_t fan, uint32_t time){
+    if(fan >= NUM_OF_FANS)
+        return;
+    
+    if(edges[fan].edgeCount == 0)
+        edges[fan].firstEdgeTime = time;
+    
+    edges[fan].lastEdgeTime = time;
+    edges[fan].edgeCount++;
+}
+
+void TACH_service(void){
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        /* take a consistent copy of the edge data and start a new window */
+        IEC1bits.CNIE = 0;
+        uint16_t count = edges[i].edgeCount;
+        uint32_t first = edges[i].firstEdgeTime;
+        uint32_t last = edges[i].lastEdgeTime;
+        edges[i].edgeCount = 0;
+        IEC1bits.CNIE = 1;
+        
+        /* the time between the first and last edges of the window
+         * covers (count - 1) tach periods */
+        if((count >= 2) && (last > first)){
+            uint32_t periods = (uint32_t)(count - 1) * 60000UL;
+            rpm[i] = (uint16_t)(periods / (TACH_PULSES_PER_REV * (last - first)));
+        }else{
+            rpm[i] = 0;
+        }
+        
+        TRACE_tach(i, rpm[i]);
+    }
+    
+    window++;
+}
+
+/* counts the windows measured, so that a reader can tell a new reading */
+uint8_t TACH_getWindow(void){
+    return window;
+}
+
+uint16_t TACH_getRpm(uint8_t fan){
+    return (fan < NUM_OF_FANS) ? rpm[fan] : 0;
+}
+
+uint32_t TACH_getLastEdgeTime(uint8_t fan){
+    if(fan >= NUM_OF_FANS)
+        return 0;
+    
+    IEC1bits.CNIE = 0;
+    uint32_t time = edges[fan].lastEdgeTime;
+    IEC1bits.CNIE = 1;
+    
+    return time;
+}
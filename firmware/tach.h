@@ -0,0 +1,25 @@
+#ifndef TACH_H
+#define TACH_H
+
+#include <stdint.h>
+
+#define TACH_PULSES_PER_REV 2
+#define TACH_WINDOW_MS      500     // RPM measurement window, also the task period
+
+/* define TACH_PASSTHROUGH as 1 to mirror fan0's tach to the motherboard
+ * through CLC1 rather than from the change notification interrupt; CLC1
+ * has fixed pins, so the board must also bring fan0's tach to CLCINA and
+ * take the motherboard tach from CLC1O */
+#ifndef TACH_PASSTHROUGH
+#define TACH_PASSTHROUGH    0
+#endif
+
+void TACH_init(void);
+void TACH_edge(uint8_t fan, uint32_t time);
+void TACH_service(void);
+
+uint16_t TACH_getRpm(uint8_t fan);
+uint8_t TACH_getWindow(void);
+uint32_t TACH_getLastEdgeTime(uint8_t fan);
+
+#endif
@@ -7,37 +7,119 @@
 
 #include <xc.h>
 #include "task.h"
+#include "profile.h"
 
 #define MAX_NUM_OF_TASKS	10
+#define MAX_NUM_OF_FAST_TASKS	4
 #define MAX_SYS_TICKS_VAL	0x7ff00000
 
+/* in tickless mode the CCP3 timer runs from Fcy/64 and its period is
+ * stretched to the next task deadline, up to TICKLESS_MAX_MS, so that
+ * the core may sit in Idle() rather than wake every millisecond */
+#if TASK_TICKLESS
+#define TICKLESS_COUNTS_PER_MS	250
+#define TICKLESS_MAX_MS		250
+#define COUNTS_PER_MS		TICKLESS_COUNTS_PER_MS
+#else
+#define COUNTS_PER_MS		16000
+#endif
+
 /* create structure that consists of a function pointer and period */
 typedef struct {
 	void (*taskFunctPtr)(void);
 	uint32_t period;
 	uint32_t nextExecutionTime;
+	void *resumePoint;		// where a coroutine task continues, 0 for the top
 }Task;
 
+/* fast tasks run from the timer interrupt in order of priority, each is
+ * timed with the CCP3 count to find its worst case execution time */
+typedef struct {
+	void (*taskFunctPtr)(void);
+	uint16_t period;
+	uint8_t priority;
+	uint32_t nextExecutionTime;
+	uint16_t wcet;
+}FastTask;
+
 static Task task[MAX_NUM_OF_TASKS];
+static uint16_t currentTask = 0;		// the background task now running
+static volatile uint8_t triggered[MAX_NUM_OF_TASKS];	// run at the next pass
+static FastTask fastTask[MAX_NUM_OF_FAST_TASKS];
+static uint16_t fastWcet = 0;		// worst case of the whole fast tier in counts
 static volatile uint32_t systemTicks = 0;
+static volatile uint16_t tickLength = 1;	// length of the current tick in ms
+
+/* scheduler statistics, the number of times a task started after its
+ * scheduled time and the worst case lateness in ms */
+static uint32_t lateCount = 0;
+static uint32_t maxLateness = 0;
 
 void (*TMR_timedFunctPtr)();
 
 void TASK_systemTicksCounter();	// function declaration
+void TASK_runFast();
+#if TASK_TICKLESS
+void TASK_idle();
+#endif
 void TMR_init(void (*functPtr)());
 void TMR_disableInterrupt();
 
 void TASK_systemTicksCounter(){
-	systemTicks++;
+	systemTicks += tickLength;
 
 	/* gracefully reset the system ticks counter
 	 * if it is about to roll over */
 	if(systemTicks >= MAX_SYS_TICKS_VAL){
 		TASK_resetTime(0);
 	}
+
+	TASK_runFast();
+}
+
+void TASK_runFast(){
+	uint16_t start = CCP3TMRL;
+	uint16_t i;
+
+	for(i = 0; (i < MAX_NUM_OF_FAST_TASKS) && (fastTask[i].taskFunctPtr != 0); i++){
+		FastTask *t = &fastTask[i];
+
+		if(systemTicks >= t->nextExecutionTime){
+			/* keep a fixed rate, unless a long tick has skipped over it */
+			t->nextExecutionTime += t->period;
+			if(t->nextExecutionTime <= systemTicks)
+				t->nextExecutionTime = systemTicks + t->period;
+
+			uint16_t taskStart = CCP3TMRL;
+			(t->taskFunctPtr)();
+			uint16_t duration = CCP3TMRL - taskStart;
+			if(duration > t->wcet)
+				t->wcet = duration;
+		}
+	}
+
+	uint16_t duration = CCP3TMRL - start;
+	if(duration > fastWcet)
+		fastWcet = duration;
 }
 
 uint32_t TASK_getTime(){
+#if TASK_TICKLESS
+    /* add the part of a long tick that has already elapsed; a period
+     * match that is pending but not yet serviced completes the tick */
+    uint16_t ie = IEC1bits.CCT3IE;
+    IEC1bits.CCT3IE = 0;
+    
+    uint32_t now = systemTicks;
+    uint16_t count = CCP3TMRL;
+    if(IFS1bits.CCT3IF){
+        now += tickLength;
+        count = CCP3TMRL;
+    }
+    IEC1bits.CCT3IE = ie;
+    
+    return now + (count / TICKLESS_COUNTS_PER_MS);
+#else
     uint8_t sameFlag = 0;
     uint32_t now0 = systemTicks;
     uint32_t now1 = systemTicks;
@@ -55,6 +137,38 @@ uint32_t TASK_getTime(){
     }
     
 	return now0;
+#endif
+}
+
+void **TASK_resumePoint(){
+	return &task[currentTask].resumePoint;
+}
+
+void TASK_delay(uint32_t ms){
+	task[currentTask].nextExecutionTime = TASK_getTime() + ms;
+}
+
+uint16_t TASK_getFastWcet(){
+	return (uint16_t)(((uint32_t)fastWcet * 1000) / COUNTS_PER_MS);
+}
+
+uint16_t TASK_lockFast(){
+	uint16_t ie = IEC1bits.CCT3IE;
+	IEC1bits.CCT3IE = 0;
+
+	return ie;
+}
+
+void TASK_unlockFast(uint16_t lock){
+	IEC1bits.CCT3IE = lock;
+}
+
+uint32_t TASK_getLateCount(){
+	return lateCount;
+}
+
+uint32_t TASK_getMaxLateness(){
+	return maxLateness;
 }
 
 void TASK_resetTime(uint32_t time){
@@ -79,6 +193,11 @@ void TASK_resetTime(uint32_t time){
 		for(i = 0; i < MAX_NUM_OF_TASKS; i++){
 			task[i].nextExecutionTime = (uint32_t)timeUntilNextExecution[i] + time;
 		}
+
+		/* fast tasks are due within their period */
+		for(i = 0; i < MAX_NUM_OF_FAST_TASKS; i++){
+			fastTask[i].nextExecutionTime = time + fastTask[i].period;
+		}
 	}
 }
 
@@ -91,6 +210,15 @@ void TASK_init(){
     	task[i].taskFunctPtr = 0;
     	task[i].period = 1;
     	task[i].nextExecutionTime = 1;
+    	task[i].resumePoint = 0;
+    	triggered[i] = 0;
+    }
+
+    for(i = 0; i < MAX_NUM_OF_FAST_TASKS; i++){
+    	fastTask[i].taskFunctPtr = 0;
+    	fastTask[i].period = 1;
+    	fastTask[i].nextExecutionTime = 1;
+    	fastTask[i].wcet = 0;
     }
 }
 
@@ -103,7 +231,7 @@ void TASK_add(void (*functPtr)(void), uint32_t period){
 		if(task[i].taskFunctPtr == functPtr){
 			if(task[i].period != period){
 				task[i].period = period;
-				task[i].nextExecutionTime = systemTicks + period;
+				task[i].nextExecutionTime = TASK_getTime() + period;
 			}
 
 			taskExists = 1;
@@ -117,7 +245,8 @@ void TASK_add(void (*functPtr)(void), uint32_t period){
 			if(task[i].taskFunctPtr == 0){
 				task[i].taskFunctPtr = functPtr;
 				task[i].period = period;
-				task[i].nextExecutionTime = systemTicks + period;
+				task[i].nextExecutionTime = TASK_getTime() + period;
+				task[i].resumePoint = 0;
 
 				break;
 			}
@@ -125,6 +254,43 @@ void TASK_add(void (*functPtr)(void), uint32_t period){
 	}
 }
 
+void TASK_addFast(void (*functPtr)(void), uint16_t period, uint8_t priority){
+	uint16_t i, j;
+
+	/* the list is kept in order of priority, highest first, with the
+	 * empty slots at the end */
+	for(i = 0; i < MAX_NUM_OF_FAST_TASKS; i++){
+		if((fastTask[i].taskFunctPtr == 0) || (priority > fastTask[i].priority))
+			break;
+	}
+
+	if((i >= MAX_NUM_OF_FAST_TASKS) || (fastTask[MAX_NUM_OF_FAST_TASKS - 1].taskFunctPtr != 0))
+		return;
+
+	uint16_t lock = TASK_lockFast();
+
+	for(j = MAX_NUM_OF_FAST_TASKS - 1; j > i; j--)
+		fastTask[j] = fastTask[j - 1];
+
+	fastTask[i].taskFunctPtr = functPtr;
+	fastTask[i].period = period;
+	fastTask[i].priority = priority;
+	fastTask[i].nextExecutionTime = systemTicks + period;
+	fastTask[i].wcet = 0;
+
+	TASK_unlockFast(lock);
+}
+
+void TASK_trigger(void (*functPtr)(void)){
+	uint16_t i;
+
+	/* byte writes, so this may be called from an interrupt */
+	for(i = 0; i < MAX_NUM_OF_TASKS; i++){
+		if(task[i].taskFunctPtr == functPtr)
+			triggered[i] = 1;
+	}
+}
+
 void TASK_remove(void (*functPtr)()){
 	uint16_t i;
 
@@ -133,6 +299,7 @@ void TASK_remove(void (*functPtr)()){
 			task[i].taskFunctPtr = 0;
 			task[i].period = 10000;
 			task[i].nextExecutionTime = MAX_SYS_TICKS_VAL;
+			task[i].resumePoint = 0;
 		}
 	}
 }
@@ -143,25 +310,109 @@ void TASK_manage(){
 		for(i = 0; i < MAX_NUM_OF_TASKS; i++){
 			uint32_t time = TASK_getTime();
 			if(task[i].taskFunctPtr != 0){
-				if(time >= task[i].nextExecutionTime){
+				if((time >= task[i].nextExecutionTime) || triggered[i]){
+					if(time > task[i].nextExecutionTime){
+						uint32_t lateness = time - task[i].nextExecutionTime;
+						lateCount++;
+						if(lateness > maxLateness)
+							maxLateness = lateness;
+					}
+					triggered[i] = 0;
+
 					task[i].nextExecutionTime = task[i].period + time;
+					currentTask = i;
+					PROFILE_BEGIN(ePROF_TASK0 + i);
 					(task[i].taskFunctPtr)();
+					PROFILE_END(ePROF_TASK0 + i);
 				}
 			}
 		}
         
         ClrWdt();
+#if TASK_TICKLESS
+        TASK_idle();
+#endif
+	}
+}
+
+#if TASK_TICKLESS
+void TASK_idle(){
+	uint32_t now = TASK_getTime();
+	uint32_t next = now + TICKLESS_MAX_MS;
+	uint16_t i;
+
+	for(i = 0; i < MAX_NUM_OF_TASKS; i++){
+		if((task[i].taskFunctPtr != 0) && (task[i].nextExecutionTime < next))
+			next = task[i].nextExecutionTime;
+	}
+
+	/* the tick must also land on each fast task deadline */
+	for(i = 0; i < MAX_NUM_OF_FAST_TASKS; i++){
+		if((fastTask[i].taskFunctPtr != 0) && (fastTask[i].nextExecutionTime < next))
+			next = fastTask[i].nextExecutionTime;
+	}
+
+	/* something is already due */
+	if(next <= now)
+		return;
+
+	/* interrupts are held off from the last look at the triggers until
+	 * the core idles, or one raised in between would only be seen at the
+	 * next tick; an enabled interrupt still wakes the core at IPL 7 and
+	 * is taken once the priority is restored */
+	uint16_t ipl = SRbits.IPL;
+	SRbits.IPL = 7;
+
+	for(i = 0; i < MAX_NUM_OF_TASKS; i++){
+		if(triggered[i]){
+			SRbits.IPL = ipl;
+			return;
+		}
+	}
+
+	IEC1bits.CCT3IE = 0;
+
+	/* the period is measured from the start of the current tick; a
+	 * pending match is left to the interrupt, otherwise the period must
+	 * stay ahead of the count or the match would be missed until the
+	 * timer wraps */
+	if(IFS1bits.CCT3IF == 0){
+		uint16_t length = next - systemTicks;
+		if(length > TICKLESS_MAX_MS)
+			length = TICKLESS_MAX_MS;
+
+		do{
+			tickLength = length;
+			CCP3PRL = (length * TICKLESS_COUNTS_PER_MS) - 1;
+			length++;
+		}while(CCP3TMRL >= CCP3PRL);
 	}
+
+	IEC1bits.CCT3IE = 1;
+
+	/* any interrupt wakes the core, the task list is checked again
+	 * before going back to sleep */
+	Idle();
+	SRbits.IPL = ipl;
 }
+#endif
 
 void TMR_init(void (*functPtr)()){
 	TMR_timedFunctPtr = functPtr;
 
     /* period registers */
     CCP3PRH = 0;
+#if TASK_TICKLESS
+    CCP3PRL = TICKLESS_COUNTS_PER_MS - 1;
+    CCP3TMRL = 0;
+    tickLength = 1;
+    
+    CCP3CON1L = 0x00c0; // timer mode, Fcy/64
+#else
     CCP3PRL = 16000;
     
     CCP3CON1L = 0x0000; // timer mode
+#endif
     CCP3CON1H = 0x0000;
     CCP3CON2L = 0x0000;
     CCP3CON2H = 0x0000;
@@ -179,9 +430,15 @@ void TMR_disableInterrupt(){
 }
 
 void _ISR _CCT3Interrupt(){
+    PROFILE_BEGIN(ePROF_ISR_CCT3);
+    
+    /* cleared first so that TASK_getTime() within the fast tasks does not
+     * count this tick as still pending */
+    IFS1bits.CCT3IF = 0;
+    
     if(TMR_timedFunctPtr != 0)
 		(*TMR_timedFunctPtr)();
     
-    IFS1bits.CCT3IF = 0;
+    PROFILE_END(ePROF_ISR_CCT3);
 }
 
@@ -10,12 +10,62 @@
 
 #include <stdint.h>
 
+/* sleep in Idle() between task deadlines rather than tick every 1ms */
+#ifndef TASK_TICKLESS
+#define TASK_TICKLESS	0
+#endif
+
 void TASK_init();
 void TASK_add(void (*functPtr)(void), uint32_t period);
 void TASK_remove(void (*functPtr)());
+
+/* runs a background task at the next pass rather than waiting for its
+ * period, safe to call from an interrupt */
+void TASK_trigger(void (*functPtr)(void));
+
+/* fast tasks run from the timer interrupt every period ms, highest
+ * priority first; they must be short and bounded and may not use
+ * anything that waits */
+void TASK_addFast(void (*functPtr)(void), uint16_t period, uint8_t priority);
+uint16_t TASK_getFastWcet();
+
+/* background code sharing data with a fast task masks the tier around
+ * the access, the lock restores the previous state */
+uint16_t TASK_lockFast();
+void TASK_unlockFast(uint16_t lock);
 void TASK_manage();
 
+/* stackless coroutines for background tasks: a task that starts with
+ * TASK_BEGIN() may give up the CPU part way through and continues from the
+ * same place on its next run.  Local variables are not preserved across a
+ * yield, so anything needed afterwards must be static.  At most one of
+ * these macros may appear on a line.  The resume points are label
+ * addresses, a GCC extension supported by XC16. */
+#define TASK_LABEL_(line)	TASK_LABEL__(line)
+#define TASK_LABEL__(line)	taskResume##line
+
+#define TASK_BEGIN()		void **taskResume_ = TASK_resumePoint(); \
+							void *taskResumeAt_ = *taskResume_; \
+							*taskResume_ = 0; \
+							if(taskResumeAt_ != 0) goto *taskResumeAt_
+
+/* continue from here on the next run of the task */
+#define TASK_YIELD()		do{ *taskResume_ = &&TASK_LABEL_(__LINE__); return; \
+							TASK_LABEL_(__LINE__):; }while(0)
+
+/* check the condition on each run of the task until it holds */
+#define TASK_WAIT_UNTIL(cond)	do{ TASK_LABEL_(__LINE__): \
+							if(!(cond)){ *taskResume_ = &&TASK_LABEL_(__LINE__); return; } }while(0)
+
+/* continue after ms rather than after the task period */
+#define TASK_SLEEP(ms)		do{ TASK_delay(ms); TASK_YIELD(); }while(0)
+
+void **TASK_resumePoint();
+void TASK_delay(uint32_t ms);
+
 uint32_t TASK_getTime();
+uint32_t TASK_getLateCount();
+uint32_t TASK_getMaxLateness();
 void TASK_resetTime(uint32_t time);
 
 #endif /* TASK_H_ */
@@ -0,0 +1,158 @@
+#include "telemetry.h"
+#include "uart.h"
+
+typedef enum {eRX_SYNC, eRX_TYPE, eRX_SEQ, eRX_LENGTH, eRX_PAYLOAD, eRX_CRC_LOW, eRX_CRC_HIGH} RxState;
+
+static uint8_t txSeq = 0;
+
+static RxState rxState = eRX_SYNC;
+static uint8_t rxHeader[3];
+static uint8_t rxPayload[TELEM_MAX_PAYLOAD];
+static uint8_t rxIndex = 0;
+static uint16_t rxCrc = 0;
+
+void TELEM_init(void){
+    UART_init();
+    
+    txSeq = 0;
+    rxState = eRX_SYNC;
+}
+
+/* queues a complete frame or nothing at all, so that a slow link drops
+ * whole frames rather than corrupting them; returns 1 when queued */
+uint8_t TELEM_send(uint8_t type, const uint8_t *payload, uint8_t length){
+    if((length > TELEM_MAX_PAYLOAD) || (UART_txFree() < (length + TELEM_OVERHEAD)))
+        return 0;
+    
+    uint8_t header[4] = {TELEM_SYNC, type, txSeq, length};
+    
+    uint16_t crc = TELEM_crc16(0xffff, &header[1], 3);
+    crc = TELEM_crc16(crc, payload, length);
+    uint8_t trailer[2] = {crc & 0xff, crc >> 8};
+    
+    UART_write(header, 4);
+    UART_write(payload, length);
+    UART_write(trailer, 2);
+    
+    txSeq++;
+    
+    return 1;
+}
+
+/* consumes received bytes and returns 1 when a complete frame with a
+ * valid CRC is available, returns 0 when more bytes are needed */
+uint8_t TELEM_receive(uint8_t *type, uint8_t *payload, uint8_t *length){
+    uint8_t data;
+    
+    while(UART_read(&data, 1)){
+        switch(rxState){
+            case eRX_SYNC:
+            {
+                if(data == TELEM_SYNC)
+                    rxState = eRX_TYPE;
+                break;
+            }
+            
+            case eRX_TYPE:
+            case eRX_SEQ:
+            {
+                rxHeader[rxState - eRX_TYPE] = data;
+                rxState++;
+                break;
+            }
+            
+            case eRX_LENGTH:
+            {
+                rxHeader[2] = data;
+                rxIndex = 0;
+                
+                if(data > TELEM_MAX_PAYLOAD)
+                    rxState = eRX_SYNC;
+                else if(data == 0)
+                    rxState = eRX_CRC_LOW;
+                else
+                    rxState = eRX_PAYLOAD;
+                break;
+            }
+            
+            case eRX_PAYLOAD:
+            {
+                rxPayload[rxIndex++] = data;
+                if(rxIndex >= rxHeader[2])
+                    rxState = eRX_CRC_LOW;
+                break;
+            }
+            
+            case eRX_CRC_LOW:
+            {
+                rxCrc = data;
+                rxState = eRX_CRC_HIGH;
+                break;
+            }
+            
+            case eRX_CRC_HIGH:
+            {
+                rxCrc |= (uint16_t)data << 8;
+                rxState = eRX_SYNC;
+                
+                uint16_t crc = TELEM_crc16(0xffff, rxHeader, 3);
+                crc = TELEM_crc16(crc, rxPayload, rxHeader[2]);
+                
+                if(crc == rxCrc){
+                    *type = rxHeader[0];
+                    *length = rxHeader[2];
+                    
+                    uint8_t i;
+                    for(i = 0; i < rxHeader[2]; i++)
+                        payload[i] = rxPayload[i];
+                    
+                    return 1;
+                }
+                break;
+            }
+            
+            default:
+            {
+                rxState = eRX_SYNC;
+                break;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+uint16_t TELEM_crc16(uint16_t crc, const uint8_t *data, uint16_t length){
+    uint16_t i;
+    for(i = 0; i < length; i++){
+        crc ^= (uint16_t)data[i] << 8;
+        
+        uint8_t bit;
+        for(bit = 0; bit < 8; bit++){
+            if(crc & 0x8000)
+                crc = (crc << 1) ^ 0x1021;
+            else
+                crc <<= 1;
+        }
+    }
+    
+    return crc;
+}
+
+/* multi-byte values are sent little-endian */
+uint8_t *TELEM_putU16(uint8_t *buf, uint16_t value){
+    *buf++ = value & 0xff;
+    *buf++ = value >> 8;
+    
+    return buf;
+}
+
+uint8_t *TELEM_putU32(uint8_t *buf, uint32_t value){
+    buf = TELEM_putU16(buf, (uint16_t)value);
+    
+    return TELEM_putU16(buf, (uint16_t)(value >> 16));
+}
+
+uint16_t TELEM_getU16(const uint8_t *buf){
+    return (uint16_t)buf[0] | ((uint16_t)buf[1] << 8);
+}
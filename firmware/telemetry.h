@@ -0,0 +1,50 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+
+/* the telemetry UART shares its receive pin with the encoder, so it is only
+ * enabled on headless boards where commands replace the encoder */
+#ifndef TELEMETRY_ENABLED
+#define TELEMETRY_ENABLED   0
+#endif
+
+#define TELEMETRY_PERIOD    100     // default streaming period, in ms
+
+/* frame format:
+ *  [SYNC][type][seq][length][payload...][crc low][crc high]
+ * the CRC is CRC-16/CCITT-FALSE over type, seq, length and payload */
+#define TELEM_SYNC              0xa5
+#define TELEM_MAX_PAYLOAD       48
+#define TELEM_OVERHEAD          6
+
+/* device to host */
+#define TELEM_MSG_STATUS        0x01
+#define TELEM_MSG_SCHED         0x02
+#define TELEM_MSG_TRACE         0x03
+#define TELEM_MSG_PROFILE       0x04
+#define TELEM_MSG_BLACKBOX      0x05
+#define TELEM_MSG_ACK           0x7f
+
+/* host to device */
+#define TELEM_CMD_SET_TARGET    0x81
+#define TELEM_CMD_SET_RATE      0x82
+#define TELEM_CMD_TRACE_DUMP    0x83
+#define TELEM_CMD_AUTOTUNE      0x84
+#define TELEM_CMD_SET_RPM       0x85
+#define TELEM_CMD_CHARACTERIZE  0x86
+#define TELEM_CMD_SET_DEMAND    0x87
+#define TELEM_CMD_SET_POLICY    0x88
+#define TELEM_CMD_BLACKBOX_DUMP 0x89
+
+void TELEM_init(void);
+uint8_t TELEM_send(uint8_t type, const uint8_t *payload, uint8_t length);
+uint8_t TELEM_receive(uint8_t *type, uint8_t *payload, uint8_t *length);
+
+uint8_t *TELEM_putU16(uint8_t *buf, uint16_t value);
+uint8_t *TELEM_putU32(uint8_t *buf, uint32_t value);
+uint16_t TELEM_getU16(const uint8_t *buf);
+
+uint16_t TELEM_crc16(uint16_t crc, const uint8_t *data, uint16_t length);
+
+#endif
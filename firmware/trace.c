@@ -0,0 +1,351 @@
+#include "trace.h"
+#include "task.h"
+
+#define TRACE_MAX_ENTRY 12
+
+#if TRACE_ENABLED
+static uint8_t traceBuf[TRACE_SIZE];
+static uint16_t head = 0;       // where the next entry is written
+static uint16_t tail = 0;       // the oldest entry
+static uint16_t used = 0;
+static uint8_t flags = 0;
+static uint8_t frozen = 0;
+static uint8_t lastPins = 0xff;
+static uint8_t adcRecorded = 0;
+static uint8_t tachRecorded = 0;    // a bit per fan
+
+static TraceState headState;    // state after the newest entry
+static TraceState tailState;    // state before the oldest entry
+
+static uint8_t *putVarint(uint8_t *p, uint32_t value);
+static uint32_t zigzag(int32_t value);
+static void record(TraceType type, uint8_t fan, int32_t value);
+static void dropOldest(void);
+static uint8_t *packU16(uint8_t *p, uint16_t value);
+#endif
+
+#if TRACE_ENABLED || (!defined(__XC16) && !defined(XC16))
+static uint32_t getVarint(const uint8_t *data, uint16_t length, uint16_t *position);
+#endif
+
+#if TRACE_ENABLED
+void TRACE_init(void){
+    head = tail = used = 0;
+    flags = 0;
+    frozen = 0;
+    lastPins = 0xff;
+    adcRecorded = 0;
+    tachRecorded = 0;
+    
+    uint8_t i;
+    headState.time = TASK_getTime();
+    headState.adc = 0;
+    for(i = 0; i < NUM_OF_FANS; i++){
+        headState.pwm[i] = 0;
+        headState.rpm[i] = 0;
+    }
+    tailState = headState;
+}
+
+void TRACE_adc(q15_t value, uint8_t applied){
+    int16_t moved = q15_abs(q15_add(value, -headState.adc));
+    if(!adcRecorded || (applied ? (moved != 0) : (moved > TRACE_ADC_THRESHOLD))){
+        adcRecorded = 1;
+        record(eTRACE_ADC, 0, value);
+    }
+}
+
+void TRACE_inputs(uint8_t pins){
+    /* only the changes are of interest */
+    if(pins != lastPins){
+        lastPins = pins;
+        record(eTRACE_INPUTS, 0, pins);
+    }
+}
+
+void TRACE_tach(uint8_t fan, uint16_t rpm){
+    /* a reading holds until the next one that differs */
+    if(!(tachRecorded & (1 << fan)) || (rpm != headState.rpm[fan])){
+        tachRecorded |= 1 << fan;
+        record(eTRACE_TACH, fan, rpm);
+    }
+}
+
+void TRACE_state(uint8_t state){
+    record(eTRACE_STATE, 0, state);
+}
+
+void TRACE_pwm(uint8_t fan, uint16_t compare){
+    record(eTRACE_PWM, fan, compare);
+}
+
+void TRACE_target(uint8_t fan, uint16_t target){
+    record(eTRACE_TARGET, fan, target);
+}
+
+/* stops recording so that a dump is consistent */
+void TRACE_freeze(uint8_t freeze){
+    frozen = freeze;
+}
+
+uint16_t TRACE_length(void){
+    return TRACE_HEADER_SIZE + used;
+}
+
+/* reads the trace as a linear dump: the header followed by the entries,
+ * oldest first */
+uint16_t TRACE_read(uint16_t offset, uint8_t *data, uint16_t length){
+    uint8_t header[TRACE_HEADER_SIZE];
+    uint8_t *p = header;
+    
+    *p++ = 'T';
+    *p++ = TRACE_VERSION;
+    *p++ = flags;
+    p = packU16(p, (uint16_t)tailState.time);
+    p = packU16(p, (uint16_t)(tailState.time >> 16));
+    p = packU16(p, tailState.adc);
+    
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++)
+        p = packU16(p, tailState.pwm[i]);
+    for(i = 0; i < NUM_OF_FANS; i++)
+        p = packU16(p, tailState.rpm[i]);
+    p = packU16(p, used);
+    
+    uint16_t n;
+    for(n = 0; (n < length) && ((offset + n) < TRACE_length()); n++){
+        uint16_t index = offset + n;
+        
+        if(index < TRACE_HEADER_SIZE){
+            data[n] = header[index];
+        }else{
+            index = tail + (index - TRACE_HEADER_SIZE);
+            if(index >= TRACE_SIZE)
+                index -= TRACE_SIZE;
+            data[n] = traceBuf[index];
+        }
+    }
+    
+    return n;
+}
+
+static void record(TraceType type, uint8_t fan, int32_t value){
+    if(frozen)
+        return;
+    
+    uint8_t entry[TRACE_MAX_ENTRY];
+    uint8_t *p = entry;
+    
+    /* the inputs are recorded from a fast task, so the rest of the
+     * tasks hold it off while appending */
+    uint16_t lock = TASK_lockFast();
+    
+    uint32_t now = TASK_getTime();
+    uint32_t dt = now - headState.time;
+    headState.time = now;
+    
+    if(dt < 15){
+        *p++ = (type << 4) | dt;
+    }else{
+        *p++ = (type << 4) | 15;
+        p = putVarint(p, dt);
+    }
+    
+    switch(type){
+        case eTRACE_ADC:
+        {
+            p = putVarint(p, zigzag(value - headState.adc));
+            headState.adc = value;
+            break;
+        }
+        
+        case eTRACE_TACH:
+        {
+            *p++ = fan;
+            p = putVarint(p, zigzag(value - headState.rpm[fan]));
+            headState.rpm[fan] = value;
+            break;
+        }
+        
+        case eTRACE_PWM:
+        {
+            *p++ = fan;
+            p = putVarint(p, zigzag(value - headState.pwm[fan]));
+            headState.pwm[fan] = value;
+            break;
+        }
+        
+        case eTRACE_TARGET:
+        {
+            *p++ = fan;
+            p = putVarint(p, (uint16_t)value);
+            break;
+        }
+        
+        default:
+        {
+            *p++ = (uint8_t)value;
+            break;
+        }
+    }
+    
+    /* make room by discarding whole entries from the oldest end */
+    uint16_t length = p - entry;
+    while((TRACE_SIZE - used) < length)
+        dropOldest();
+    
+    uint16_t i;
+    for(i = 0; i < length; i++){
+        traceBuf[head] = entry[i];
+        head++;
+        if(head >= TRACE_SIZE)
+            head = 0;
+    }
+    used += length;
+    
+    TASK_unlockFast(lock);
+}
+
+static void dropOldest(void){
+    /* copy the oldest entry out of the ring so that it may be decoded
+     * linearly, which also moves the tail state past it */
+    uint8_t entry[TRACE_MAX_ENTRY];
+    uint16_t i;
+    uint16_t index = tail;
+    for(i = 0; (i < TRACE_MAX_ENTRY) && (i < used); i++){
+        entry[i] = traceBuf[index];
+        index++;
+        if(index >= TRACE_SIZE)
+            index = 0;
+    }
+    
+    uint16_t length = 0;
+    TraceEntry dropped;
+    if(!TRACE_decode(entry, i, &length, &tailState, &dropped) || (length == 0))
+        length = used;   // cannot happen, but never spin forever
+    
+    tail += length;
+    if(tail >= TRACE_SIZE)
+        tail -= TRACE_SIZE;
+    used -= length;
+    flags |= TRACE_FLAG_WRAPPED;
+}
+
+static uint8_t *putVarint(uint8_t *p, uint32_t value){
+    while(value >= 0x80){
+        *p++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    
+    return p;
+}
+
+static uint32_t zigzag(int32_t value){
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static uint8_t *packU16(uint8_t *p, uint16_t value){
+    *p++ = value & 0xff;
+    *p++ = value >> 8;
+    
+    return p;
+}
+#endif
+
+/* the decoder is left out of firmware built without the trace, the host
+ * replayer always has it */
+#if TRACE_ENABLED || (!defined(__XC16) && !defined(XC16))
+uint8_t TRACE_decode(const uint8_t *data, uint16_t length, uint16_t *position,
+        TraceState *state, TraceEntry *entry){
+    if(*position >= length)
+        return 0;
+    
+    uint8_t first = data[(*position)++];
+    uint32_t dt = first & 0x0f;
+    if(dt == 15)
+        dt = getVarint(data, length, position);
+    
+    state->time += dt;
+    entry->time = state->time;
+    entry->type = (TraceType)(first >> 4);
+    entry->fan = 0;
+    
+    switch(entry->type){
+        case eTRACE_ADC:
+        {
+            uint32_t zz = getVarint(data, length, position);
+            state->adc += (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+            entry->value = state->adc;
+            break;
+        }
+        
+        case eTRACE_TACH:
+        case eTRACE_PWM:
+        {
+            entry->fan = (*position < length) ? data[(*position)++] : 0;
+            if(entry->fan >= NUM_OF_FANS)
+                return 0;
+            
+            uint32_t zz = getVarint(data, length, position);
+            int32_t diff = (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+            uint16_t *last = (entry->type == eTRACE_TACH) ? &state->rpm[entry->fan] : &state->pwm[entry->fan];
+            *last += diff;
+            entry->value = *last;
+            break;
+        }
+        
+        case eTRACE_TARGET:
+        {
+            entry->fan = (*position < length) ? data[(*position)++] : 0;
+            entry->value = (uint16_t)getVarint(data, length, position);
+            break;
+        }
+        
+        case eTRACE_INPUTS:
+        case eTRACE_STATE:
+        {
+            entry->value = (*position < length) ? data[(*position)++] : 0;
+            break;
+        }
+        
+        default:
+            return 0;
+    }
+    
+    return (*position <= length);
+}
+
+void TRACE_unpackHeader(const uint8_t *header, uint8_t *flags, TraceState *state, uint16_t *length){
+    const uint8_t *p = &header[2];
+    
+    *flags = *p++;
+    state->time = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    p += 4;
+    state->adc = (q15_t)(p[0] | (p[1] << 8));
+    p += 2;
+    
+    uint8_t i;
+    for(i = 0; i < NUM_OF_FANS; i++, p += 2)
+        state->pwm[i] = p[0] | (p[1] << 8);
+    for(i = 0; i < NUM_OF_FANS; i++, p += 2)
+        state->rpm[i] = p[0] | (p[1] << 8);
+    
+    *length = p[0] | (p[1] << 8);
+}
+
+static uint32_t getVarint(const uint8_t *data, uint16_t length, uint16_t *position){
+    uint32_t value = 0;
+    uint8_t shift = 0;
+    
+    while((*position < length) && (shift < 32)){
+        uint8_t byte = data[(*position)++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if((byte & 0x80) == 0)
+            break;
+        shift += 7;
+    }
+    
+    return value;
+}
+#endif
@@ -0,0 +1,86 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "libmathq15.h"
+#include "fan.h"
+
+/* the trace recorder is compiled out unless enabled */
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED   0
+#endif
+
+#ifndef TRACE_SIZE
+#define TRACE_SIZE      320     // bytes of RAM for the ring
+#endif
+
+/* an input sample is recorded when it has moved further than this from the
+ * last one recorded, or when the outputs are computed from it; in between
+ * the firmware does not act on it */
+#ifndef TRACE_ADC_THRESHOLD
+#define TRACE_ADC_THRESHOLD 64
+#endif
+
+#define TRACE_VERSION       1
+#define TRACE_HEADER_SIZE   27
+#define TRACE_FLAG_WRAPPED  0x01    // the oldest entries have been overwritten
+
+/* each entry starts with a byte holding the type in the high nibble and
+ * the time since the previous entry, in ms, in the low nibble; a time of
+ * 15 is followed by a varint holding the actual time.  ADC samples, tach
+ * RPM and PWM compare values are stored as zig-zag varint differences
+ * from the previous value of the same kind. */
+typedef enum {
+    eTRACE_ADC,         // input duty cycle sample
+    eTRACE_INPUTS,      // switch and encoder pins: bit0 enc A, bit1 enc B, bit2 switch
+    eTRACE_TACH,        // measured RPM of a fan
+    eTRACE_STATE,       // fanState transition
+    eTRACE_PWM,         // PWM compare register write
+    eTRACE_TARGET       // target duty cycle loaded or commanded
+}TraceType;
+
+/* the values that entries are delta-encoded against */
+typedef struct {
+    uint32_t time;
+    q15_t adc;
+    uint16_t pwm[NUM_OF_FANS];
+    uint16_t rpm[NUM_OF_FANS];
+}TraceState;
+
+typedef struct {
+    TraceType type;
+    uint32_t time;
+    uint8_t fan;
+    uint16_t value;
+}TraceEntry;
+
+#if TRACE_ENABLED
+void TRACE_init(void);
+void TRACE_adc(q15_t value, uint8_t applied);
+void TRACE_inputs(uint8_t pins);
+void TRACE_tach(uint8_t fan, uint16_t rpm);
+void TRACE_state(uint8_t state);
+void TRACE_pwm(uint8_t fan, uint16_t compare);
+void TRACE_target(uint8_t fan, uint16_t target);
+
+void TRACE_freeze(uint8_t freeze);
+uint16_t TRACE_length(void);
+uint16_t TRACE_read(uint16_t offset, uint8_t *data, uint16_t length);
+#else
+#define TRACE_init()
+#define TRACE_adc(value, applied)
+#define TRACE_inputs(pins)
+#define TRACE_tach(fan, rpm)
+#define TRACE_state(state)
+#define TRACE_pwm(fan, compare)
+#define TRACE_target(fan, target)
+#endif
+
+/* decodes one entry of a linear dump, also used by the host replayer */
+#if TRACE_ENABLED || (!defined(__XC16) && !defined(XC16))
+uint8_t TRACE_decode(const uint8_t *data, uint16_t length, uint16_t *position,
+        TraceState *state, TraceEntry *entry);
+void TRACE_unpackHeader(const uint8_t *header, uint8_t *flags, TraceState *state, uint16_t *length);
+#endif
+
+#endif
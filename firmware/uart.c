@@ -0,0 +1,115 @@
+#include "uart.h"
+#include <xc.h>
+#include "profile.h"
+#include "dio.h"
+
+#define FCY 16000000UL
+
+#define U1TX_PIN    B, 7
+#define U1RX_PIN    B, 2
+
+static volatile uint8_t txBuf[UART_TX_BUF_SIZE];
+static volatile uint16_t txHead = 0, txTail = 0;
+static volatile uint8_t rxBuf[UART_RX_BUF_SIZE];
+static volatile uint16_t rxHead = 0, rxTail = 0;
+
+void UART_init(void){
+    /* U1TX on RB7, U1RX on RB2, which is shared with encoder B and so
+     * the UART is only used on boards without the encoder */
+    DIO_MAKE_OUTPUT(U1TX_PIN);
+    DIO_MAKE_INPUT(U1RX_PIN);
+    DIO_MAKE_DIGITAL(U1RX_PIN);
+    CNPD1bits.CN6PDE = 0;   // UART idles high, remove the encoder pull-down
+    
+    U1MODE = 0x0008;        // 8N1, BRGH = 1
+    U1STA = 0x0000;
+    U1BRG = (FCY / (4UL * UART_BAUD)) - 1;
+    
+    /* interrupt when any byte may be written and when any byte arrives */
+    U1STAbits.UTXISEL1 = 0;
+    U1STAbits.UTXISEL0 = 0;
+    
+    IFS0bits.U1RXIF = 0;
+    IEC0bits.U1RXIE = 1;
+    IFS0bits.U1TXIF = 0;
+    IEC0bits.U1TXIE = 0;    // enabled when there is something to send
+    
+    U1MODEbits.UARTEN = 1;
+    U1STAbits.UTXEN = 1;
+}
+
+/* queues as many bytes as will fit without blocking and returns that count */
+uint16_t UART_write(const uint8_t *data, uint16_t length){
+    uint16_t i;
+    for(i = 0; i < length; i++){
+        uint16_t next = (txHead + 1) & (UART_TX_BUF_SIZE - 1);
+        if(next == txTail)
+            break;
+        
+        txBuf[txHead] = data[i];
+        txHead = next;
+    }
+    
+    IEC0bits.U1TXIE = 1;
+    
+    return i;
+}
+
+uint16_t UART_txFree(void){
+    return (UART_TX_BUF_SIZE - 1) - ((txHead - txTail) & (UART_TX_BUF_SIZE - 1));
+}
+
+uint16_t UART_read(uint8_t *data, uint16_t length){
+    uint16_t i;
+    for(i = 0; i < length; i++){
+        if(rxTail == rxHead)
+            break;
+        
+        data[i] = rxBuf[rxTail];
+        rxTail = (rxTail + 1) & (UART_RX_BUF_SIZE - 1);
+    }
+    
+    return i;
+}
+
+uint16_t UART_rxAvailable(void){
+    return (rxHead - rxTail) & (UART_RX_BUF_SIZE - 1);
+}
+
+void _ISR _U1TXInterrupt(void){
+    PROFILE_BEGIN(ePROF_ISR_U1TX);
+    IFS0bits.U1TXIF = 0;
+    
+    /* fill the hardware FIFO */
+    while((U1STAbits.UTXBF == 0) && (txTail != txHead)){
+        U1TXREG = txBuf[txTail];
+        txTail = (txTail + 1) & (UART_TX_BUF_SIZE - 1);
+    }
+    
+    if(txTail == txHead)
+        IEC0bits.U1TXIE = 0;
+    
+    PROFILE_END(ePROF_ISR_U1TX);
+}
+
+void _ISR _U1RXInterrupt(void){
+    PROFILE_BEGIN(ePROF_ISR_U1RX);
+    IFS0bits.U1RXIF = 0;
+    
+    /* an overrun stops the receiver until it is cleared */
+    if(U1STAbits.OERR)
+        U1STAbits.OERR = 0;
+    
+    while(U1STAbits.URXDA){
+        uint8_t data = U1RXREG;
+        uint16_t next = (rxHead + 1) & (UART_RX_BUF_SIZE - 1);
+        
+        /* drop the byte when full, the frame CRC will catch it */
+        if(next != rxTail){
+            rxBuf[rxHead] = data;
+            rxHead = next;
+        }
+    }
+    
+    PROFILE_END(ePROF_ISR_U1RX);
+}
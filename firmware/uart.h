@@ -0,0 +1,18 @@
+#ifndef UART_H
+#define UART_H
+
+#include <stdint.h>
+
+#define UART_BAUD           115200
+#define UART_TX_BUF_SIZE    128     // must be a power of 2
+#define UART_RX_BUF_SIZE    32      // must be a power of 2
+
+void UART_init(void);
+
+uint16_t UART_write(const uint8_t *data, uint16_t length);
+uint16_t UART_txFree(void);
+
+uint16_t UART_read(uint8_t *data, uint16_t length);
+uint16_t UART_rxAvailable(void);
+
+#endif
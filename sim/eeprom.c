@@ -0,0 +1,92 @@
+/*
+ * eeprom.c
+ *
+ * Emulated data EEPROM for the simulator, replaces firmware/eeprom.c.  The
+ * contents may be loaded from and saved to a file so that runs can start
+ * from a given EEPROM history.
+ */
+
+#include <stdio.h>
+#include "eeprom.h"
+#include "sim.h"
+
+#define EEPROM_WORDS    256
+#define EEPROM_OP_NS    (4 * SIM_NS_PER_MS)     // each erase or write
+
+static uint16_t eedata[EEPROM_WORDS];
+static uint32_t writeCount = 0;
+static uint64_t busyUntil = 0;
+static uint8_t writing = 0;     // the write that follows the erase has started
+
+void EEPROM_erase(uint16_t address){
+    SIM_maskInterrupts(SIM_now(), SIM_DISI_CYCLES);
+    if(address < EEPROM_WORDS)
+        eedata[address] = 0xffff;
+}
+
+/* an erase and a write, each unlocked under disi */
+void EEPROM_write(uint16_t address, uint16_t value){
+    SIM_maskInterrupts(SIM_now(), SIM_DISI_CYCLES);
+    SIM_maskInterrupts(SIM_now() + EEPROM_OP_NS, SIM_DISI_CYCLES);
+    if(address < EEPROM_WORDS){
+        eedata[address] = value;
+        writeCount++;
+    }
+}
+
+/* the data is stored at once, only the time taken is modelled */
+void EEPROM_startWrite(uint16_t address, uint16_t value){
+    SIM_maskInterrupts(SIM_now(), SIM_DISI_CYCLES);
+    if(address < EEPROM_WORDS){
+        eedata[address] = value;
+        writeCount++;
+    }
+    busyUntil = SIM_now() + 2 * EEPROM_OP_NS;
+    writing = 0;
+}
+
+/* the firmware starts the write once it sees the erase complete */
+uint8_t EEPROM_busy(void){
+    if(!writing && (SIM_now() >= busyUntil - EEPROM_OP_NS)){
+        SIM_maskInterrupts(SIM_now(), SIM_DISI_CYCLES);
+        writing = 1;
+    }
+
+    return SIM_now() < busyUntil;
+}
+
+uint16_t EEPROM_read(uint16_t address){
+    return (address < EEPROM_WORDS) ? eedata[address] : 0xffff;
+}
+
+int SIM_eepromLoad(const char *path){
+    FILE *f = fopen(path, "rb");
+    if(f == NULL)
+        return -1;
+
+    size_t n = fread(eedata, sizeof(uint16_t), EEPROM_WORDS, f);
+    fclose(f);
+
+    return (int)n;
+}
+
+int SIM_eepromSave(const char *path){
+    FILE *f = fopen(path, "wb");
+    if(f == NULL)
+        return -1;
+
+    size_t n = fwrite(eedata, sizeof(uint16_t), EEPROM_WORDS, f);
+    fclose(f);
+
+    return (int)n;
+}
+
+/* sets a word without counting it as a firmware write */
+void SIM_eepromPoke(uint16_t address, uint16_t value){
+    if(address < EEPROM_WORDS)
+        eedata[address] = value;
+}
+
+uint32_t SIM_eepromWrites(void){
+    return writeCount;
+}
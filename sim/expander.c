@@ -0,0 +1,241 @@
+/*
+ * expander.c
+ *
+ * Fake PWM and tach expanders for the simulator, laid out as firmware
+ * expander.h expects.  Each answers at its address on the emulated bus with
+ * a register file whose pointer is set by the first byte of a write and
+ * advances with each byte.  A channel's fan model runs at the duty cycle in
+ * its PWMOUT register, applied at once, and its tach count register is
+ * filled in from the model's RPM as it is read.
+ *
+ * The bus time the expanders take is summed over each control period, and
+ * the latency is measured from each motherboard input step until every
+ * expander in use has been sent a burst.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "expander.h"
+#include "i2c.h"
+#include "sim.h"
+
+#if EXPANDER_ENABLED
+#define SIM_EXP_REGISTERS   256
+#define SIM_CONTROL_NS      (10 * SIM_NS_PER_MS)
+
+typedef struct {
+    uint32_t transfers;
+    uint64_t sumNs;
+    uint64_t maxNs;             // in a control period
+}SimBusTime;
+
+typedef struct {
+    uint8_t regs[SIM_EXP_REGISTERS];
+    uint8_t pointer;
+    uint8_t written;            // has been sent a burst
+    uint8_t stepped;            // has been sent one since the input step
+}SimExpander;
+
+static FanModel fans[EXP_MAX_CHANNELS];
+static SimLatency stepLatency = {0};
+static SimBusTime busTime = {0};
+static SimExpander expanders[EXP_DEVICES];
+static uint8_t answering = EXP_DEVICES;
+static uint8_t stepPending = 0;
+static uint64_t stepTime = 0;
+static uint64_t period = 0;     // the control period being summed
+static uint64_t periodNs = 0;
+
+static void addBusTime(uint64_t ns);
+static void updateTach(SimExpander *e, uint8_t first);
+
+void SIM_expanderInit(void){
+    memset(expanders, 0, sizeof(expanders));
+
+    uint8_t i;
+    for(i = 0; i < EXP_MAX_CHANNELS; i++){
+        FanModel *fm = &fans[i];
+        if(fm->maxRpm == 0.0){
+            fm->maxRpm = 2400.0;
+            fm->tau = 1.5;
+            fm->startDc = 0.12;
+            fm->sustainDc = 0.06;
+        }
+        fm->rpm = 0.0;
+        fm->forcedRpm = -1.0;
+        fm->phase = 0.0;
+        fm->spinning = 0;
+    }
+}
+
+/* expanders from this one on do not answer */
+void SIM_expanderAnswering(uint8_t devices){
+    answering = (devices < EXP_DEVICES) ? devices : EXP_DEVICES;
+}
+
+double SIM_expanderDutyCycle(uint8_t channel){
+    const SimExpander *e = &expanders[channel / EXP_CHANNELS_PER_DEVICE];
+    uint8_t reg = EXP_REG_PWMOUT + ((channel % EXP_CHANNELS_PER_DEVICE) << 1);
+    uint16_t word = ((uint16_t)e->regs[reg] << 8) | e->regs[reg + 1];
+
+    return (double)(word >> EXP_PWM_SHIFT) / 511.0;
+}
+
+void SIM_expanderStep(uint64_t stepNs){
+    double dt = (double)stepNs * 1e-9;
+
+    uint8_t i;
+    for(i = 0; i < EXP_MAX_CHANNELS; i++){
+        FanModel *fm = &fans[i];
+        double dc = SIM_expanderDutyCycle(i);
+
+        if(!fm->spinning && (dc >= fm->startDc))
+            fm->spinning = 1;
+        else if(fm->spinning && (dc < fm->sustainDc))
+            fm->spinning = 0;
+
+        double target = (fm->spinning && !fm->seized) ? fm->maxRpm * dc : 0.0;
+        double tau = fm->seized ? (fm->tau * 0.1) : fm->tau;
+        fm->rpm += (target - fm->rpm) * (dt / tau);
+        if((target == 0.0) && (fm->rpm < 1.0))
+            fm->rpm = 0.0;
+    }
+}
+
+void SIM_expanderSeize(uint8_t channel, uint8_t seized){
+    if(channel < EXP_MAX_CHANNELS)
+        fans[channel].seized = seized;
+}
+
+void SIM_expanderInputStep(void){
+    uint8_t d;
+    for(d = 0; d < EXP_DEVICES; d++)
+        expanders[d].stepped = 0;
+
+    stepPending = 1;
+    stepTime = SIM_now();
+}
+
+/* returns -1 for an address that is not an expander's, else whether the
+ * transfer was acknowledged */
+int SIM_expanderTransfer(uint8_t address, uint8_t reading, uint8_t *data, uint8_t length, uint64_t ns){
+    if((address < EXP_BASE_ADDRESS) || (address >= EXP_BASE_ADDRESS + EXP_DEVICES))
+        return -1;
+
+    uint8_t d = address - EXP_BASE_ADDRESS;
+    SimExpander *e = &expanders[d];
+
+    addBusTime(ns);
+    if(d >= answering)
+        return 0;
+
+    uint8_t i;
+    if(reading){
+        updateTach(e, d * EXP_CHANNELS_PER_DEVICE);
+        for(i = 0; i < length; i++)
+            data[i] = e->regs[e->pointer++];
+        return 1;
+    }
+
+    e->pointer = data[0];
+    for(i = 1; i < length; i++)
+        e->regs[e->pointer++] = data[i];
+
+    /* a burst of duty cycles */
+    if((data[0] == EXP_REG_PWMOUT) && (length > 1)){
+        e->written = 1;
+        e->stepped = 1;
+
+        uint8_t all = 1;
+        for(i = 0; i < EXP_DEVICES; i++){
+            if(expanders[i].written && !expanders[i].stepped)
+                all = 0;
+        }
+
+        if(stepPending && all){
+            uint64_t latency = SIM_now() - stepTime;
+            SimLatency *l = &stepLatency;
+            if((l->count == 0) || (latency < l->minNs))
+                l->minNs = latency;
+            if(latency > l->maxNs)
+                l->maxNs = latency;
+            l->sumNs += latency;
+            l->count++;
+            stepPending = 0;
+        }
+    }
+
+    return 1;
+}
+
+/* the bus time of a transfer counts in the control period it ends in */
+static void addBusTime(uint64_t ns){
+    SimBusTime *b = &busTime;
+    uint64_t p = SIM_now() / SIM_CONTROL_NS;
+
+    if(p != period){
+        if(periodNs > b->maxNs)
+            b->maxNs = periodNs;
+        period = p;
+        periodNs = 0;
+    }
+
+    periodNs += ns;
+    b->sumNs += ns;
+    b->transfers++;
+}
+
+void SIM_expanderReport(void){
+    const SimBusTime *b = &busTime;
+    double periods = (double)SIM_now() / SIM_CONTROL_NS;
+    uint64_t maxNs = (periodNs > b->maxNs) ? periodNs : b->maxNs;
+
+    printf("expanders %u answering of %u, faults 0x%02x\n", answering, EXP_DEVICES, EXP_getFaults());
+    printf("expander bus %u transfers at %lu Hz, %.3f ms per 10 ms control period mean, %.3f max\n",
+            b->transfers, (unsigned long)I2C_CLOCK, (periods > 0.0) ? (double)b->sumNs / 1e6 / periods : 0.0,
+            (double)maxNs / 1e6);
+    const SimLatency *l = &stepLatency;
+    if(l->count > 0)
+        printf("input steps %u, latency to every expander min %.1f, mean %.2f, max %.1f ms\n", l->count,
+                (double)l->minNs / 1e6, (double)l->sumNs / l->count / 1e6, (double)l->maxNs / 1e6);
+
+    uint8_t i;
+    for(i = 0; i < EXP_MAX_CHANNELS; i++){
+        if(!expanders[i / EXP_CHANNELS_PER_DEVICE].written)
+            continue;
+        printf("exp%u.%u: duty %5.1f%%, %6.0f rpm (read %u)%s\n", i / EXP_CHANNELS_PER_DEVICE,
+                i % EXP_CHANNELS_PER_DEVICE, 100.0 * SIM_expanderDutyCycle(i), fans[i].rpm, EXP_getRpm(i),
+                fans[i].seized ? ", seized" : "");
+    }
+}
+
+/* a count of the 8192Hz clock over a tach period, full while the fan is
+ * stopped or its tach input is off */
+static void updateTach(SimExpander *e, uint8_t first){
+    uint8_t i;
+    for(i = 0; i < EXP_CHANNELS_PER_DEVICE; i++){
+        double rpm = fans[first + i].rpm;
+        uint16_t count = EXP_TACH_FULL;
+        if(((e->regs[EXP_REG_FAN_CONFIG + i] & EXP_FAN_CONFIG_TACH) != 0) && (rpm > 0.0)){
+            double c = (double)EXP_RPM_FACTOR / rpm;
+            if(c < EXP_TACH_FULL)
+                count = (uint16_t)(c + 0.5);
+        }
+
+        uint16_t word = count << EXP_TACH_SHIFT;
+        e->regs[EXP_REG_TACH_COUNT + (i << 1)] = (uint8_t)(word >> 8);
+        e->regs[EXP_REG_TACH_COUNT + (i << 1) + 1] = (uint8_t)word;
+    }
+}
+#else
+/* the bus has no expanders on it */
+int SIM_expanderTransfer(uint8_t address, uint8_t reading, uint8_t *data, uint8_t length, uint64_t ns){
+    (void)address;
+    (void)reading;
+    (void)data;
+    (void)length;
+    (void)ns;
+
+    return -1;
+}
+#endif
@@ -0,0 +1,288 @@
+/*
+ * fleet.c
+ *
+ * Runs many simulated boards, each with its own fan models, input trace and
+ * EEPROM contents, across the cores of the host, and measures the step
+ * response and stall detection of each.
+ *
+ * The firmware keeps its state in globals and statics, so, as for --boards,
+ * each instance is a process of its own: a worker per core takes the next
+ * instance from a counter in shared memory and forks a child that runs it
+ * from a clean copy of the worker, which has not run the firmware.  A child
+ * writes its results to its own slot in the shared memory.  Instances are
+ * independent, so taking them from one counter balances the load as well as
+ * stealing work would.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "sim.h"
+
+#define SETTLE_BAND         0.02    // of the step
+#define SETTLE_MIN_STEP     0.05    // of the fan's maximum RPM, smaller changes are not steps
+
+uint8_t STALL_getFaults(void);
+
+typedef struct {
+    uint32_t next;              // the next instance to be taken
+    uint32_t size;
+    SimFleetResult results[];
+}SimFleet;
+
+static SimFleet *fleet = NULL;
+static SimMetrics metrics;
+
+/* RPM of each fan since the last input step, SIM_SAMPLE_NS apart */
+static float samples[SIM_NUM_OF_FANS][SIM_MAX_SAMPLES];
+static uint32_t numOfSamples = 0;
+static uint64_t nextSample = 0;
+static uint64_t intervalStart = 0;
+static uint8_t measuring = 0;
+
+static void finishInterval(void);
+static int compareFloat(const void *a, const void *b);
+
+/*********** Metrics **********************************************************/
+void SIM_metricsInit(void){
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.seizedFan = -1;
+    metrics.detectMs = -1.0;
+    numOfSamples = 0;
+    measuring = 0;
+}
+
+/* called as each scenario event is applied; an input step ends the interval
+ * of the previous one, steps before the board runs normally are not
+ * measured as the soft start is not a step response */
+void SIM_metricsEvent(const SimEvent *event, uint8_t booted){
+    if(event->type == eEV_SEIZE){
+        /* only the board's own fans, the expanders report their own */
+        if((metrics.seizedFan < 0) && (event->arg < SIM_NUM_OF_FANS)){
+            metrics.seizedFan = event->arg;
+            metrics.seizeTime = SIM_now();
+        }
+        return;
+    }
+
+    if((event->type != eEV_INPUT) || (event->value == SIM_inputDc))
+        return;
+
+    finishInterval();
+    if(booted){
+        measuring = 1;
+        intervalStart = SIM_now();
+        nextSample = intervalStart;
+    }
+}
+
+void SIM_metricsTick(void){
+    uint8_t faults = STALL_getFaults();
+    if((metrics.seizedFan >= 0) && (metrics.detectMs < 0.0) && (faults & (1 << metrics.seizedFan)))
+        metrics.detectMs = (double)(SIM_now() - metrics.seizeTime) / 1e6;
+    metrics.falseFaults |= faults & ~((metrics.seizedFan >= 0) ? (1 << metrics.seizedFan) : 0);
+
+    while(measuring && (SIM_now() >= nextSample) && (numOfSamples < SIM_MAX_SAMPLES)){
+        uint8_t i;
+        for(i = 0; i < SIM_NUM_OF_FANS; i++)
+            samples[i][numOfSamples] = (float)SIM_fans[i].rpm;
+        numOfSamples++;
+        nextSample += SIM_SAMPLE_NS;
+    }
+}
+
+void SIM_metricsFinish(void){
+    finishInterval();
+}
+
+const SimMetrics *SIM_getMetrics(void){
+    return &metrics;
+}
+
+/* the settle time is from the step until the RPM stays within 2% of the
+ * step about its value at the end of the interval; the overshoot is how far
+ * it went past that value, in % of the step */
+static void finishInterval(void){
+    if(!measuring || (numOfSamples < 2)){
+        measuring = 0;
+        numOfSamples = 0;
+        return;
+    }
+
+    uint8_t i;
+    for(i = 0; i < SIM_NUM_OF_FANS; i++){
+        double first = samples[i][0];
+        double last = samples[i][numOfSamples - 1];
+        double step = last - first;
+        /* a seized fan has no step response to measure */
+        if((fabs(step) < SETTLE_MIN_STEP * SIM_fans[i].maxRpm) || SIM_fans[i].seized)
+            continue;
+
+        double band = SETTLE_BAND * fabs(step);
+        uint32_t settled = numOfSamples;
+        double beyond = 0.0;
+        uint32_t j;
+        for(j = numOfSamples; j > 0; j--){
+            double error = samples[i][j - 1] - last;
+            if((settled == numOfSamples) && (fabs(error) > band))
+                settled = j;
+            if(((step > 0.0) ? error : -error) > beyond)
+                beyond = (step > 0.0) ? error : -error;
+        }
+        if(settled == numOfSamples)
+            settled = 0;
+
+        double settleMs = (double)settled * SIM_SAMPLE_NS / 1e6;
+        double overshoot = 100.0 * beyond / fabs(step);
+        metrics.steps++;
+        metrics.settleSumMs += settleMs;
+        if(settleMs > metrics.settleMaxMs)
+            metrics.settleMaxMs = settleMs;
+        if(overshoot > metrics.overshootMax)
+            metrics.overshootMax = overshoot;
+    }
+
+    measuring = 0;
+    numOfSamples = 0;
+}
+
+/*********** Pool *************************************************************/
+/* returns the instance to run in each child, and -1 in the parent once all
+ * of them have run */
+int SIM_fleetFork(uint32_t size, int jobs){
+    size_t bytes = sizeof(SimFleet) + size * sizeof(SimFleetResult);
+    fleet = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(fleet == MAP_FAILED){
+        perror("mmap");
+        exit(1);
+    }
+    memset(fleet, 0, bytes);
+    fleet->size = size;
+
+    if(jobs < 1)
+        jobs = 1;
+
+    fflush(NULL);
+    int w;
+    for(w = 0; w < jobs; w++){
+        pid_t worker = fork();
+        if(worker < 0){
+            perror("fork");
+            exit(1);
+        }
+        if(worker > 0)
+            continue;
+
+        for(;;){
+            uint32_t instance = __atomic_fetch_add(&fleet->next, 1, __ATOMIC_RELAXED);
+            if(instance >= size)
+                _exit(0);
+
+            pid_t child = fork();
+            if(child == 0)
+                return (int)instance;
+
+            int status;
+            if((child < 0) || (waitpid(child, &status, 0) < 0) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+                fleet->results[instance].failed = 1;
+        }
+    }
+
+    while(wait(NULL) > 0);
+
+    return -1;
+}
+
+/* the slot of a child's instance */
+SimFleetResult *SIM_fleetResult(int instance){
+    return &fleet->results[instance];
+}
+
+void SIM_fleetReport(int jobs, double wall, const char *csvPath){
+    uint32_t n = fleet->size;
+    uint32_t i, ran = 0, failed = 0, steps = 0;
+    uint32_t stalls = 0, detected = 0, falseFaults = 0;
+    double simSeconds = 0.0, settleSum = 0.0, settleMax = 0.0, overshootMax = 0.0;
+    double detectSum = 0.0, detectMax = 0.0;
+    float *settles = malloc(n * sizeof(float));
+    FILE *csv = csvPath ? fopen(csvPath, "w") : NULL;
+
+    if(csv)
+        fprintf(csv, "instance,failed,sim_s,boot_ms,steps,settle_mean_ms,settle_max_ms,overshoot_pct,seized_fan,detect_ms,false_faults\n");
+
+    for(i = 0; i < n; i++){
+        const SimFleetResult *r = &fleet->results[i];
+        if(csv){
+            fprintf(csv, "%u,%u,%.1f,%.0f,%u,%.0f,%.0f,%.2f,%d,%.0f,0x%02x\n", i, r->failed, r->simSeconds,
+                    r->bootMs, r->metrics.steps, r->metrics.steps ? r->metrics.settleSumMs / r->metrics.steps : 0.0,
+                    r->metrics.settleMaxMs, r->metrics.overshootMax, r->metrics.seizedFan, r->metrics.detectMs,
+                    r->metrics.falseFaults);
+        }
+        if(r->failed || !r->done){
+            failed++;
+            continue;
+        }
+
+        const SimMetrics *m = &r->metrics;
+        settles[ran++] = (float)m->settleMaxMs;
+        simSeconds += r->simSeconds;
+        steps += m->steps;
+        settleSum += m->settleSumMs;
+        if(m->settleMaxMs > settleMax)
+            settleMax = m->settleMaxMs;
+        if(m->overshootMax > overshootMax)
+            overshootMax = m->overshootMax;
+        if(m->seizedFan >= 0){
+            stalls++;
+            if(m->detectMs >= 0.0){
+                detected++;
+                detectSum += m->detectMs;
+                if(m->detectMs > detectMax)
+                    detectMax = m->detectMs;
+            }
+        }
+        if(m->falseFaults)
+            falseFaults++;
+    }
+    if(csv)
+        fclose(csv);
+
+    qsort(settles, ran, sizeof(float), compareFloat);
+
+    printf("fleet of %u instances on %d jobs in %.2f s wall, %.1f instances/s, %.0fx real time\n", n, jobs, wall,
+            (wall > 0.0) ? n / wall : 0.0, (wall > 0.0) ? simSeconds / wall : 0.0);
+    printf("ran %u, failed %u\n", ran, failed);
+    printf("step responses %u, settle mean %.0f ms, worst per instance p50 %.0f, p95 %.0f, max %.0f ms\n", steps,
+            steps ? settleSum / steps : 0.0, ran ? settles[ran / 2] : 0.0, ran ? settles[(ran * 95) / 100] : 0.0,
+            settleMax);
+    printf("overshoot max %.2f%% of the step\n", overshootMax);
+    printf("stalls injected %u, detected %u, latency mean %.0f ms, max %.0f ms\n", stalls, detected,
+            detected ? detectSum / detected : 0.0, detectMax);
+    printf("instances with a fault on a fan that was not seized %u\n", falseFaults);
+
+    free(settles);
+}
+
+static int compareFloat(const void *a, const void *b){
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*********** Scenarios ********************************************************/
+/* xorshift, so that each instance's scenario follows from the seed alone */
+double SIM_fleetRandom(uint32_t *state){
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return (double)x / 4294967296.0;
+}
@@ -0,0 +1,368 @@
+/*
+ * i2c.c
+ *
+ * Emulated I2C bus for the simulator, replaces firmware/i2c.c.  Transfers are
+ * modelled whole rather than bit by bit: a master transfer completes after
+ * the time its bytes take on the wire, at nine clocks a byte.
+ *
+ * With --boards the simulator runs one process per board and the bus is
+ * shared memory between them.  The processes run in lockstep, meeting at a
+ * barrier every SIM_BUS_QUANTUM_NS of virtual time: writes completed by the
+ * master during a quantum are delivered to the followers at its end, and a
+ * master read returns the response a follower had set by the last barrier.
+ *
+ * A host such as a BMC may also address this board's follower with
+ * --smbus; its transfers run a byte at a time alongside the firmware.
+ * Transfers to fan expanders are answered at once by expander.c.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "i2c.h"
+#include "sim.h"
+
+#define SIM_BUS_MAX_WRITES  8       // per quantum, the bus carries at most two
+#define SIM_BUS_ADDRESSES   128
+#define SIM_HOST_TRANSFERS  256
+
+typedef struct {
+    uint8_t address;
+    uint8_t length;
+    uint8_t data[I2C_MAX_LENGTH];
+}SimBusFrame;
+
+typedef struct {
+    pthread_barrier_t barrier;
+    int boards;
+    uint32_t numOfWrites;
+    SimBusFrame writes[SIM_BUS_MAX_WRITES];
+    uint8_t present[SIM_BUS_ADDRESSES];
+    SimBusFrame responses[SIM_BUS_ADDRESSES];
+    uint64_t stamps[256];
+}SimBus;
+
+static SimBus localBus = {.boards = 1};
+static SimBus *bus = &localBus;
+static uint64_t lastSync = 0;
+static uint64_t busEnd = 0;
+
+/* master */
+static uint8_t isMaster = 0;
+static I2cStatus status = eI2C_IDLE;
+static uint8_t active = 0;
+static uint64_t doneAt;
+static SimBusFrame transfer;
+static uint8_t reading;
+static uint8_t *destination;
+static void (*doneCallback)(I2cStatus status);
+static SimBusFrame outbox[SIM_BUS_MAX_WRITES];
+static uint32_t numOfOutbox = 0;
+static SimBusFrame snapshot[SIM_BUS_ADDRESSES];
+static uint8_t snapshotPresent[SIM_BUS_ADDRESSES];
+
+/* follower */
+static uint8_t ownAddress = 0;
+static void (*receivedCallback)(const uint8_t *data, uint8_t length);
+static uint8_t (*readHandler)(uint8_t reg, uint8_t first);
+static SimBusFrame response;
+
+/* host transfers to the follower: a register write, or a register
+ * pointer write, repeated start and a read of length bytes */
+typedef struct {
+    uint64_t time;
+    uint8_t reg;
+    uint8_t length;
+    int value;              // negative for a read
+}SimHostTransfer;
+
+static SimHostTransfer host[SIM_HOST_TRANSFERS];
+static int numOfHost = 0;
+static int nextHost = 0;
+static uint8_t hostActive = 0;
+static uint8_t hostReading = 0;
+static uint8_t hostPosition;
+static uint64_t hostNextByte;
+static uint64_t hostFree = 0;       // end of the previous transfer
+static uint8_t hostData[I2C_MAX_LENGTH];
+
+static uint64_t transferNs(uint8_t length){
+    /* address and data bytes, plus a clock each for start and stop */
+    return ((1ULL + length) * 9ULL + 2ULL) * 1000000000ULL / I2C_CLOCK;
+}
+
+static uint8_t start(uint8_t addr, const uint8_t *data, uint8_t len, void (*done)(I2cStatus status)){
+    if(!isMaster || active || (len == 0) || (len > I2C_MAX_LENGTH))
+        return 0;
+
+    transfer.address = addr;
+    transfer.length = len;
+    if(data != NULL)
+        memcpy(transfer.data, data, len);
+    doneCallback = done;
+    doneAt = SIM_now() + transferNs(len);
+    status = eI2C_BUSY;
+    active = 1;
+
+    return 1;
+}
+
+void I2C_initMaster(void){
+    isMaster = 1;
+}
+
+uint8_t I2C_write(uint8_t address, const uint8_t *data, uint8_t length, void (*done)(I2cStatus status)){
+    if(!start(address, data, length, done))
+        return 0;
+    reading = 0;
+
+    return 1;
+}
+
+uint8_t I2C_read(uint8_t address, uint8_t *data, uint8_t length, void (*done)(I2cStatus status)){
+    if(!start(address, NULL, length, done))
+        return 0;
+    reading = 1;
+    destination = data;
+
+    return 1;
+}
+
+I2cStatus I2C_getStatus(void){
+    return status;
+}
+
+void I2C_initFollower(uint8_t address, void (*received)(const uint8_t *data, uint8_t length)){
+    ownAddress = address & (SIM_BUS_ADDRESSES - 1);
+    receivedCallback = received;
+    bus->present[ownAddress] = 1;
+}
+
+uint8_t I2C_setResponse(const uint8_t *data, uint8_t length){
+    if(length > I2C_MAX_LENGTH)
+        length = I2C_MAX_LENGTH;
+
+    memcpy(response.data, data, length);
+    response.length = length;
+
+    return 1;
+}
+
+void I2C_setReadHandler(uint8_t (*readRegister)(uint8_t reg, uint8_t first)){
+    readHandler = readRegister;
+}
+
+uint8_t I2C_readInProgress(void){
+    return hostReading;
+}
+
+/* the firmware is never preempted by the emulated bus */
+uint16_t I2C_lock(void){
+    return 0;
+}
+
+void I2C_unlock(uint16_t lock){
+    (void)lock;
+}
+
+/*********** Bus ***************************************************************/
+static void complete(void){
+    uint8_t addr = transfer.address;
+    I2cStatus result;
+    int expander = SIM_expanderTransfer(addr, reading, reading ? destination : transfer.data, transfer.length,
+            transferNs(transfer.length));
+
+    if(expander >= 0){
+        result = expander ? eI2C_DONE : eI2C_NACK;
+    }else if(addr == I2C_GENERAL_CALL){
+        uint8_t acked = 0;
+        int i;
+        for(i = 1; i < SIM_BUS_ADDRESSES; i++)
+            acked |= snapshotPresent[i];
+        result = acked ? eI2C_DONE : eI2C_NACK;
+    }else{
+        result = snapshotPresent[addr & (SIM_BUS_ADDRESSES - 1)] ? eI2C_DONE : eI2C_NACK;
+    }
+
+    if((result == eI2C_DONE) && (expander < 0)){
+        if(reading){
+            /* bytes beyond the response read back as the idle bus */
+            const SimBusFrame *r = &snapshot[addr & (SIM_BUS_ADDRESSES - 1)];
+            uint8_t i;
+            for(i = 0; i < transfer.length; i++)
+                destination[i] = (i < r->length) ? r->data[i] : 0xff;
+        }else if(numOfOutbox < SIM_BUS_MAX_WRITES){
+            outbox[numOfOutbox++] = transfer;
+        }
+    }
+
+    active = 0;
+    status = result;
+    SIM_interrupted = 1;
+    if(doneCallback != NULL)
+        doneCallback(result);
+}
+
+static uint64_t byteNs(void){
+    return 9ULL * 1000000000ULL / I2C_CLOCK;
+}
+
+static void hostStep(uint64_t now){
+    const SimHostTransfer *h = &host[nextHost];
+
+    if(!hostActive){
+        /* a transfer waits for the one before it */
+        uint64_t t = (h->time > hostFree) ? h->time : hostFree;
+        if((nextHost >= numOfHost) || (t > now))
+            return;
+
+        hostActive = 1;
+        hostPosition = 0;
+        if(ownAddress == 0){
+            printf("smbus %9.4f s nack\n", (double)t / 1e9);
+            hostActive = 0;
+            nextHost++;
+            return;
+        }
+
+        /* address and register, then the data or a repeated start and
+         * the address again */
+        hostNextByte = t + ((h->value < 0) ? 3 : 2) * byteNs();
+    }
+
+    while(hostActive && (hostNextByte <= now)){
+        if(h->value >= 0){
+            uint8_t data[2] = {h->reg, (uint8_t)h->value};
+            printf("smbus %9.4f s write 0x%02x: %02x\n", (double)hostNextByte / 1e9, h->reg, data[1]);
+            if(receivedCallback != NULL)
+                receivedCallback(data, 2);
+            hostActive = 0;
+        }else{
+            uint8_t reg = h->reg + hostPosition;
+            hostData[hostPosition] = (readHandler != NULL) ? readHandler(reg, hostPosition == 0)
+                    : ((reg < response.length) ? response.data[reg] : 0xff);
+            hostReading = 1;
+
+            if(++hostPosition >= h->length){
+                int i;
+                printf("smbus %9.4f s read 0x%02x:", (double)hostNextByte / 1e9, h->reg);
+                for(i = 0; i < h->length; i++)
+                    printf(" %02x", hostData[i]);
+                printf("\n");
+                hostReading = 0;
+                hostActive = 0;
+            }
+        }
+
+        SIM_interrupted = 1;
+        hostNextByte += byteNs();
+    }
+
+    if(!hostActive){
+        hostFree = hostNextByte;
+        nextHost++;
+    }
+}
+
+static void synchronize(void){
+    uint32_t i;
+
+    /* publish what this board has put on the bus during the quantum */
+    if(isMaster){
+        bus->numOfWrites = numOfOutbox;
+        memcpy(bus->writes, outbox, numOfOutbox * sizeof(SimBusFrame));
+        numOfOutbox = 0;
+    }
+    if(ownAddress != 0)
+        bus->responses[ownAddress] = response;
+    if(bus->boards > 1)
+        pthread_barrier_wait(&bus->barrier);
+
+    /* and collect what the other boards have */
+    if(isMaster){
+        memcpy(snapshot, bus->responses, sizeof(snapshot));
+        memcpy(snapshotPresent, bus->present, sizeof(snapshotPresent));
+    }
+    if((ownAddress != 0) && (receivedCallback != NULL)){
+        for(i = 0; i < bus->numOfWrites; i++){
+            const SimBusFrame *w = &bus->writes[i];
+            if((w->address == I2C_GENERAL_CALL) || (w->address == ownAddress)){
+                receivedCallback(w->data, w->length);
+                SIM_interrupted = 1;
+            }
+        }
+    }
+    if(bus->boards > 1)
+        pthread_barrier_wait(&bus->barrier);
+}
+
+/* sets up the bus shared by the boards, before the processes are forked */
+int SIM_busCreate(int boards){
+    SimBus *shared = mmap(NULL, sizeof(SimBus), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED)
+        return -1;
+
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if(pthread_barrier_init(&shared->barrier, &attr, (unsigned)boards) != 0)
+        return -1;
+    pthread_barrierattr_destroy(&attr);
+
+    shared->boards = boards;
+    bus = shared;
+
+    return 0;
+}
+
+/* the boards only meet for the quanta that all of them reach */
+void SIM_busSetEnd(uint64_t endTime){
+    busEnd = endTime;
+}
+
+void SIM_busStep(void){
+    uint64_t now = SIM_now();
+
+    while(active && (now >= doneAt))
+        complete();
+
+    hostStep(now);
+
+    while((lastSync + SIM_BUS_QUANTUM_NS <= now) && (lastSync + SIM_BUS_QUANTUM_NS <= busEnd)){
+        lastSync += SIM_BUS_QUANTUM_NS;
+        synchronize();
+    }
+}
+
+void SIM_busBarrier(void){
+    if(bus->boards > 1)
+        pthread_barrier_wait(&bus->barrier);
+}
+
+int SIM_busHost(uint64_t time, uint8_t reg, uint8_t length, int value){
+    if((numOfHost >= SIM_HOST_TRANSFERS) || (length > I2C_MAX_LENGTH))
+        return -1;
+
+    /* kept in time order */
+    int i = numOfHost++;
+    while((i > 0) && (host[i - 1].time > time)){
+        host[i] = host[i - 1];
+        i--;
+    }
+    host[i].time = time;
+    host[i].reg = reg;
+    host[i].length = length;
+    host[i].value = value;
+
+    return 0;
+}
+
+void SIM_busStamp(uint8_t seq, uint64_t time){
+    bus->stamps[seq] = time;
+}
+
+uint64_t SIM_busStampOf(uint8_t seq){
+    return bus->stamps[seq];
+}
@@ -0,0 +1,327 @@
+/*
+ * plant.c
+ *
+ * Fan, motherboard and user interface models for the simulator.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xc.h>
+#include "sim.h"
+#include "expander.h"
+
+/* tach inputs of each fan and the PWM compare registers that drive them */
+static const uint8_t tachBit[SIM_NUM_OF_FANS] = {13, 10, 8, 6};
+static volatile uint16_t * const compareReg[SIM_NUM_OF_FANS] = {&CCP2RB, &CCP5RB, &CCP4RB, &CCP1RB};
+static volatile uint16_t * const periodReg[SIM_NUM_OF_FANS] = {&CCP2PRL, &CCP5PRL, &CCP4PRL, &CCP1PRL};
+static volatile uint16_t * const controlReg[SIM_NUM_OF_FANS] = {&CCP2CON1L, &CCP5CON1L, &CCP4CON1L, &CCP1CON1L};
+static volatile uint16_t * const outputReg[SIM_NUM_OF_FANS] = {&CCP2CON2H, &CCP5CON2H, &CCP4CON2H, &CCP1CON2H};
+static volatile uint16_t * const timerReg[SIM_NUM_OF_FANS] = {&CCP2TMRL, &CCP5TMRL, &CCP4TMRL, &CCP1TMRL};
+
+FanModel SIM_fans[SIM_NUM_OF_FANS];
+double SIM_inputDc = 0.0;
+double SIM_adcNoise = 0.0;
+int32_t SIM_adcOverride = -1;
+uint32_t SIM_mbTachEdges = 0;
+SimLatency SIM_mbTachLatency = {0};
+
+/* switch and encoder activity still to be played out */
+static uint64_t switchReleaseTime = 0;
+static int encoderSteps = 0;
+static uint64_t nextEncoderStep = 0;
+static uint8_t encoderPhase = 0;
+
+/* recent intervals during which interrupts were held off */
+#define MASKED_INTERVALS    8
+static uint64_t maskStart[MASKED_INTERVALS];
+static uint64_t maskEnd[MASKED_INTERVALS];
+static uint8_t nextMask = 0;
+
+static void setTach(uint8_t fan, uint8_t level, uint64_t edgeTime);
+static uint8_t clcOutput(void);
+static uint8_t mbTachLevel(void);
+static uint64_t cyclesToNs(uint32_t cycles);
+static uint64_t unmaskedAt(uint64_t time);
+static void addLatency(uint64_t latency);
+static void updateAdc(void);
+
+void SIM_plantInit(void){
+    uint8_t i;
+    for(i = 0; i < SIM_NUM_OF_FANS; i++){
+        FanModel *fm = &SIM_fans[i];
+        if(fm->maxRpm == 0.0){
+            fm->maxRpm = 2400.0;
+            fm->tau = 1.5;
+            fm->startDc = 0.12;
+            fm->sustainDc = 0.06;
+        }
+        fm->rpm = 0.0;
+        fm->forcedRpm = -1.0;
+        fm->phase = 0.0;
+        fm->spinning = 0;
+        fm->tachEdges = 0;
+    }
+#if EXPANDER_ENABLED
+    SIM_expanderInit();
+#endif
+
+    updateAdc();
+}
+
+double SIM_fanDutyCycle(uint8_t fan){
+    /* the module must be on and one of its output pins enabled */
+    if(((*controlReg[fan]) & 0x8000) == 0 || ((*outputReg[fan]) & 0x3f00) == 0 || (*periodReg[fan] == 0))
+        return 0.0;
+
+    return (double)(*compareReg[fan]) / (double)(*periodReg[fan]);
+}
+
+/* the timers are not run, so each holds the count it was started from and
+ * the outputs are high from a count of 0 to the compare value; the supply
+ * draw is counted in fans, each drawing one unit while its output is high */
+void SIM_pwmSupply(SimSupply *supply){
+    uint16_t period = 0;
+    uint8_t i;
+    for(i = 0; i < SIM_NUM_OF_FANS; i++){
+        if(SIM_fanDutyCycle(i) > 0.0)
+            period = *periodReg[i];
+    }
+
+    memset(supply, 0, sizeof(*supply));
+    if(period == 0)
+        return;
+
+    double sum = 0.0, sumOfSquares = 0.0;
+    uint32_t t;
+    for(t = 0; t <= period; t++){
+        uint8_t on = 0, rising = 0;
+        for(i = 0; i < SIM_NUM_OF_FANS; i++){
+            if(SIM_fanDutyCycle(i) == 0.0)
+                continue;
+            uint32_t count = (*timerReg[i] + t) % ((uint32_t)period + 1);
+            on += (count < *compareReg[i]);
+            rising += (count == 0);
+        }
+        if(on > supply->peak)
+            supply->peak = on;
+        if(rising > supply->together)
+            supply->together = rising;
+        sum += on;
+        sumOfSquares += (double)on * on;
+    }
+
+    supply->mean = sum / (period + 1);
+    supply->ripple = sqrt(sumOfSquares / (period + 1) - supply->mean * supply->mean);
+}
+
+void SIM_plantStep(uint64_t stepNs){
+    double dt = (double)stepNs * 1e-9;
+
+    uint8_t i;
+    for(i = 0; i < SIM_NUM_OF_FANS; i++){
+        FanModel *fm = &SIM_fans[i];
+        double dc = SIM_fanDutyCycle(i);
+
+        if(!fm->spinning && (dc >= fm->startDc))
+            fm->spinning = 1;
+        else if(fm->spinning && (dc < fm->sustainDc))
+            fm->spinning = 0;
+
+        double target = (fm->spinning && !fm->seized) ? fm->maxRpm * dc : 0.0;
+        double tau = fm->seized ? (fm->tau * 0.1) : fm->tau;
+        fm->rpm += (target - fm->rpm) * (dt / tau);
+        if((target == 0.0) && (fm->rpm < 1.0))
+            fm->rpm = 0.0;
+        if(fm->forcedRpm >= 0.0)
+            fm->rpm = fm->forcedRpm;
+
+        /* two tach pulses per revolution means four transitions; the
+         * remaining phase places each within the step */
+        fm->phase += dt * fm->rpm / 15.0;
+        while(fm->phase >= 1.0){
+            fm->phase -= 1.0;
+            uint64_t edgeTime = SIM_now() - (uint64_t)(fm->phase * 15.0e9 / fm->rpm);
+            setTach(i, ((PORTB >> tachBit[i]) & 1) ^ 1, edgeTime);
+        }
+    }
+
+    /* the switch reads high while it is pressed */
+    if(switchReleaseTime && (SIM_now() >= switchReleaseTime)){
+        PORTBbits.RB3 = 0;
+        switchReleaseTime = 0;
+    }
+
+    /* quadrature steps on A (RA0) and B (RB2), one transition every 2ms */
+    if(encoderSteps && (SIM_now() >= nextEncoderStep)){
+        static const uint8_t gray[4] = {0, 1, 3, 2};
+
+        encoderPhase = (encoderSteps > 0) ? ((encoderPhase + 1) & 3) : ((encoderPhase + 3) & 3);
+        encoderSteps += (encoderSteps > 0) ? -1 : 1;
+        PORTAbits.RA0 = gray[encoderPhase] & 1;
+        PORTBbits.RB2 = gray[encoderPhase] >> 1;
+
+        nextEncoderStep = SIM_now() + 2 * SIM_NS_PER_MS;
+    }
+#if EXPANDER_ENABLED
+    SIM_expanderStep(stepNs);
+#endif
+
+    updateAdc();
+}
+
+void SIM_plantEvent(const SimEvent *event){
+    switch(event->type){
+        case eEV_INPUT:     SIM_inputDc = event->value;                 break;
+        case eEV_CLICK:
+        {
+            /* a click unless a hold time is given */
+            PORTBbits.RB3 = 1;
+            switchReleaseTime = event->time + ((event->value > 0.0) ? (uint64_t)(event->value * 1e9)
+                    : 100 * SIM_NS_PER_MS);
+            break;
+        }
+        case eEV_TURN:      encoderSteps += event->arg;                 break;
+        case eEV_SEIZE:
+        case eEV_FREE:
+        {
+            /* fans from SIM_NUM_OF_FANS on are the expander channels */
+            uint8_t seized = (event->type == eEV_SEIZE);
+            if(event->arg < SIM_NUM_OF_FANS)
+                SIM_fans[event->arg].seized = seized;
+#if EXPANDER_ENABLED
+            else
+                SIM_expanderSeize(event->arg - SIM_NUM_OF_FANS, seized);
+#endif
+            break;
+        }
+        default:                                                        break;
+    }
+}
+
+uint8_t SIM_clcEnabled(void){
+    return CLC1CONLbits.LCEN && CLC1CONLbits.LCOE;
+}
+
+void SIM_maskInterrupts(uint64_t time, uint32_t cycles){
+    maskStart[nextMask] = time;
+    maskEnd[nextMask] = time + cyclesToNs(cycles);
+    nextMask = (nextMask + 1) % MASKED_INTERVALS;
+}
+
+static void setTach(uint8_t fan, uint8_t level, uint64_t edgeTime){
+    uint16_t mask = 1 << tachBit[fan];
+    uint8_t mbTach = mbTachLevel();
+
+    PORTB = level ? (PORTB | mask) : (PORTB & ~mask);
+    SIM_fans[fan].tachEdges++;
+
+    /* the cell follows fan0's tach at once, the interrupt only once any
+     * interrupt in progress has finished */
+    uint64_t latency = SIM_CLC_DELAY_NS;
+    if(!SIM_clcEnabled()){
+        uint64_t start = unmaskedAt(edgeTime);
+        latency = (start - edgeTime) + cyclesToNs(SIM_CN_ISR_CYCLES);
+    }
+
+    if(IEC1bits.CNIE){
+        SIM_maskInterrupts(unmaskedAt(edgeTime), SIM_CN_ISR_CYCLES);
+
+        IFS1bits.CNIF = 1;
+        _CNInterrupt();
+        SIM_interrupted = 1;
+    }
+
+    if(mbTachLevel() != mbTach){
+        SIM_mbTachEdges++;
+        if(fan == 0)
+            addLatency(latency);
+    }
+}
+
+/* AND-OR mode only, with data source 1 as CLCINA, wired to fan0's tach;
+ * the other sources read 0 */
+static uint8_t clcOutput(void){
+    uint8_t ds[4] = {0, 0, 0, 0};
+    if((CLC1SELL & 0x0007) == 0)
+        ds[0] = (PORTB >> tachBit[0]) & 1;
+
+    uint32_t select = ((uint32_t)CLC1GLSH << 16) | CLC1GLSL;
+    uint8_t gate[4];
+    uint8_t g, d;
+    for(g = 0; g < 4; g++){
+        uint8_t bits = (select >> (8 * g)) & 0xff;
+
+        gate[g] = 0;
+        for(d = 0; d < 4; d++){
+            if(((bits >> (2 * d + 1)) & 1) && ds[d])
+                gate[g] = 1;
+            if(((bits >> (2 * d)) & 1) && !ds[d])
+                gate[g] = 1;
+        }
+        gate[g] ^= (CLC1CONH >> g) & 1;
+    }
+
+    uint8_t out = 0;
+    if(CLC1CONLbits.MODE == 0)
+        out = (gate[0] & gate[1]) | (gate[2] & gate[3]);
+
+    return out ^ CLC1CONLbits.LCPOL;
+}
+
+static uint8_t mbTachLevel(void){
+    return SIM_clcEnabled() ? clcOutput() : LATBbits.LATB14;
+}
+
+static uint64_t cyclesToNs(uint32_t cycles){
+    return (uint64_t)cycles * 1000000000ULL / SIM_FCY;
+}
+
+/* the first time from the one given at which no interrupt or disi is in
+ * progress */
+static uint64_t unmaskedAt(uint64_t time){
+    uint8_t moved = 1;
+    while(moved){
+        moved = 0;
+
+        uint8_t i;
+        for(i = 0; i < MASKED_INTERVALS; i++){
+            if((time >= maskStart[i]) && (time < maskEnd[i])){
+                time = maskEnd[i];
+                moved = 1;
+            }
+        }
+    }
+
+    return time;
+}
+
+static void addLatency(uint64_t latency){
+    SimLatency *l = &SIM_mbTachLatency;
+
+    if((l->count == 0) || (latency < l->minNs))
+        l->minNs = latency;
+    if(latency > l->maxNs)
+        l->maxNs = latency;
+    l->sumNs += latency;
+    l->count++;
+}
+
+static void updateAdc(void){
+    if(SIM_adcOverride >= 0){
+        ADC1BUF0 = (uint16_t)SIM_adcOverride;
+        AD1CON1bits.DONE = 1;
+        return;
+    }
+    
+    /* 16-bit left justified conversion of the filtered motherboard PWM */
+    double dc = SIM_inputDc;
+    if(SIM_adcNoise > 0.0)
+        dc += SIM_adcNoise * (2.0 * ((double)rand() / RAND_MAX) - 1.0);
+
+    if(dc < 0.0)        dc = 0.0;
+    else if(dc > 1.0)   dc = 1.0;
+
+    ADC1BUF0 = (uint16_t)(dc * 65535.0);
+    AD1CON1bits.DONE = 1;
+}
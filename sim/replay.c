@@ -0,0 +1,223 @@
+/*
+ * replay.c
+ *
+ * Deterministic replay of a trace recorded by firmware/trace.c.  The
+ * recorded inputs (ADC samples, switch and encoder pins, tach RPM and
+ * commanded targets) are fed back to the firmware at the times they were
+ * recorded and the outputs it produces (PWM writes and state transitions)
+ * are compared against the recorded ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <xc.h>
+#include "sim.h"
+#include "trace.h"
+#include "eeprom.h"
+#include "tach.h"
+
+#if TRACE_ENABLED
+
+extern q15_t targetDcFan[];
+extern uint8_t outputsDirty;
+
+static TraceEntry *recorded = NULL;
+static int numOfRecorded = 0;
+static int nextInput = 0;
+static int nextTach = 0;
+static uint8_t recordedFlags = 0;
+
+static int decodeDump(const uint8_t *dump, long size, TraceEntry **entries, uint8_t *flags);
+static int isOutput(const TraceEntry *entry);
+
+/* returns the number of entries and the firmware time of the last one,
+ * which the replay runs until */
+int SIM_replayLoad(const char *path, uint32_t *lastTime){
+    FILE *f = fopen(path, "rb");
+    if(f == NULL)
+        return -1;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t *dump = malloc(size);
+    if((dump == NULL) || (fread(dump, 1, size, f) != (size_t)size)){
+        fclose(f);
+        free(dump);
+        return -1;
+    }
+    fclose(f);
+
+    numOfRecorded = decodeDump(dump, size, &recorded, &recordedFlags);
+    free(dump);
+    if(numOfRecorded < 0)
+        return -1;
+
+    /* a wrapped trace starts in an unknown firmware state, and one without
+     * outputs has nothing to compare */
+    if(recordedFlags & TRACE_FLAG_WRAPPED){
+        printf("replay: the trace wrapped, record it with a larger TRACE_SIZE\n");
+        return -1;
+    }
+
+    int outputs = 0;
+    int i;
+    for(i = 0; i < numOfRecorded; i++)
+        outputs += isOutput(&recorded[i]);
+    if(outputs == 0){
+        printf("replay: the trace holds no outputs\n");
+        return -1;
+    }
+
+    /* the targets loaded at eINIT come from the EEPROM, so preload it */
+    uint8_t loaded = 0;
+    for(i = 0; i < numOfRecorded; i++){
+        uint8_t fan = recorded[i].fan;
+        if((recorded[i].type == eTRACE_TARGET) && !(loaded & (1 << fan))){
+            EEPROM_write(fan, recorded[i].value);
+            loaded |= 1 << fan;
+        }
+    }
+
+    *lastTime = (numOfRecorded > 0) ? recorded[numOfRecorded - 1].time : 0;
+
+    return numOfRecorded;
+}
+
+/* applies every recorded input up to and including the current time */
+void SIM_replayApply(uint32_t now){
+    /* a measured RPM is recorded at the end of its window, so the fan is
+     * run at that speed from the start of the window for the firmware to
+     * measure the same value at the same time */
+    while((nextTach < numOfRecorded) && (recorded[nextTach].time <= now + TACH_WINDOW_MS)){
+        const TraceEntry *e = &recorded[nextTach++];
+        if(e->type == eTRACE_TACH)
+            SIM_fans[e->fan].forcedRpm = e->value;
+    }
+
+    while((nextInput < numOfRecorded) && (recorded[nextInput].time <= now)){
+        const TraceEntry *e = &recorded[nextInput++];
+
+        switch(e->type){
+            case eTRACE_ADC:
+                SIM_adcOverride = (int32_t)((uint16_t)e->value << 1);
+                ADC1BUF0 = (uint16_t)SIM_adcOverride;
+                break;
+
+            case eTRACE_INPUTS:
+                PORTAbits.RA0 = e->value & 1;
+                PORTBbits.RB2 = (e->value >> 1) & 1;
+                PORTBbits.RB3 = (e->value >> 2) & 1;
+                break;
+
+            case eTRACE_TARGET:
+                /* matches the value the firmware reloads at eINIT and
+                 * replays targets that arrived by command */
+                targetDcFan[e->fan] = e->value;
+                outputsDirty = 1;
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+/* compares the outputs in the firmware's own trace of the replay with the
+ * recorded outputs, returns 0 when they match bit-for-bit */
+int SIM_replayCompare(void){
+    uint16_t size = TRACE_length();
+    uint8_t *dump = malloc(size);
+    TRACE_read(0, dump, size);
+
+    TraceEntry *replayed = NULL;
+    uint8_t flags = 0;
+    int numOfReplayed = decodeDump(dump, size, &replayed, &flags);
+    free(dump);
+
+    int r = 0, p = 0, matched = 0, result = 0;
+    if(flags & TRACE_FLAG_WRAPPED){
+        printf("replay: the replay trace wrapped, rebuild with a larger TRACE_SIZE\n");
+        result = 1;
+    }
+
+    while(1){
+        while((r < numOfRecorded) && !isOutput(&recorded[r]))
+            r++;
+        while((p < numOfReplayed) && !isOutput(&replayed[p]))
+            p++;
+
+        if((r >= numOfRecorded) || (p >= numOfReplayed)){
+            if((r < numOfRecorded) || (p < numOfReplayed)){
+                printf("replay: output count differs after %d matching outputs\n", matched);
+                result = 1;
+            }
+            break;
+        }
+
+        const TraceEntry *a = &recorded[r++];
+        const TraceEntry *b = &replayed[p++];
+        if((a->time != b->time) || (a->type != b->type) || (a->fan != b->fan) || (a->value != b->value)){
+            printf("replay: mismatch after %d matching outputs\n", matched);
+            printf("  recorded %ums type %d fan %u value %u\n", a->time, a->type, a->fan, a->value);
+            printf("  replayed %ums type %d fan %u value %u\n", b->time, b->type, b->fan, b->value);
+            result = 1;
+            break;
+        }
+        matched++;
+    }
+
+    if((result == 0) && (matched == 0)){
+        printf("replay: no outputs replayed\n");
+        result = 1;
+    }else if(result == 0){
+        printf("replay: all %d outputs match\n", matched);
+    }
+
+    free(replayed);
+    return result;
+}
+
+int SIM_traceSave(const char *path){
+    FILE *f = fopen(path, "wb");
+    if(f == NULL)
+        return -1;
+
+    uint16_t size = TRACE_length();
+    uint8_t *dump = malloc(size);
+    TRACE_read(0, dump, size);
+    fwrite(dump, 1, size, f);
+    fclose(f);
+    free(dump);
+
+    return size;
+}
+
+static int decodeDump(const uint8_t *dump, long size, TraceEntry **entries, uint8_t *flags){
+    if((size < TRACE_HEADER_SIZE) || (dump[0] != 'T') || (dump[1] != TRACE_VERSION))
+        return -1;
+
+    TraceState state;
+    uint16_t length;
+    TRACE_unpackHeader(dump, flags, &state, &length);
+    if(length > size - TRACE_HEADER_SIZE)
+        length = size - TRACE_HEADER_SIZE;
+
+    /* every entry is at least one byte */
+    *entries = malloc(sizeof(TraceEntry) * (length + 1));
+
+    const uint8_t *data = &dump[TRACE_HEADER_SIZE];
+    uint16_t position = 0;
+    int n = 0;
+    while(TRACE_decode(data, length, &position, &state, &(*entries)[n]))
+        n++;
+
+    return n;
+}
+
+static int isOutput(const TraceEntry *entry){
+    return (entry->type == eTRACE_PWM) || (entry->type == eTRACE_STATE);
+}
+
+#endif
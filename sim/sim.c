@@ -0,0 +1,948 @@
+/*
+ * sim.c
+ *
+ * Runs the firmware on a virtual clock.  The scheduler calls ClrWdt() once
+ * per pass through its task list, which is the point where the firmware has
+ * nothing left to do until the next timer tick, so the simulator advances
+ * the plant to that tick and fires the timer interrupt from there.  A
+ * tickless build instead sleeps in Idle(), which advances the plant until
+ * the next timer tick or the first other interrupt.
+ *
+ * With --boards one process is forked per board and the boards talk over
+ * the emulated I2C bus in i2c.c; board 0 is the master and the only one
+ * connected to the motherboard.
+ */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <xc.h>
+#include "sim.h"
+#include "libmathq15.h"
+#include "task.h"
+#include "trace.h"
+#include "sync.h"
+#include "curve.h"
+#include "persist.h"
+#include "blackbox.h"
+#include "expander.h"
+
+#undef main
+
+/*********** Special function registers ***************************************/
+volatile uint16_t CLKDIV, INTCON1, INTCON2, TBLPAG;
+volatile uint16_t AD1CON1, AD1CON2, AD1CON3, AD1CHS, AD1CSSL, ADC1BUF0;
+volatile uint16_t U1MODE, U1STA, U1BRG;
+volatile uint16_t CCP1PRH, CCP2PRH, CCP3PRH, CCP4PRH, CCP5PRH;
+volatile uint16_t CCP1PRL, CCP2PRL, CCP3PRL, CCP4PRL, CCP5PRL;
+volatile uint16_t CCP1CON1L, CCP2CON1L, CCP3CON1L, CCP4CON1L, CCP5CON1L;
+volatile uint16_t CCP1CON1H, CCP2CON1H, CCP3CON1H, CCP4CON1H, CCP5CON1H;
+volatile uint16_t CCP1CON2L, CCP2CON2L, CCP3CON2L, CCP4CON2L, CCP5CON2L;
+volatile uint16_t CCP1CON2H, CCP2CON2H, CCP3CON2H, CCP4CON2H, CCP5CON2H;
+volatile uint16_t CCP1CON3L, CCP2CON3L, CCP3CON3L, CCP4CON3L, CCP5CON3L;
+volatile uint16_t CCP1CON3H, CCP2CON3H, CCP3CON3H, CCP4CON3H, CCP5CON3H;
+volatile uint16_t CCP1RA, CCP2RA, CCP3RA, CCP4RA, CCP5RA;
+volatile uint16_t CCP1RB, CCP2RB, CCP3RB, CCP4RB, CCP5RB;
+volatile uint16_t CCP1TMRL, CCP2TMRL, CCP4TMRL, CCP5TMRL;
+volatile uint16_t T1CON, PR1;
+volatile uint16_t PORTA, PORTB, LATA, LATB, TRISA, TRISB, ANSA, ANSB;
+volatile uint16_t CNEN1, CNEN2, CNPD1;
+volatile uint16_t IFS0, IEC0, IFS1, IEC1, SR;
+volatile uint16_t NVMCON;
+volatile uint16_t RCON = PERSIST_RCON_POR | PERSIST_RCON_BOR;
+volatile uint16_t CLC1CONL, CLC1CONH, CLC1SELL, CLC1GLSL, CLC1GLSH;
+
+/*********** Firmware state used for reporting ********************************/
+extern int fanState;
+extern q15_t inputPwmDutyCycle;
+extern uint32_t controlUpdates, controlUpdatesSkipped, pwmWrites, pwmWritesSkipped;
+uint16_t TACH_getRpm(uint8_t fan);
+uint8_t STALL_getFaults(void);
+
+/*********** Simulator state **************************************************/
+#define MAX_EVENTS  256
+
+static uint64_t now = 0;
+static uint64_t endTime = 10 * 1000 * SIM_NS_PER_MS;
+static uint64_t lastTick = 0;   // time of the last CCP3 period match
+static uint32_t tickCount = 0;
+static uint32_t wakeups = 0;
+static volatile uint16_t ccp3Slot = 0;
+static uint16_t ccp3Shown = 0;
+uint8_t SIM_interrupted = 0;
+static jmp_buf simExit;
+
+static SimEvent events[MAX_EVENTS];
+static int numOfEvents = 0;
+static int nextEvent = 0;
+
+static FILE *csv = NULL;
+static uint32_t csvPeriod = 100;
+static uint64_t nextCsv = 0;
+static FILE *uartLog = NULL;
+static volatile uint16_t uartTxSlot;
+static const char *eepromPath = NULL;
+static const char *persistPath = NULL;
+
+/* from reset to the first pass of the fan task in eNORMAL */
+#define STATE_NORMAL 2
+static uint64_t bootTime = 0;
+static uint8_t booted = 0;
+static double bootLowestDc[SIM_NUM_OF_FANS];
+
+/* from each motherboard input step to the first change of fan0's duty
+ * cycle that follows it */
+static uint8_t stepPending = 0;
+static uint64_t stepTime = 0;
+static double stepDc = 0.0;
+static SimLatency stepLatency = {0};
+#if TRACE_ENABLED
+static const char *traceOut = NULL;
+static uint8_t replaying = 0;
+static uint32_t replayEnd = 0;      // firmware time of the last recorded entry
+#endif
+static int boards = 1;
+static int board = 0;
+
+/* many independent boards, see fleet.c */
+static uint32_t fleetSize = 0;
+static int fleetJobs = 0;
+static uint32_t fleetSeed = 1;
+static const char *fleetCsv = NULL;
+static int fleetInstance = -1;
+static int fleetOnly = -1;      // an instance run alone, with the usual outputs
+static uint8_t timeGiven = 0;
+/* the boards soft-start for up to about 25s, the input steps from 40s and a
+ * stall comes between half and nine tenths of the run */
+#define FLEET_TIME      (300 * 1000 * SIM_NS_PER_MS)
+#define FLEET_MIN_TIME  (60 * 1000 * SIM_NS_PER_MS)
+#if SYNC_ENABLED
+/* time from a broadcast by the master to its use by this follower */
+static uint8_t lastSeq = 0;
+static uint32_t syncApplied = 0;
+static uint64_t latencySum = 0;
+static uint64_t latencyMax = 0;
+#endif
+
+#if TRACE_ENABLED
+static void replayTick(void);
+#endif
+static uint64_t ccp3Prescale(void);
+static uint64_t ccp3CountsToNs(uint64_t counts);
+static uint64_t nextMatch(void);
+static void trackSync(void);
+static void waitForInterrupt(uint8_t anyInterrupt);
+static void advanceTo(uint64_t t, uint8_t anyInterrupt);
+static void writeCsv(void);
+static void addEvent(uint64_t time, SimEventType type, int arg, double value);
+static int parseArgs(int argc, char *argv[]);
+static void trackBoot(void);
+static void trackStep(void);
+static void loadPersist(void);
+static void savePersist(void);
+static void fleetScenario(int instance);
+#if BLACKBOX_ENABLED
+static void printBlackbox(void);
+#endif
+
+/*********** Clock and core hooks *********************************************/
+uint64_t SIM_now(void){
+    return now;
+}
+
+void SIM_clrWdt(void){
+#if !TASK_TICKLESS
+    /* the scheduler busy-waits for the next tick */
+    waitForInterrupt(0);
+#endif
+}
+
+void SIM_idle(void){
+    waitForInterrupt(1);
+}
+
+volatile uint16_t *SIM_ccp3TmrSlot(void){
+    /* a write by the firmware since the last access restarts the count */
+    if(ccp3Slot != ccp3Shown)
+        lastTick = now - ccp3CountsToNs(ccp3Slot);
+
+    uint64_t counts = (now - lastTick) * (SIM_FCY / 1000000ULL) / 1000ULL / ccp3Prescale();
+    ccp3Slot = ccp3Shown = (counts > 0xffff) ? 0xffff : (uint16_t)counts;
+
+    return &ccp3Slot;
+}
+
+volatile uint16_t *SIM_uartTxSlot(void){
+    /* the previous byte written is complete by the time the next slot
+     * is requested */
+    static uint8_t pending = 0;
+    if(pending && uartLog)
+        fputc(uartTxSlot & 0xff, uartLog);
+    pending = 1;
+
+    return &uartTxSlot;
+}
+
+uint16_t SIM_uartRxRead(void){
+    U1STAbits.URXDA = 0;
+    return 0;
+}
+
+uint16_t SIM_readTmr1(void){
+    static const uint16_t prescale[4] = {1, 8, 64, 256};
+
+    if(!(T1CON & 0x8000))
+        return 0;
+
+    uint64_t counts = now * (SIM_FCY / 1000000ULL) / 1000ULL / prescale[(T1CON >> 4) & 3];
+    return (uint16_t)(counts % ((uint64_t)PR1 + 1));
+}
+
+#if TRACE_ENABLED
+static void replayTick(void){
+    SIM_replayApply(TASK_getTime());
+}
+#endif
+
+static uint64_t ccp3Prescale(void){
+    static const uint64_t prescale[4] = {1, 4, 16, 64};
+    return prescale[(CCP3CON1L >> 6) & 3];
+}
+
+static uint64_t ccp3CountsToNs(uint64_t counts){
+    return counts * ccp3Prescale() * 1000ULL / (SIM_FCY / 1000000ULL);
+}
+
+static uint64_t nextMatch(void){
+    /* the timer resets on the count after the period match */
+    uint64_t t = lastTick + ccp3CountsToNs((uint64_t)CCP3PRL + 1);
+
+    /* a period set below the count already reached is missed until the
+     * timer wraps */
+    if(t <= now)
+        t = lastTick + ccp3CountsToNs(0x10000ULL + CCP3PRL + 1);
+
+    return t;
+}
+
+static void trackSync(void){
+#if SYNC_ENABLED
+    if(boards < 2)
+        return;
+
+    /* the firmware has finished its pass, so a change is as of now */
+    if(!SYNC_isFollower()){
+        if(SYNC_getSeq() != lastSeq){
+            lastSeq = SYNC_getSeq();
+            SIM_busStamp(lastSeq, now);
+        }
+    }else if(SYNC_getAppliedSeq() != lastSeq){
+        lastSeq = SYNC_getAppliedSeq();
+        uint64_t latency = now - SIM_busStampOf(lastSeq);
+        latencySum += latency;
+        if(latency > latencyMax)
+            latencyMax = latency;
+        syncApplied++;
+    }
+#endif
+}
+
+static void waitForInterrupt(uint8_t anyInterrupt){
+    trackSync();
+
+#if TRACE_ENABLED
+    /* the recorded inputs are applied from the tick itself, ahead of the
+     * fast tasks that sample them; the task list is set up by the
+     * firmware, so this is added on the first wait */
+    if(replaying == 1){
+        TASK_addFast(&replayTick, 1, 255);
+        replaying = 2;
+    }
+#endif
+
+    /* pick up a count written since it was last read */
+    (void)SIM_ccp3TmrSlot();
+
+    uint64_t match = nextMatch();
+    advanceTo(match, anyInterrupt);
+    wakeups++;
+
+    /* timer tick */
+    if(now >= match){
+        lastTick = now;
+        if((CCP3CON1L & 0x8000) && IEC1bits.CCT3IE){
+            IFS1bits.CCT3IF = 1;
+            _CCT3Interrupt();
+            SIM_maskInterrupts(now, SIM_TICK_ISR_CYCLES);
+            tickCount++;
+        }
+    }
+
+    trackBoot();
+    trackStep();
+    SIM_metricsTick();
+
+    if(csv && (now >= nextCsv)){
+        writeCsv();
+        nextCsv += csvPeriod * SIM_NS_PER_MS;
+    }
+
+#if TRACE_ENABLED
+    /* a replay runs by the firmware's clock, which drifts from the
+     * simulated one, until every task of the last recorded ms has run */
+    if(replaying && (TASK_getTime() > replayEnd))
+        longjmp(simExit, 1);
+#endif
+
+    if(now >= endTime)
+        longjmp(simExit, 1);
+}
+
+static void advanceTo(uint64_t t, uint8_t anyInterrupt){
+    SIM_interrupted = 0;
+
+    while(now < t){
+        uint64_t step = t - now;
+        if(step > SIM_STEP_NS)
+            step = SIM_STEP_NS;
+        now += step;
+
+        while((nextEvent < numOfEvents) && (events[nextEvent].time <= now)){
+            if((events[nextEvent].type == eEV_INPUT) && (events[nextEvent].value != SIM_inputDc)){
+                stepPending = 1;
+                stepTime = now;
+                stepDc = SIM_fanDutyCycle(0);
+#if EXPANDER_ENABLED
+                SIM_expanderInputStep();
+#endif
+            }
+            SIM_metricsEvent(&events[nextEvent], booted);
+            SIM_plantEvent(&events[nextEvent++]);
+        }
+
+        SIM_plantStep(step);
+
+        if(IEC0bits.U1TXIE){
+            _U1TXInterrupt();
+            SIM_interrupted = 1;
+        }
+
+        SIM_busStep();
+
+        if(anyInterrupt && SIM_interrupted)
+            break;
+    }
+}
+
+static void trackBoot(void){
+    if(booted)
+        return;
+
+    if(fanState == STATE_NORMAL){
+        bootTime = now;
+        booted = 1;
+        return;
+    }
+
+    uint8_t i;
+    for(i = 0; i < SIM_NUM_OF_FANS; i++){
+        double dc = SIM_fanDutyCycle(i);
+        if(dc < bootLowestDc[i])
+            bootLowestDc[i] = dc;
+    }
+}
+
+static void trackStep(void){
+    if(!stepPending || (SIM_fanDutyCycle(0) == stepDc))
+        return;
+
+    uint64_t latency = now - stepTime;
+    if((stepLatency.count == 0) || (latency < stepLatency.minNs))
+        stepLatency.minNs = latency;
+    if(latency > stepLatency.maxNs)
+        stepLatency.maxNs = latency;
+    stepLatency.sumNs += latency;
+    stepLatency.count++;
+    stepPending = 0;
+}
+
+/* what a reset that keeps the power on leaves behind: the persistent RAM
+ * and, after a warm reset, fans that are still turning */
+static void loadPersist(void){
+    FILE *f = fopen(persistPath, "rb");
+    if(f == NULL)
+        return;
+
+    if((fread(&persistBlock, sizeof(persistBlock), 1, f) == 1)
+            && (fread(&persistClock, sizeof(persistClock), 1, f) == 1)){
+        uint8_t i;
+        for(i = 0; i < SIM_NUM_OF_FANS; i++){
+            double rpm;
+            if((fread(&rpm, sizeof(rpm), 1, f) == 1) && !(RCON & PERSIST_RCON_COLD)){
+                SIM_fans[i].rpm = rpm;
+                SIM_fans[i].spinning = (rpm > 0.0);
+            }
+        }
+    }
+    fclose(f);
+}
+
+static void savePersist(void){
+    FILE *f = fopen(persistPath, "wb");
+    if(f == NULL)
+        return;
+
+    fwrite(&persistBlock, sizeof(persistBlock), 1, f);
+    fwrite(&persistClock, sizeof(persistClock), 1, f);
+
+    uint8_t i;
+    for(i = 0; i < SIM_NUM_OF_FANS; i++)
+        fwrite(&SIM_fans[i].rpm, sizeof(SIM_fans[i].rpm), 1, f);
+    fclose(f);
+}
+
+/* the fan models, input trace, EEPROM targets and any stall of an instance
+ * follow from the seed and its number alone */
+static void fleetScenario(int instance){
+    uint32_t state = (fleetSeed * 2654435761u) ^ ((uint32_t)instance * 40503u + 0x9e3779b9u);
+    if(state == 0)
+        state = 1;
+
+    uint8_t i;
+    for(i = 0; i < SIM_NUM_OF_FANS; i++){
+        FanModel *fm = &SIM_fans[i];
+        fm->maxRpm = 1200.0 + 2400.0 * SIM_fleetRandom(&state);
+        fm->tau = 0.5 + 2.5 * SIM_fleetRandom(&state);
+        fm->startDc = 0.08 + 0.12 * SIM_fleetRandom(&state);
+        fm->sustainDc = fm->startDc * (0.5 + 0.3 * SIM_fleetRandom(&state));
+
+        /* most boards have had their targets adjusted at some time */
+        if(SIM_fleetRandom(&state) < 0.75)
+            SIM_eepromPoke(i, (uint16_t)(16384 + 16383 * SIM_fleetRandom(&state)));
+    }
+    SIM_adcNoise = 0.003 * SIM_fleetRandom(&state);
+
+    /* steps from once the fans have soft-started */
+    double end = (double)endTime / 1e9;
+    double t;
+    addEvent(0, eEV_INPUT, 0, 0.3 + 0.6 * SIM_fleetRandom(&state));
+    for(t = 40.0 + 20.0 * SIM_fleetRandom(&state); (t < end) && (numOfEvents < MAX_EVENTS - 1);
+            t += 20.0 + 100.0 * SIM_fleetRandom(&state)){
+        addEvent((uint64_t)(t * 1e9), eEV_INPUT, 0, 0.15 + 0.85 * SIM_fleetRandom(&state));
+    }
+
+    if(SIM_fleetRandom(&state) < 0.5){
+        int fan = (int)(SIM_fleetRandom(&state) * SIM_NUM_OF_FANS);
+        addEvent((uint64_t)((0.5 + 0.4 * SIM_fleetRandom(&state)) * endTime), eEV_SEIZE, fan, 0.0);
+    }
+}
+
+/*********** Reporting ********************************************************/
+/* the library's own conversions are left out of a LIBMATHQ15_NO_FLOAT build */
+static double fraction(q15_t num){
+    return (double)num / 32768.0;
+}
+
+#if BLACKBOX_ENABLED
+/* decodes the log as telemetry.py dump-blackbox would */
+static void printBlackbox(void){
+    static const char *names[] = {"", "reset", "stall", "input loss", "check fail"};
+    uint8_t data[BBOX_DUMP_SIZE];
+    uint16_t length = BBOX_read(0, data, sizeof(data));
+    uint16_t position = 0;
+    BboxState state = {0};
+    BboxRecord record;
+
+    printf("black box at hour %u, %u records dropped\n", BBOX_getHour(), BBOX_getDropped());
+    while(BBOX_decode(data, length, &position, &state, &record)){
+        printf("  hour %5u  ", record.hour);
+        if(!record.valid){
+            printf("corrupt record\n");
+            continue;
+        }
+
+        uint8_t i;
+        switch(record.type){
+            case eBBOX_RESET:
+                printf("%s %s, rcon %04x\n", names[record.type], record.detail ? "warm" : "cold", record.value);
+                break;
+            case eBBOX_STALL:
+                printf("%s fan%u at %.1f%%\n", names[record.type], record.detail, 100.0 * fraction(record.value));
+                break;
+            case eBBOX_INPUT_LOSS:
+                printf("%s at %.1f%%\n", names[record.type], 100.0 * fraction(record.value));
+                break;
+            case eBBOX_CHECK_FAIL:
+                printf("%s, %u records from slot %u\n", names[record.type], record.detail, record.value);
+                break;
+            case eBBOX_KEY_RPM:
+                printf("summary key, rpm half\n");    // the duty cycle half follows
+                break;
+            case eBBOX_KEY_DC:
+            case eBBOX_DELTA:
+                printf("summary %s", (record.type == eBBOX_DELTA) ? "delta" : "key  ");
+                if(!record.complete){
+                    printf(", no base\n");
+                    break;
+                }
+                for(i = 0; i < NUM_OF_FANS; i++)
+                    printf("  %5u rpm %5.1f%%", record.rpm[i], 100.0 * fraction(record.dc[i]));
+                printf("\n");
+                break;
+            default:
+                printf("type %u\n", record.type);
+                break;
+        }
+    }
+}
+#endif
+
+static void writeCsv(void){
+    fprintf(csv, "%.3f,%d,%.4f", (double)now / 1e9, fanState, fraction(inputPwmDutyCycle));
+
+    uint8_t i;
+    for(i = 0; i < SIM_NUM_OF_FANS; i++)
+        fprintf(csv, ",%.4f,%.0f,%u", SIM_fanDutyCycle(i), SIM_fans[i].rpm, TACH_getRpm(i));
+
+    fprintf(csv, ",%u\n", STALL_getFaults());
+}
+
+/*********** Scenario *********************************************************/
+static void addEvent(uint64_t time, SimEventType type, int arg, double value){
+    if(numOfEvents >= MAX_EVENTS){
+        fprintf(stderr, "too many events\n");
+        exit(1);
+    }
+
+    /* keep the list sorted by time, stable for equal times */
+    int i = numOfEvents++;
+    while((i > 0) && (events[i - 1].time > time)){
+        events[i] = events[i - 1];
+        i--;
+    }
+    events[i].time = time;
+    events[i].type = type;
+    events[i].arg = arg;
+    events[i].value = value;
+}
+
+static uint64_t seconds(const char *s){
+    return (uint64_t)(atof(s) * 1e9);
+}
+
+static void usage(void){
+    fprintf(stderr,
+        "usage: fansim [options]\n"
+        "  --time S               simulated run time in seconds (default 10)\n"
+        "  --input T:DC[,...]     motherboard duty cycle (0.0-1.0) from time T\n"
+        "  --noise DC             peak ADC noise as a duty cycle\n"
+        "  --click T[,...]        press and release the adjust switch at time T\n"
+        "  --hold T:S[,...]       hold the adjust switch down for S seconds\n"
+        "  --turn T:N[,...]       turn the encoder N steps (negative is CCW)\n"
+        "  --seize F:T            fan F seizes at time T, from 4 on the\n"
+        "                         expander channels\n"
+        "  --free F:T             fan F is freed at time T\n"
+        "  --fan F:RPM:TAU:START:SUSTAIN\n"
+        "                         fan model: max RPM, time constant in s and\n"
+        "                         start/sustain duty cycles\n"
+        "  --eeprom FILE          load the EEPROM from FILE and save it on exit\n"
+        "  --rcon HEX             reset cause (default 0003, power-on; 0010 is\n"
+        "                         a watchdog timeout)\n"
+        "  --persist FILE         load the persistent RAM and fan speeds from\n"
+        "                         FILE and save them on exit\n"
+        "  --csv FILE             write a trace of the outputs to FILE\n"
+        "  --csv-period MS        trace period (default 100)\n"
+        "  --uart FILE            write the transmitted UART bytes to FILE\n"
+        "  --trace-out FILE       save the firmware's trace to FILE on exit\n"
+        "  --replay FILE          replay a trace and compare the outputs\n"
+        "                         (both need -DTRACE_ENABLED=1)\n"
+        "  --smbus T:REG:N[,...]  read N registers from REG at time T as a host\n"
+        "  --smbus T:REG=V[,...]  or write V to REG (needs -DSMBUS_ENABLED=1)\n"
+        "  --boards N             run N boards synchronized over I2C, board 0\n"
+        "                         takes the input (needs -DSYNC_ENABLED=1)\n"
+        "  --expanders N          only the first N fan expanders answer\n"
+        "                         (needs -DEXPANDER_ENABLED=1)\n"
+        "  --fleet N              run N independent boards with random fan\n"
+        "                         models, inputs, EEPROM targets and stalls\n"
+        "                         (--time defaults to 300 s, at least 60 s)\n"
+        "  --jobs N               processes running the fleet (default: cores)\n"
+        "  --seed N               seed of the fleet's scenarios (default 1)\n"
+        "  --fleet-csv FILE       write the metrics of each instance to FILE\n"
+        "  --instance K           run only instance K of the fleet, as a single\n"
+        "                         board with the usual summary and outputs\n");
+}
+
+static int parseArgs(int argc, char *argv[]){
+    int i;
+    for(i = 1; i < argc; i++){
+        const char *opt = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+        char buf[512];
+
+        if(val == NULL){
+            usage();
+            return -1;
+        }
+        strncpy(buf, val, sizeof(buf) - 1);
+        buf[sizeof(buf) - 1] = 0;
+        i++;
+
+        if(strcmp(opt, "--time") == 0){
+            endTime = seconds(val);
+            timeGiven = 1;
+        }else if(strcmp(opt, "--noise") == 0){
+            SIM_adcNoise = atof(val);
+        }else if(strcmp(opt, "--csv") == 0){
+            csv = fopen(val, "w");
+        }else if(strcmp(opt, "--csv-period") == 0){
+            csvPeriod = (uint32_t)atoi(val);
+            if(csvPeriod == 0)
+                csvPeriod = 1;
+        }else if(strcmp(opt, "--uart") == 0){
+            uartLog = fopen(val, "wb");
+        }else if(strcmp(opt, "--eeprom") == 0){
+            eepromPath = val;
+            SIM_eepromLoad(val);
+        }else if(strcmp(opt, "--rcon") == 0){
+            RCON = (uint16_t)strtoul(val, NULL, 16);
+        }else if(strcmp(opt, "--persist") == 0){
+            persistPath = val;
+        }else if((strcmp(opt, "--trace-out") == 0) || (strcmp(opt, "--replay") == 0)){
+#if TRACE_ENABLED
+            if(opt[2] == 't'){
+                traceOut = val;
+            }else if(SIM_replayLoad(val, &replayEnd) < 0){
+                fprintf(stderr, "cannot load trace %s\n", val);
+                return -1;
+            }else{
+                /* a bound in case the firmware clock stops */
+                replaying = 1;
+                endTime = ((uint64_t)replayEnd * 2 + 1000) * SIM_NS_PER_MS;
+            }
+#else
+            fprintf(stderr, "%s needs a build with -DTRACE_ENABLED=1\n", opt);
+            return -1;
+#endif
+        }else if(strcmp(opt, "--boards") == 0){
+#if SYNC_ENABLED
+            boards = atoi(val);
+            if((boards < 1) || (boards > SIM_MAX_BOARDS)){
+                fprintf(stderr, "--boards takes 1 to %d\n", SIM_MAX_BOARDS);
+                return -1;
+            }
+#else
+            fprintf(stderr, "%s needs a build with -DSYNC_ENABLED=1\n", opt);
+            return -1;
+#endif
+        }else if(strcmp(opt, "--expanders") == 0){
+#if EXPANDER_ENABLED
+            SIM_expanderAnswering((uint8_t)atoi(val));
+#else
+            fprintf(stderr, "%s needs a build with -DEXPANDER_ENABLED=1\n", opt);
+            return -1;
+#endif
+        }else if(strcmp(opt, "--fleet") == 0){
+            fleetSize = (uint32_t)strtoul(val, NULL, 0);
+        }else if(strcmp(opt, "--jobs") == 0){
+            fleetJobs = atoi(val);
+        }else if(strcmp(opt, "--seed") == 0){
+            fleetSeed = (uint32_t)strtoul(val, NULL, 0);
+        }else if(strcmp(opt, "--fleet-csv") == 0){
+            fleetCsv = val;
+        }else if(strcmp(opt, "--instance") == 0){
+            fleetOnly = atoi(val);
+        }else if(strcmp(opt, "--fan") == 0){
+            int f = atoi(strtok(buf, ":"));
+            if((f < 0) || (f >= SIM_NUM_OF_FANS))
+                return -1;
+            SIM_fans[f].maxRpm = atof(strtok(NULL, ":"));
+            SIM_fans[f].tau = atof(strtok(NULL, ":"));
+            SIM_fans[f].startDc = atof(strtok(NULL, ":"));
+            SIM_fans[f].sustainDc = atof(strtok(NULL, ":"));
+        }else{
+            char *item;
+            for(item = strtok(buf, ","); item; item = strtok(NULL, ",")){
+                char *colon = strchr(item, ':');
+
+                if(strcmp(opt, "--input") == 0 && colon){
+                    addEvent(seconds(item), eEV_INPUT, 0, atof(colon + 1));
+                }else if(strcmp(opt, "--click") == 0){
+                    addEvent(seconds(item), eEV_CLICK, 0, 0.0);
+                }else if(strcmp(opt, "--hold") == 0 && colon){
+                    addEvent(seconds(item), eEV_CLICK, 0, atof(colon + 1));
+                }else if(strcmp(opt, "--smbus") == 0 && colon){
+                    /* registers are given in hex */
+                    char *rest;
+                    unsigned long reg = strtoul(colon + 1, &rest, 16);
+                    int r = (*rest == '=') ? SIM_busHost(seconds(item), (uint8_t)reg, 1, (int)strtoul(rest + 1, NULL, 16))
+                            : (*rest == ':') ? SIM_busHost(seconds(item), (uint8_t)reg, (uint8_t)atoi(rest + 1), -1) : -1;
+                    if(r < 0){
+                        usage();
+                        return -1;
+                    }
+                }else if(strcmp(opt, "--turn") == 0 && colon){
+                    addEvent(seconds(item), eEV_TURN, atoi(colon + 1), 0.0);
+                }else if((strcmp(opt, "--seize") == 0 || strcmp(opt, "--free") == 0) && colon){
+                    int f = atoi(item);
+                    if((f < 0) || (f >= SIM_NUM_OF_FANS + (EXPANDER_ENABLED ? EXP_MAX_CHANNELS : 0)))
+                        return -1;
+                    addEvent(seconds(colon + 1), (opt[2] == 's') ? eEV_SEIZE : eEV_FREE, f, 0.0);
+                }else{
+                    usage();
+                    return -1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*********** Entry point ******************************************************/
+int main(int argc, char *argv[]){
+    int i;
+
+    if(parseArgs(argc, argv))
+        return 1;
+
+    /* a fleet measures step responses and stalls, which all come once the
+     * fans have soft-started */
+    if((fleetSize > 0) || (fleetOnly >= 0)){
+        if(!timeGiven)
+            endTime = FLEET_TIME;
+        if(endTime < FLEET_MIN_TIME){
+            fprintf(stderr, "--fleet needs --time of at least %u s, the input steps and stalls come "
+                    "after the soft start\n", (unsigned)(FLEET_MIN_TIME / (1000 * SIM_NS_PER_MS)));
+            return 1;
+        }
+    }
+
+    /* each instance of a fleet runs in a child process from here on, the
+     * parent only reports */
+    if(fleetOnly >= 0){
+        fleetScenario(fleetOnly);
+    }else if(fleetSize > 0){
+        if(boards > 1){
+            fprintf(stderr, "--fleet runs single boards\n");
+            return 1;
+        }
+        if(fleetJobs <= 0)
+            fleetJobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        fleetInstance = SIM_fleetFork(fleetSize, fleetJobs);
+        if(fleetInstance < 0){
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            SIM_fleetReport(fleetJobs, (double)(end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9,
+                    fleetCsv);
+            return 0;
+        }
+
+        csv = NULL;
+        uartLog = NULL;
+        eepromPath = NULL;
+        persistPath = NULL;
+#if TRACE_ENABLED
+        traceOut = NULL;
+#endif
+        fleetScenario(fleetInstance);
+    }
+
+    if(boards > 1){
+#if TRACE_ENABLED
+        if(replaying){
+            fprintf(stderr, "--replay runs a single board\n");
+            return 1;
+        }
+#endif
+        if(SIM_busCreate(boards) < 0){
+            fprintf(stderr, "cannot set up the shared bus\n");
+            return 1;
+        }
+
+        /* the outputs belong to board 0 */
+        fflush(NULL);
+        for(i = 1; i < boards; i++){
+            pid_t pid = fork();
+            if(pid < 0){
+                perror("fork");
+                return 1;
+            }
+            if(pid == 0){
+                board = i;
+                csv = NULL;
+                uartLog = NULL;
+                eepromPath = NULL;
+                persistPath = NULL;
+#if TRACE_ENABLED
+                traceOut = NULL;
+#endif
+                break;
+            }
+        }
+    }
+    SIM_busSetEnd(endTime);
+
+    SIM_plantInit();
+    SIM_metricsInit();
+    if(persistPath)
+        loadPersist();
+    for(i = 0; i < SIM_NUM_OF_FANS; i++)
+        bootLowestDc[i] = 1.0;
+
+#if SYNC_ENABLED
+    SIM_eepromPoke(SYNC_ROLE_EEPROM, (uint16_t)board);
+
+    /* followers have no motherboard input of their own */
+    if(board > 0){
+        int n = 0;
+        for(i = 0; i < numOfEvents; i++){
+            if(events[i].type != eEV_INPUT)
+                events[n++] = events[i];
+        }
+        numOfEvents = n;
+        SIM_inputDc = 0.0;
+    }
+#endif
+
+    if(csv){
+        fprintf(csv, "time,state,input");
+        for(i = 0; i < SIM_NUM_OF_FANS; i++)
+            fprintf(csv, ",dc%d,rpm%d,tach%d", i, i, i);
+        fprintf(csv, ",faults\n");
+    }
+
+    clock_t start = clock();
+    if(setjmp(simExit) == 0)
+        firmware_main();
+    double wall = (double)(clock() - start) / CLOCKS_PER_SEC;
+    int result = 0;
+
+    double simSeconds = (double)now / 1e9;
+    SIM_metricsFinish();
+
+    if(fleetInstance >= 0){
+        SimFleetResult *r = SIM_fleetResult(fleetInstance);
+        r->simSeconds = simSeconds;
+        r->bootMs = booted ? (double)bootTime / 1e6 : -1.0;
+        r->metrics = *SIM_getMetrics();
+        r->done = 1;
+        return 0;
+    }
+
+    /* the boards report in turn */
+    int turn;
+    for(turn = 0; turn < board; turn++)
+        SIM_busBarrier();
+
+#if SYNC_ENABLED
+    if(boards > 1){
+        printf("-- board %d, %s\n", board, SYNC_isFollower() ? "follower" : "master");
+        if(SYNC_isFollower()){
+            printf("sync applied %u broadcasts, latency mean %.2f ms, max %.2f ms\n", syncApplied,
+                    syncApplied ? (double)latencySum / syncApplied / 1e6 : 0.0, (double)latencyMax / 1e6);
+        }else{
+            printf("sync followers present 0x%02x, faults 0x%02x\n", SYNC_getPresent(), SYNC_getFaults());
+        }
+    }
+#endif
+    printf("simulated %.1f s in %.3f s wall (%.0fx real time)\n",
+            simSeconds, wall, (wall > 0.0) ? simSeconds / wall : 0.0);
+    printf("state %d, input %.1f%%, faults 0x%02x\n",
+            fanState, 100.0 * fraction(inputPwmDutyCycle), STALL_getFaults());
+
+    for(i = 0; i < SIM_NUM_OF_FANS; i++){
+        printf("fan%d: duty %5.1f%%, %6.0f rpm (measured %u)\n", i,
+                100.0 * SIM_fanDutyCycle(i), SIM_fans[i].rpm, TACH_getRpm(i));
+        if(CURVE_isValid(i)){
+            uint8_t j;
+            printf("      start %4.1f%%, sustain %4.1f%%, rpm", 100.0 * fraction(CURVE_getStartDc(i)),
+                    100.0 * fraction(CURVE_getSustainDc(i)));
+            for(j = 0; j < CURVE_POINTS; j++)
+                printf(" %u", CURVE_getPointRpm(i, j));
+            printf("\n");
+        }
+    }
+
+    printf("%s reset (rcon %04x)", PERSIST_isWarm() ? "warm" : "cold", PERSIST_getResetCause());
+    if(booted){
+        printf(", normal after %.0f ms, lowest duty before", (double)bootTime / 1e6);
+        for(i = 0; i < SIM_NUM_OF_FANS; i++)
+            printf(" %.1f%%", 100.0 * bootLowestDc[i]);
+    }
+    printf("\n");
+
+    printf("control updates %u, skipped %u, %.1f fan task passes/s in eNORMAL\n", controlUpdates,
+            controlUpdatesSkipped, (simSeconds > 0.0) ? (controlUpdates + controlUpdatesSkipped) / simSeconds : 0.0);
+    if(stepLatency.count > 0){
+        printf("input steps %u, latency to fan0 min %.1f, mean %.2f, max %.1f ms\n", stepLatency.count,
+                stepLatency.minNs / 1e6, stepLatency.sumNs / 1e6 / stepLatency.count, stepLatency.maxNs / 1e6);
+    }
+    const SimMetrics *metrics = SIM_getMetrics();
+    if(metrics->steps > 0){
+        printf("step responses %u, settle mean %.0f ms, max %.0f ms, overshoot max %.2f%%\n", metrics->steps,
+                metrics->settleSumMs / metrics->steps, metrics->settleMaxMs, metrics->overshootMax);
+    }
+    if(metrics->seizedFan >= 0){
+        if(metrics->detectMs >= 0.0)
+            printf("fan%d seized, stall fault after %.0f ms\n", metrics->seizedFan, metrics->detectMs);
+        else
+            printf("fan%d seized, no stall fault\n", metrics->seizedFan);
+    }
+    printf("pwm writes %u, skipped %u\n", pwmWrites, pwmWritesSkipped);
+    SimSupply supply;
+    SIM_pwmSupply(&supply);
+    printf("pwm supply %u fans on at most, %u turning on together, mean %.2f, ripple %.2f rms\n", supply.peak,
+            supply.together, supply.mean, supply.ripple);
+#if EXPANDER_ENABLED
+    SIM_expanderReport();
+#endif
+    printf("motherboard tach edges %u, eeprom writes %u\n", SIM_mbTachEdges, SIM_eepromWrites());
+    if(SIM_mbTachLatency.count > 0){
+        printf("motherboard tach latency (%s): min %.3f, mean %.3f, max %.3f us\n",
+                SIM_clcEnabled() ? "clc" : "interrupt", SIM_mbTachLatency.minNs / 1000.0,
+                SIM_mbTachLatency.sumNs / 1000.0 / SIM_mbTachLatency.count, SIM_mbTachLatency.maxNs / 1000.0);
+    }
+    printf("firmware time %u ms\n", TASK_getTime());
+    printf("scheduler %s, %.0f wakeups/s, %.0f ticks/s\n", TASK_TICKLESS ? "tickless" : "1ms tick",
+            (simSeconds > 0.0) ? wakeups / simSeconds : 0.0,
+            (simSeconds > 0.0) ? tickCount / simSeconds : 0.0);
+#if BLACKBOX_ENABLED
+    printBlackbox();
+#endif
+
+    fflush(stdout);
+    for(; turn < boards; turn++)
+        SIM_busBarrier();
+
+#if TRACE_ENABLED
+    if(traceOut)
+        SIM_traceSave(traceOut);
+    if(replaying)
+        result = SIM_replayCompare();
+#endif
+
+    if(eepromPath)
+        SIM_eepromSave(eepromPath);
+    if(persistPath)
+        savePersist();
+    if(csv)
+        fclose(csv);
+    if(uartLog)
+        fclose(uartLog);
+
+    if(board == 0){
+        int status;
+        while(wait(&status) > 0){
+            if(!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+                result = 1;
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,164 @@
+/*
+ * sim.h
+ *
+ * Host simulator for the fan controller firmware.  The firmware runs
+ * unmodified against simulated peripherals on a virtual clock.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+#define SIM_FCY             16000000ULL
+#define SIM_STEP_NS         250000ULL   // plant integration step
+#define SIM_NS_PER_MS       1000000ULL
+#define SIM_NUM_OF_FANS     4
+#define SIM_MAX_BOARDS      8
+#define SIM_BUS_QUANTUM_NS  SIM_NS_PER_MS   // lockstep between boards
+
+/* the firmware runs in zero virtual time, so the latency from a fan0 tach
+ * edge to the motherboard tach is modelled from these estimates; interrupts
+ * do not nest, so an edge waits for any interrupt in progress or disi */
+#define SIM_CN_ISR_CYCLES   60      // entry, context save and the handler up to the LATB14 write
+#define SIM_TICK_ISR_CYCLES 400     // the CCT3 interrupt and the fast tasks run from it
+#define SIM_DISI_CYCLES     5       // each EEPROM unlock sequence
+#define SIM_CLC_DELAY_NS    25      // CLCINA to CLC1O through the cell
+
+/* first-order fan model; the fan starts turning once the duty cycle reaches
+ * startDc and stops when the duty cycle falls below sustainDc */
+typedef struct {
+    double maxRpm;
+    double tau;             // time constant in seconds
+    double startDc;
+    double sustainDc;
+
+    double rpm;
+    double phase;           // fraction of the way to the next tach transition
+    double forcedRpm;       // replayed RPM, negative when the model runs freely
+    uint8_t spinning;
+    uint8_t seized;
+    uint32_t tachEdges;
+}FanModel;
+
+typedef struct {
+    uint32_t count;
+    uint64_t sumNs;
+    uint64_t minNs;
+    uint64_t maxNs;
+}SimLatency;
+
+/* supply draw over a PWM period in fans on, plant.c */
+typedef struct {
+    uint8_t peak;
+    uint8_t together;           // most fans turning on at the same count
+    double mean;
+    double ripple;              // rms about the mean
+}SimSupply;
+
+typedef enum {eEV_INPUT, eEV_CLICK, eEV_TURN, eEV_SEIZE, eEV_FREE} SimEventType;
+
+typedef struct {
+    uint64_t time;
+    SimEventType type;
+    int arg;
+    double value;
+}SimEvent;
+
+/* step response and stall detection of a run, fleet.c; the RPM is sampled
+ * every SIM_SAMPLE_NS for up to SIM_MAX_SAMPLES after each input step */
+#define SIM_SAMPLE_NS       (10 * SIM_NS_PER_MS)
+#define SIM_MAX_SAMPLES     60000
+
+typedef struct {
+    uint32_t steps;             // fan responses to input steps measured
+    double settleSumMs;
+    double settleMaxMs;
+    double overshootMax;        // % of the step
+    int seizedFan;              // the first fan seized, -1 for none
+    uint64_t seizeTime;
+    double detectMs;            // from the seizure to the stall fault, -1 if missed
+    uint8_t falseFaults;        // faults of fans that were not seized
+}SimMetrics;
+
+typedef struct {
+    uint8_t done;
+    uint8_t failed;
+    double simSeconds;
+    double bootMs;
+    SimMetrics metrics;
+}SimFleetResult;
+
+/* virtual clock; SIM_interrupted is set whenever a peripheral interrupt
+ * runs so that Idle() may return early */
+extern uint8_t SIM_interrupted;
+uint64_t SIM_now(void);
+
+/* plant and user interface models, plant.c */
+extern FanModel SIM_fans[SIM_NUM_OF_FANS];
+extern double SIM_inputDc;
+extern double SIM_adcNoise;
+extern int32_t SIM_adcOverride;
+extern uint32_t SIM_mbTachEdges;
+extern SimLatency SIM_mbTachLatency;
+
+void SIM_plantInit(void);
+void SIM_plantStep(uint64_t stepNs);
+void SIM_plantEvent(const SimEvent *event);
+double SIM_fanDutyCycle(uint8_t fan);
+void SIM_pwmSupply(SimSupply *supply);
+uint8_t SIM_clcEnabled(void);
+
+/* interrupts are held off from time for the cycles given */
+void SIM_maskInterrupts(uint64_t time, uint32_t cycles);
+
+/* emulated EEPROM, eeprom.c */
+int SIM_eepromLoad(const char *path);
+int SIM_eepromSave(const char *path);
+uint32_t SIM_eepromWrites(void);
+void SIM_eepromPoke(uint16_t address, uint16_t value);
+
+/* I2C bus shared between boards, i2c.c */
+int SIM_busCreate(int boards);
+void SIM_busSetEnd(uint64_t endTime);
+void SIM_busStep(void);
+void SIM_busBarrier(void);
+int SIM_busHost(uint64_t time, uint8_t reg, uint8_t length, int value);
+void SIM_busStamp(uint8_t seq, uint64_t time);
+uint64_t SIM_busStampOf(uint8_t seq);
+
+/* fake fan expanders on the bus, expander.c */
+void SIM_expanderInit(void);
+void SIM_expanderAnswering(uint8_t devices);
+double SIM_expanderDutyCycle(uint8_t channel);
+void SIM_expanderStep(uint64_t stepNs);
+void SIM_expanderSeize(uint8_t channel, uint8_t seized);
+void SIM_expanderInputStep(void);
+int SIM_expanderTransfer(uint8_t address, uint8_t reading, uint8_t *data, uint8_t length, uint64_t ns);
+void SIM_expanderReport(void);
+
+/* metrics and the multi-instance pool, fleet.c */
+void SIM_metricsInit(void);
+void SIM_metricsEvent(const SimEvent *event, uint8_t booted);
+void SIM_metricsTick(void);
+void SIM_metricsFinish(void);
+const SimMetrics *SIM_getMetrics(void);
+int SIM_fleetFork(uint32_t size, int jobs);
+SimFleetResult *SIM_fleetResult(int instance);
+void SIM_fleetReport(int jobs, double wall, const char *csvPath);
+double SIM_fleetRandom(uint32_t *state);
+
+/* trace replay, replay.c */
+int SIM_replayLoad(const char *path, uint32_t *lastTime);
+void SIM_replayApply(uint32_t now);
+int SIM_replayCompare(void);
+int SIM_traceSave(const char *path);
+
+/* firmware entry points */
+int firmware_main(void);
+void _CCT3Interrupt(void);
+void _CNInterrupt(void);
+void _U1TXInterrupt(void);
+void _U1RXInterrupt(void);
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ * xc.h
+ *
+ * Host stand-in for the XC16 device header so that the unmodified firmware
+ * sources may be compiled into the simulator.  Special function registers
+ * are plain variables and the bit structures alias them with the same
+ * layout as the PIC24FV16KM202 (only the bits the firmware uses are named).
+ */
+
+#ifndef SIM_XC_H
+#define SIM_XC_H
+
+#include <stdint.h>
+
+/* compiler and core intrinsics; persistent variables are kept across a
+ * warm reset by the simulator's --persist file */
+#define _ISR
+#define _PERSISTENT
+#define Nop()
+#define ClrWdt()    SIM_clrWdt()
+#define Idle()      SIM_idle()
+
+void SIM_clrWdt(void);
+void SIM_idle(void);
+
+#define SIM_BITS(reg)   (*(volatile reg##BITS *)&reg)
+
+/* registers without any named bits */
+extern volatile uint16_t CLKDIV, INTCON1, INTCON2, TBLPAG, RCON;
+extern volatile uint16_t AD1CON2, AD1CON3, AD1CHS, AD1CSSL, ADC1BUF0;
+extern volatile uint16_t U1BRG;
+extern volatile uint16_t CCP1PRH, CCP2PRH, CCP3PRH, CCP4PRH, CCP5PRH;
+extern volatile uint16_t CCP1PRL, CCP2PRL, CCP3PRL, CCP4PRL, CCP5PRL;
+extern volatile uint16_t CCP1CON1H, CCP2CON1H, CCP3CON1H, CCP4CON1H, CCP5CON1H;
+extern volatile uint16_t CCP1CON2L, CCP2CON2L, CCP3CON2L, CCP4CON2L, CCP5CON2L;
+extern volatile uint16_t CCP1CON2H, CCP2CON2H, CCP3CON2H, CCP4CON2H, CCP5CON2H;
+extern volatile uint16_t CCP1CON3L, CCP2CON3L, CCP3CON3L, CCP4CON3L, CCP5CON3L;
+extern volatile uint16_t CCP1RA, CCP2RA, CCP3RA, CCP4RA, CCP5RA;
+extern volatile uint16_t CCP1RB, CCP2RB, CCP3RB, CCP4RB, CCP5RB;
+extern volatile uint16_t CCP1TMRL, CCP2TMRL, CCP4TMRL, CCP5TMRL;
+
+/* the CCP3 count follows the virtual clock, a value written to it restarts
+ * the count from there */
+volatile uint16_t *SIM_ccp3TmrSlot(void);
+#define CCP3TMRL    (*SIM_ccp3TmrSlot())
+
+/* I/O ports */
+#define SIM_PORT_BITS(p) \
+    typedef struct { uint16_t p##0:1, p##1:1, p##2:1, p##3:1, p##4:1, p##5:1, p##6:1, p##7:1, \
+        p##8:1, p##9:1, p##10:1, p##11:1, p##12:1, p##13:1, p##14:1, p##15:1; }
+
+SIM_PORT_BITS(RA) PORTABITS;
+SIM_PORT_BITS(RB) PORTBBITS;
+SIM_PORT_BITS(LATA) LATABITS;
+SIM_PORT_BITS(LATB) LATBBITS;
+SIM_PORT_BITS(TRISA) TRISABITS;
+SIM_PORT_BITS(TRISB) TRISBBITS;
+SIM_PORT_BITS(ANSA) ANSABITS;
+SIM_PORT_BITS(ANSB) ANSBBITS;
+
+extern volatile uint16_t PORTA, PORTB, LATA, LATB, TRISA, TRISB, ANSA, ANSB;
+#define PORTAbits   SIM_BITS(PORTA)
+#define PORTBbits   SIM_BITS(PORTB)
+#define LATAbits    SIM_BITS(LATA)
+#define LATBbits    SIM_BITS(LATB)
+#define TRISAbits   SIM_BITS(TRISA)
+#define TRISBbits   SIM_BITS(TRISB)
+#define ANSAbits    SIM_BITS(ANSA)
+#define ANSBbits    SIM_BITS(ANSB)
+
+/* change notification */
+typedef struct { uint16_t CN0IE:1, CN1IE:1, CN2IE:1, CN3IE:1, CN4IE:1, CN5IE:1, CN6IE:1, CN7IE:1,
+    CN8IE:1, CN9IE:1, CN10IE:1, CN11IE:1, CN12IE:1, CN13IE:1, CN14IE:1, CN15IE:1; } CNEN1BITS;
+typedef struct { uint16_t CN16IE:1, CN17IE:1, CN18IE:1, CN19IE:1, CN20IE:1, CN21IE:1, CN22IE:1, CN23IE:1,
+    CN24IE:1, CN25IE:1, CN26IE:1, CN27IE:1, CN28IE:1, CN29IE:1, CN30IE:1, CN31IE:1; } CNEN2BITS;
+typedef struct { uint16_t CN0PDE:1, CN1PDE:1, CN2PDE:1, CN3PDE:1, CN4PDE:1, CN5PDE:1, CN6PDE:1, CN7PDE:1,
+    CN8PDE:1, CN9PDE:1, CN10PDE:1, CN11PDE:1, CN12PDE:1, CN13PDE:1, CN14PDE:1, CN15PDE:1; } CNPD1BITS;
+extern volatile uint16_t CNEN1, CNEN2, CNPD1;
+#define CNEN1bits   SIM_BITS(CNEN1)
+#define CNEN2bits   SIM_BITS(CNEN2)
+#define CNPD1bits   SIM_BITS(CNPD1)
+
+/* interrupt flags and enables */
+typedef struct { uint16_t :11, U1RXIF:1, U1TXIF:1, :3; } IFS0BITS;
+typedef struct { uint16_t :11, U1RXIE:1, U1TXIE:1, :3; } IEC0BITS;
+typedef struct { uint16_t :3, CNIF:1, :9, CCT3IF:1, :2; } IFS1BITS;
+typedef struct { uint16_t :3, CNIE:1, :9, CCT3IE:1, :2; } IEC1BITS;
+extern volatile uint16_t IFS0, IEC0, IFS1, IEC1;
+#define IFS0bits    SIM_BITS(IFS0)
+#define IEC0bits    SIM_BITS(IEC0)
+#define IFS1bits    SIM_BITS(IFS1)
+#define IEC1bits    SIM_BITS(IEC1)
+
+/* CPU status; the simulator runs the interrupts that wake Idle() whatever
+ * the priority, the order in which they run once it is lowered again */
+typedef struct { uint16_t C:1, Z:1, OV:1, N:1, RA:1, IPL:3, DC:1, :7; } SRBITS;
+extern volatile uint16_t SR;
+#define SRbits      SIM_BITS(SR)
+
+/* MCCP/SCCP */
+typedef struct { uint16_t MOD:4, CCSEL:1, T32:1, TMRPS:2, CLKSEL:3, TMRSYNC:1, CCPSLP:1, CCPSIDL:1, :1, CCPON:1; } CCPCON1LBITS;
+typedef struct { uint16_t :2, POLBDF:1, POLACE:1, :12; } CCPCON3HBITS;
+typedef CCPCON1LBITS CCP1CON1LBITS, CCP2CON1LBITS, CCP3CON1LBITS, CCP4CON1LBITS, CCP5CON1LBITS;
+typedef CCPCON3HBITS CCP1CON3HBITS, CCP2CON3HBITS, CCP3CON3HBITS, CCP4CON3HBITS, CCP5CON3HBITS;
+extern volatile uint16_t CCP1CON1L, CCP2CON1L, CCP3CON1L, CCP4CON1L, CCP5CON1L;
+extern volatile uint16_t CCP1CON3H, CCP2CON3H, CCP3CON3H, CCP4CON3H, CCP5CON3H;
+#define CCP1CON1Lbits   SIM_BITS(CCP1CON1L)
+#define CCP2CON1Lbits   SIM_BITS(CCP2CON1L)
+#define CCP3CON1Lbits   SIM_BITS(CCP3CON1L)
+#define CCP4CON1Lbits   SIM_BITS(CCP4CON1L)
+#define CCP5CON1Lbits   SIM_BITS(CCP5CON1L)
+#define CCP1CON3Hbits   SIM_BITS(CCP1CON3H)
+#define CCP2CON3Hbits   SIM_BITS(CCP2CON3H)
+#define CCP3CON3Hbits   SIM_BITS(CCP3CON3H)
+#define CCP4CON3Hbits   SIM_BITS(CCP4CON3H)
+#define CCP5CON3Hbits   SIM_BITS(CCP5CON3H)
+
+/* configurable logic cell 1, evaluated by the simulator whenever its
+ * inputs change */
+typedef struct { uint16_t MODE:3, :2, LCPOL:1, LCOUT:1, LCOE:1, :2, INTN:1, INTP:1, :3, LCEN:1; } CLC1CONLBITS;
+typedef struct { uint16_t G1POL:1, G2POL:1, G3POL:1, G4POL:1, :12; } CLC1CONHBITS;
+extern volatile uint16_t CLC1CONL, CLC1CONH, CLC1SELL, CLC1GLSL, CLC1GLSH;
+#define CLC1CONLbits    SIM_BITS(CLC1CONL)
+#define CLC1CONHbits    SIM_BITS(CLC1CONH)
+
+/* ADC */
+typedef struct { uint16_t DONE:1, SAMP:1, ASAM:1, :12, ADON:1; } AD1CON1BITS;
+extern volatile uint16_t AD1CON1;
+#define AD1CON1bits SIM_BITS(AD1CON1)
+
+/* NVM */
+typedef struct { uint16_t :15, WR:1; } NVMCONBITS;
+extern volatile uint16_t NVMCON;
+#define NVMCONbits  SIM_BITS(NVMCON)
+
+/* UART1, transmitted bytes are captured by the simulator as they are
+ * written and received bytes are supplied by it as they are read */
+typedef struct { uint16_t :3, BRGH:1, :11, UARTEN:1; } U1MODEBITS;
+typedef struct { uint16_t URXDA:1, OERR:1, :7, UTXBF:1, UTXEN:1, :2, UTXISEL0:1, :1, UTXISEL1:1; } U1STABITS;
+extern volatile uint16_t U1MODE, U1STA;
+#define U1MODEbits  SIM_BITS(U1MODE)
+#define U1STAbits   SIM_BITS(U1STA)
+
+volatile uint16_t *SIM_uartTxSlot(void);
+uint16_t SIM_uartRxRead(void);
+#define U1TXREG     (*SIM_uartTxSlot())
+#define U1RXREG     (SIM_uartRxRead())
+
+/* Timer1, the count is derived from the virtual clock when read */
+extern volatile uint16_t T1CON, PR1;
+uint16_t SIM_readTmr1(void);
+#define TMR1        (SIM_readTmr1())
+
+#endif
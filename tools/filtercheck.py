@@ -0,0 +1,306 @@
+#!/usr/bin/env python3
+"""
+Checks the filters of libfilterq15.c against double-precision references
+and measures their speed on the host.
+
+libfilterq15.c is compiled with the host's compiler together with a small
+driver that runs each filter over a buffer of samples and times it.  The
+checks are:
+
+ * EMA: the step response against y += alpha * (x - y) in doubles, and the
+   gain of sine waves against a / |1 - (1 - a) e^-jw|
+ * biquad: the step response against the same difference equation in
+   doubles, and the gain of sine waves against |H(e^jw)|, both with the Q14
+   coefficients, for a low-pass and a high-pass section; the rounded output
+   is fed back through 1 / A(z), so the step may be off by half an LSB times
+   the sum of that response's magnitudes, which grows as the poles near 1
+ * median: random samples with impulses against the median of the window,
+   which must match exactly
+
+The gains are measured over whole periods once the filter has settled.
+Each check has a tolerance, in LSBs for the step responses and in dB for
+the gains; the exit status is 1 when any check exceeds its tolerance.
+
+The timings are the best of several runs of every filter over a buffer of
+random samples, in ns per sample on the host; they compare the filters with
+one another rather than predict the cycles on the PIC24.
+
+Usage:
+    filtercheck.py [--source firmware/libfilterq15.c] [--cc cc] [--samples 1000000] [--seed 1]
+"""
+
+import argparse
+import cmath
+import ctypes
+import math
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+FIRMWARE = os.path.join(HERE, '..', 'firmware')
+
+EMA_STEP_LSB = 1.5                      # the truncated feedback and the rounded output
+GAIN_DB = 0.05                          # of a sine wave's gain, down to -40 dB
+GAIN_FLOOR_DB = -40.0                   # below which the gain is only checked to be as low
+STEP = 16384                            # 0.5
+AMPLITUDE = 16384
+FREQUENCIES = (0.001, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.3, 0.45)    # of the sample rate
+
+DRIVER = r'''
+#include <time.h>
+#include "libfilterq15.h"
+
+void run_ema(q15_t alpha, q15_t initial, const q15_t *in, q15_t *out, int n){
+    FilterEma f;
+    q15_ema_init(&f, alpha, initial);
+    for(int i = 0; i < n; i++)
+        out[i] = q15_ema_update(&f, in[i]);
+}
+
+void run_biquad(const int16_t *c, q15_t initial, const q15_t *in, q15_t *out, int n){
+    FilterBiquad f;
+    q15_biquad_init(&f, c[0], c[1], c[2], c[3], c[4]);
+    q15_biquad_reset(&f, initial);
+    for(int i = 0; i < n; i++)
+        out[i] = q15_biquad_update(&f, in[i]);
+}
+
+void run_median(int size, q15_t initial, const q15_t *in, q15_t *out, int n){
+    FilterMedian f;
+    q15_median_init(&f, (uint8_t)size, initial);
+    for(int i = 0; i < n; i++)
+        out[i] = q15_median_update(&f, in[i]);
+}
+
+static double now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* ns per sample of filter kind over the buffer, the sink keeps the
+ * outputs live */
+volatile q15_t sink;
+
+double bench(int kind, const q15_t *in, int n){
+    FilterEma ema;
+    FilterBiquad biquad;
+    FilterMedian median;
+    q15_ema_init(&ema, 1024, 0);
+    q15_biquad_init(&biquad, 920, 1841, 920, -25576, 10874);
+    q15_median_init(&median, (kind == 3) ? 5 : 3, 0);
+
+    double start = now();
+    for(int i = 0; i < n; i++){
+        switch(kind){
+            case 0:     sink = in[i];                               break;
+            case 1:     sink = q15_ema_update(&ema, in[i]);         break;
+            case 2:     sink = q15_median_update(&median, in[i]);   break;
+            case 3:     sink = q15_median_update(&median, in[i]);   break;
+            default:    sink = q15_biquad_update(&biquad, in[i]);   break;
+        }
+    }
+
+    return (now() - start) / n;
+}
+'''
+
+BENCHES = (('loop alone', 0), ('ema', 1), ('median of 3', 2), ('median of 5', 3), ('biquad', 4))
+
+
+def build(cc, source):
+    """the filters and the driver, compiled for the host"""
+    directory = tempfile.mkdtemp()
+    driver = os.path.join(directory, 'driver.c')
+    library = os.path.join(directory, 'libfilterq15.so')
+    with open(driver, 'w') as f:
+        f.write(DRIVER)
+    try:
+        subprocess.run([cc, '-O2', '-std=gnu99', '-shared', '-fPIC', '-I', os.path.dirname(os.path.abspath(source)),
+                        '-I', FIRMWARE, '-o', library, driver, source], check=True)
+    except (OSError, subprocess.CalledProcessError) as e:
+        sys.exit('%s: %s' % (source, e))
+
+    lib = ctypes.CDLL(library)
+    lib.bench.restype = ctypes.c_double
+    return lib
+
+
+def buffer(samples):
+    return (ctypes.c_int16 * len(samples))(*samples)
+
+
+def run(lib, kind, setup, samples):
+    out = (ctypes.c_int16 * len(samples))()
+    getattr(lib, 'run_' + kind)(*setup, buffer(samples), out, len(samples))
+    return list(out)
+
+
+def q15(value):
+    return max(-32768, min(32767, int(round(value * 32768.0))))
+
+
+def q14(value):
+    return max(-32768, min(32767, int(round(value * 16384.0))))
+
+
+def lowpass(fc, q):
+    """RBJ cookbook sections, normalized to a0 and quantized to Q14"""
+    w = 2.0 * math.pi * fc
+    alpha = math.sin(w) / (2.0 * q)
+    a0 = 1.0 + alpha
+    b = ((1.0 - math.cos(w)) / 2.0, 1.0 - math.cos(w), (1.0 - math.cos(w)) / 2.0)
+    return [q14(x / a0) for x in b] + [q14(-2.0 * math.cos(w) / a0), q14((1.0 - alpha) / a0)]
+
+
+def highpass(fc, q):
+    w = 2.0 * math.pi * fc
+    alpha = math.sin(w) / (2.0 * q)
+    a0 = 1.0 + alpha
+    b = ((1.0 + math.cos(w)) / 2.0, -(1.0 + math.cos(w)), (1.0 + math.cos(w)) / 2.0)
+    return [q14(x / a0) for x in b] + [q14(-2.0 * math.cos(w) / a0), q14((1.0 - alpha) / a0)]
+
+
+def ema_reference(alpha, initial, samples):
+    a = alpha / 32768.0
+    y = float(initial)
+    out = []
+    for x in samples:
+        y += a * (x - y)
+        out.append(y)
+    return out
+
+
+def biquad_reference(c, initial, samples):
+    b0, b1, b2, a1, a2 = (x / 16384.0 for x in c)
+    x1 = x2 = y1 = y2 = float(initial)
+    out = []
+    for x in samples:
+        y = b0 * x + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2
+        x2, x1, y2, y1 = x1, x, y1, y
+        out.append(y)
+    return out
+
+
+def ema_gain(alpha, f):
+    a = alpha / 32768.0
+    return abs(a / (1.0 - (1.0 - a) * cmath.exp(-2j * math.pi * f)))
+
+
+def biquad_gain(c, f):
+    b0, b1, b2, a1, a2 = (x / 16384.0 for x in c)
+    z = cmath.exp(-2j * math.pi * f)
+    return abs((b0 + b1 * z + b2 * z * z) / (1.0 + a1 * z + a2 * z * z))
+
+
+def rounding_gain(c, length=20000):
+    """the sum of the magnitudes of the impulse response of 1 / A(z), through
+    which the biquad's output rounding is fed back"""
+    a1, a2 = (x / 16384.0 for x in c[3:])
+    y1 = y2 = 0.0
+    total = 0.0
+    for n in range(length):
+        y = (1.0 if n == 0 else 0.0) - a1 * y1 - a2 * y2
+        y2, y1 = y1, y
+        total += abs(y)
+    return total
+
+
+def measured_gain(lib, kind, setup, f, settle):
+    """the amplitude of the output's component at f over whole periods once
+    settled, against that of the input"""
+    periods = max(4, int(math.ceil(4000 * f)))
+    length = int(round(periods / f))
+    samples = [int(round(AMPLITUDE * math.sin(2.0 * math.pi * f * n))) for n in range(settle + length)]
+    out = run(lib, kind, setup, samples)[settle:]
+
+    s = sum(y * math.sin(2.0 * math.pi * f * (n + settle)) for n, y in enumerate(out))
+    c = sum(y * math.cos(2.0 * math.pi * f * (n + settle)) for n, y in enumerate(out))
+    return 2.0 * math.hypot(s, c) / length / AMPLITUDE
+
+
+def db(gain):
+    return 20.0 * math.log10(max(gain, 1e-9))
+
+
+def check_step(lib, kind, setup, reference, tolerance, name):
+    samples = [STEP] * 2000
+    out = run(lib, kind, setup, samples)
+    error = max(abs(y - r) for y, r in zip(out, reference(setup[0], setup[1], samples)))
+    ok = error <= tolerance
+    print('%-26s step     max error %6.2f LSB of %.2f%s' % (name, error, tolerance, '' if ok else '  FAILED'))
+    return ok
+
+
+def check_gains(lib, kind, setup, gain, settle, name):
+    worst = 0.0
+    ok = True
+    for f in FREQUENCIES:
+        expected = db(gain(setup[0], f))
+        measured = db(measured_gain(lib, kind, setup, f, settle))
+        if expected < GAIN_FLOOR_DB:
+            ok &= measured < GAIN_FLOOR_DB + GAIN_DB
+        else:
+            worst = max(worst, abs(measured - expected))
+    ok &= worst <= GAIN_DB
+    print('%-26s response max error %6.3f dB%s' % (name, worst, '' if ok else '  FAILED'))
+    return ok
+
+
+def check_median(lib, size, generator, count):
+    samples = [generator.randint(-2000, 2000) if generator.random() > 0.05
+               else generator.choice((-32768, 32767)) for _ in range(count)]
+    out = run(lib, 'median', (size, 0), samples)
+    window = [0] * size
+    mismatches = 0
+    for n, x in enumerate(samples):
+        window = window[1:] + [x]
+        if out[n] != sorted(window)[size // 2]:
+            mismatches += 1
+    print('%-26s %d samples, %d mismatches%s' % ('median of %d' % size, count, mismatches,
+                                                  '' if mismatches == 0 else '  FAILED'))
+    return mismatches == 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('--source', default=os.path.join(FIRMWARE, 'libfilterq15.c'))
+    parser.add_argument('--cc', default='cc')
+    parser.add_argument('--samples', type=int, default=1000000, help='of each timing run')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    lib = build(args.cc, args.source)
+    generator = random.Random(args.seed)
+    ok = True
+
+    for alpha in (q15(0.5), q15(0.1), q15(1.0 / 64)):
+        name = 'ema alpha %.4f' % (alpha / 32768.0)
+        ok &= check_step(lib, 'ema', (alpha, 0), ema_reference, EMA_STEP_LSB, name)
+        ok &= check_gains(lib, 'ema', (alpha, 0), ema_gain, 20 * 32768 // alpha, name)
+
+    for name, coefficients in (('biquad low-pass 0.05', lowpass(0.05, 0.7071)),
+                               ('biquad low-pass 0.01', lowpass(0.01, 0.7071)),
+                               ('biquad high-pass 0.02', highpass(0.02, 0.7071))):
+        setup = (buffer(coefficients), 0)
+        tolerance = 0.5 * rounding_gain(coefficients) + 0.5
+        ok &= check_step(lib, 'biquad', setup, lambda c, i, s: biquad_reference(coefficients, i, s), tolerance, name)
+        ok &= check_gains(lib, 'biquad', setup, lambda c, f: biquad_gain(coefficients, f), 2000, name)
+
+    for size in (3, 5):
+        ok &= check_median(lib, size, generator, 100000)
+
+    samples = buffer([generator.randint(-32768, 32767) for _ in range(args.samples)])
+    print('%-26s %8s' % ('timing', 'ns/sample'))
+    for name, kind in BENCHES:
+        best = min(lib.bench(kind, samples, args.samples) for _ in range(5))
+        print('%-26s %8.2f' % (name, best))
+
+    return 0 if ok else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+"""
+Flash, RAM and stack footprint of the firmware, per module and per symbol.
+
+Reads the symbol sizes of each object file with nm and totals them against
+the budgets of the PIC24FV16KM202: 16 KB of flash, which is 5632 24-bit
+instructions or 11264 program counter units as xc16-nm reports sizes, and
+1 KB of RAM.  Initialized data counts against both, as its initial values
+are copied from flash at start-up.  Objects compiled with -fstack-usage
+leave a .su file beside them, from which the stack frame of each function
+is listed; the stack has whatever RAM the data leaves.
+
+Usage:
+    footprint.py [--nm xc16-nm] [--flash 11264] [--ram 1024] [--top 20] <object> ...
+
+The exit status is 1 when either budget is exceeded, so that the report can
+run as a post-build step.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+
+FLASH_BUDGET = 11264
+RAM_BUDGET = 1024
+
+KINDS = ('text', 'const', 'data', 'bss')
+
+
+def kind_of(letter):
+    """the memory a symbol of the nm type letter occupies, or None"""
+    letter = letter.lower()
+    if letter in 'tw':
+        return 'text'
+    if letter == 'r':
+        return 'const'
+    if letter in 'dgv':
+        return 'data'
+    if letter in 'bsc':
+        return 'bss'
+    return None
+
+
+def read_symbols(nm, path):
+    """(name, kind, size) of each sized symbol defined in an object"""
+    try:
+        out = subprocess.run([nm, '--defined-only', '--print-size', path],
+                             check=True, capture_output=True, text=True).stdout
+    except (OSError, subprocess.CalledProcessError) as e:
+        sys.exit('%s: %s' % (path, e))
+
+    symbols = []
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) != 4:
+            continue        # no size, a label rather than an object
+
+        kind = kind_of(fields[2])
+        size = int(fields[1], 16)
+        if kind is not None and size > 0:
+            symbols.append((fields[3], kind, size))
+
+    return symbols
+
+
+def read_stack(path):
+    """(function, frame bytes, qualifier) from the .su file of an object"""
+    su = os.path.splitext(path)[0] + '.su'
+    if not os.path.exists(su):
+        return []
+
+    frames = []
+    with open(su) as f:
+        for line in f:
+            fields = line.rstrip('\n').split('\t')
+            if len(fields) == 3:
+                frames.append((fields[0].rsplit(':', 1)[-1], int(fields[1]), fields[2]))
+
+    return frames
+
+
+def flash_of(sizes):
+    return sizes['text'] + sizes['const'] + sizes['data']
+
+
+def ram_of(sizes):
+    return sizes['data'] + sizes['bss']
+
+
+def main():
+    parser = argparse.ArgumentParser(description='firmware footprint report')
+    parser.add_argument('objects', nargs='+')
+    parser.add_argument('--nm', default='xc16-nm')
+    parser.add_argument('--flash', type=int, default=FLASH_BUDGET,
+                        help='flash budget in the units nm reports')
+    parser.add_argument('--ram', type=int, default=RAM_BUDGET, help='RAM budget in bytes')
+    parser.add_argument('--top', type=int, default=20, help='number of symbols and frames listed')
+    args = parser.parse_args()
+
+    modules = []
+    symbols = []
+    frames = []
+    totals = dict.fromkeys(KINDS, 0)
+
+    for path in args.objects:
+        module = os.path.splitext(os.path.basename(path))[0]
+        sizes = dict.fromkeys(KINDS, 0)
+
+        for name, kind, size in read_symbols(args.nm, path):
+            sizes[kind] += size
+            totals[kind] += size
+            symbols.append((size, kind, module, name))
+
+        for name, size, qualifier in read_stack(path):
+            frames.append((size, module, name, qualifier))
+
+        modules.append((module, sizes))
+
+    print('%-16s %7s %7s %7s %7s %7s %7s' % ('module', 'text', 'const', 'data', 'bss', 'flash', 'ram'))
+    for module, sizes in sorted(modules, key=lambda m: -flash_of(m[1])):
+        print('%-16s %7d %7d %7d %7d %7d %7d' % ((module,) + tuple(sizes[k] for k in KINDS)
+                                              + (flash_of(sizes), ram_of(sizes))))
+    print('%-16s %7d %7d %7d %7d %7d %7d' % (('total',) + tuple(totals[k] for k in KINDS)
+                                          + (flash_of(totals), ram_of(totals))))
+
+    print('\n%-16s %-32s %-6s %7s' % ('module', 'symbol', 'kind', 'size'))
+    for size, kind, module, name in sorted(symbols, reverse=True)[:args.top]:
+        print('%-16s %-32s %-6s %7d' % (module, name, kind, size))
+
+    if frames:
+        print('\n%-16s %-32s %-8s %7s' % ('module', 'function', 'frame', 'bytes'))
+        for size, module, name, qualifier in sorted(frames, reverse=True)[:args.top]:
+            print('%-16s %-32s %-8s %7d' % (module, name, qualifier, size))
+
+    flash = flash_of(totals)
+    ram = ram_of(totals)
+    print('\nflash %d of %d (%.0f%%), ram %d of %d (%.0f%%), %d left for the stack'
+          % (flash, args.flash, 100.0 * flash / args.flash,
+             ram, args.ram, 100.0 * ram / args.ram, args.ram - ram))
+    if frames:
+        print('deepest frame %d bytes, call depth not included' % max(f[0] for f in frames))
+
+    over = []
+    if flash > args.flash:
+        over.append('flash')
+    if ram > args.ram:
+        over.append('ram')
+    if over:
+        print('over budget: %s' % ', '.join(over))
+        return 1
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
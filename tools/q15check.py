@@ -0,0 +1,476 @@
+#!/usr/bin/env python3
+"""
+Checks the routines of libmathq15_xc16.s against their C versions.
+
+The C versions in libmathq15.c are left out of XC16 builds in favour of the
+assembly, and elsewhere are bit-exact models of it.  This script compiles
+libmathq15.c with the host's compiler and runs each assembly routine on a
+model of the PIC24 instructions that the file uses, over every input of the
+one operand routines and over the corner cases and random pairs of the two
+operand ones, and compares the results.  The model also counts the cycles of
+each call, from the caller's call to the return, by the PIC24F timings:
+branches taken, goto and call take 2 cycles, return 3, a skip 2 or 3 and a
+read through the PSV window 1 more; a div.sd repeated 18 times takes 18.
+
+Usage:
+    q15check.py [--asm firmware/libmathq15_xc16.s] [--source firmware/libmathq15.c]
+                [--cc cc] [--pairs 100000] [--seed 1]
+
+An older libmathq15_xc16.s may be given with --asm to compare its cycles;
+routines that it lacks are listed as such.  The exit status is 1 when any
+result differs from the C version.
+"""
+
+import argparse
+import ctypes
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+FIRMWARE = os.path.join(HERE, '..', 'firmware')
+
+PSV_BASE = 0x8000       # where the model maps sine_table in data space
+SINE_TABLE_ENTRIES = 256
+
+SR_BITS = {'C': 0, 'Z': 1, 'OV': 2, 'N': 3}
+TWO_WORD = ('goto', 'call')
+
+CORNERS = (0, 1, 2, 3, 63, 64, 255, 256, 4095, 8191, 16383, 16384, 32766, 32767,
+           -1, -2, -63, -64, -256, -16384, -32767, -32768)
+
+
+class AsmError(Exception):
+    pass
+
+
+def s16(value):
+    value &= 0xffff
+    return value - 0x10000 if value & 0x8000 else value
+
+
+def parse(path):
+    """the instructions of an assembly file as (mnemonic, operands, line),
+    and the index of each label"""
+    program = []
+    labels = {}
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            line = line.split(';', 1)[0].strip()
+            label = re.match(r'^([A-Za-z_.$][\w.$]*):(.*)$', line)
+            if label:
+                labels[label.group(1)] = len(program)
+                line = label.group(2).strip()
+            if not line or line.startswith('.') or line.startswith('#'):
+                continue
+
+            fields = line.split(None, 1)
+            operands = [o.strip() for o in fields[1].split(',')] if len(fields) > 1 else []
+            program.append((fields[0].lower(), operands, number))
+
+    return program, labels
+
+
+class Machine:
+    """just enough of a PIC24 to run libmathq15_xc16.s"""
+
+    def __init__(self, path, sine_table):
+        self.program, self.labels = parse(path)
+        self.memory = {}
+        for i, value in enumerate(sine_table):
+            self.memory[PSV_BASE + 2 * i] = value & 0xffff
+        self.symbols = {'_sine_table': PSV_BASE}
+
+    def has(self, name):
+        return ('_' + name) in self.labels
+
+    def run(self, name, *args):
+        """w0 on return and the cycles taken, the call included"""
+        self.w = [0] * 16
+        for i, value in enumerate(args):
+            self.w[i] = value & 0xffff
+        self.flags = {'C': 0, 'Z': 0, 'OV': 0, 'N': 0}
+        self.repeat = 0
+        stack = [None]
+        pc = self.labels['_' + name]
+        cycles = 2
+
+        while True:
+            if pc >= len(self.program):
+                raise AsmError('%s runs off the end' % name)
+            op, operands, number = self.program[pc]
+            handler = getattr(self, 'op_' + op.replace('.', '_'), None)
+            if handler is None:
+                raise AsmError('line %d: %s is not modelled' % (number, op))
+
+            try:
+                result = handler(*operands)
+            except AsmError as e:
+                raise AsmError('line %d: %s' % (number, e))
+
+            if op == 'repeat':
+                count = result
+                pc += 1
+                op, operands, number = self.program[pc]
+                if op != 'div.sd' or count != 17:
+                    raise AsmError('line %d: only repeat #17 of div.sd is modelled' % number)
+                self.op_div_sd(*operands)
+                cycles += 1 + count + 1
+                pc += 1
+                continue
+
+            step, taken = result if isinstance(result, tuple) else (result, None)
+            if op == 'return':
+                cycles += 3
+                pc = stack.pop()
+                if pc is None:
+                    return s16(self.w[0]), cycles
+            elif op == 'call':
+                cycles += 2
+                stack.append(pc + 1)
+                pc = self.target(operands[0])
+            elif op in ('goto', 'bra') and taken is not False:
+                cycles += 2
+                pc = self.target(operands[-1])
+            elif op.startswith('bt') or op.startswith('cps'):
+                if taken:
+                    skipped = self.program[pc + 1][0]
+                    cycles += 3 if skipped in TWO_WORD else 2
+                    pc += 2
+                else:
+                    cycles += 1
+                    pc += 1
+            else:
+                cycles += step
+                pc += 1
+
+    def target(self, label):
+        if label not in self.labels:
+            raise AsmError('no label %s' % label)
+        return self.labels[label]
+
+    # operands
+    def reg(self, operand):
+        m = re.match(r'^w(\d+)$', operand, re.I)
+        if not m:
+            raise AsmError('%s is not a register' % operand)
+        return int(m.group(1))
+
+    def literal(self, operand):
+        if not operand.startswith('#'):
+            raise AsmError('%s is not a literal' % operand)
+        text = operand[1:]
+        m = re.match(r'^psvoffset\((\w+)\)$', text)
+        if m:
+            return self.symbols[m.group(1)]
+        return int(text, 0)
+
+    def read(self, operand):
+        """the value of a source operand and the extra cycles to read it"""
+        if operand.startswith('#'):
+            return self.literal(operand) & 0xffff, 0
+        m = re.match(r'^\[w(\d+)(\+\+)?\]$', operand, re.I)
+        if m:
+            n = int(m.group(1))
+            address = self.w[n]
+            if address not in self.memory:
+                raise AsmError('read of 0x%04x' % address)
+            if m.group(2):
+                self.w[n] = (address + 2) & 0xffff
+            return self.memory[address], (1 if address >= PSV_BASE else 0)
+        return self.w[self.reg(operand)], 0
+
+    def set_nz(self, value):
+        self.flags['N'] = (value >> 15) & 1
+        self.flags['Z'] = int(value == 0)
+
+    def add(self, a, b, carry=0):
+        total = a + b + carry
+        result = total & 0xffff
+        self.flags['C'] = int(total > 0xffff)
+        self.flags['OV'] = int(((a ^ result) & (b ^ result) & 0x8000) != 0)
+        self.set_nz(result)
+        return result
+
+    def sub(self, a, b):
+        return self.add(a, (~b) & 0xffff, 1)
+
+    # instructions; each returns its cycles, or for a branch or skip
+    # (cycles, whether taken)
+    def op_mov(self, src, dst):
+        value, extra = self.read(src)
+        self.w[self.reg(dst)] = value
+        return 1 + extra
+
+    def op_clr(self, dst):
+        self.w[self.reg(dst)] = 0
+        return 1
+
+    def op_setm(self, dst):
+        self.w[self.reg(dst)] = 0xffff
+        return 1
+
+    def multiply(self, a, b, dst, signed):
+        x, y = self.w[self.reg(a)], self.w[self.reg(b)]
+        if signed:
+            x, y = s16(x), s16(y)
+        product = (x * y) & 0xffffffff
+        n = self.reg(dst)
+        self.w[n] = product & 0xffff
+        self.w[n + 1] = product >> 16
+        return 1
+
+    def op_mul_ss(self, a, b, dst):
+        return self.multiply(a, b, dst, True)
+
+    def op_mul_uu(self, a, b, dst):
+        return self.multiply(a, b, dst, False)
+
+    def op_div_sd(self, m, n):
+        low = self.reg(m)
+        if low & 1:
+            raise AsmError('div.sd needs an even register')
+        dividend = self.w[low] | (self.w[low + 1] << 16)
+        if dividend & 0x80000000:
+            dividend -= 0x100000000
+        divisor = s16(self.w[self.reg(n)])
+        if divisor == 0:
+            raise AsmError('div.sd by 0')
+        quotient = abs(dividend) // abs(divisor)
+        if (dividend < 0) != (divisor < 0):
+            quotient = -quotient
+        if not -32768 <= quotient <= 32767:
+            raise AsmError('div.sd overflows, %d / %d' % (dividend, divisor))
+        self.w[0] = quotient & 0xffff
+        self.w[1] = (dividend - quotient * divisor) & 0xffff
+        self.set_nz(self.w[0])
+        return 1
+
+    def op_repeat(self, count):
+        return self.literal(count)
+
+    def op_rlc(self, src, dst):
+        value = self.w[self.reg(src)]
+        result = ((value << 1) | self.flags['C']) & 0xffff
+        self.flags['C'] = value >> 15
+        self.set_nz(result)
+        self.w[self.reg(dst)] = result
+        return 1
+
+    def shift(self, args, function):
+        if len(args) == 3:
+            value, count, dst = self.w[self.reg(args[0])], self.literal(args[1]), args[2]
+        else:
+            value, count, dst = self.w[self.reg(args[0])], 1, args[1]
+        result = function(value, count) & 0xffff
+        self.set_nz(result)
+        self.w[self.reg(dst)] = result
+        return 1
+
+    def op_sl(self, *args):
+        return self.shift(args, lambda v, c: v << c)
+
+    def op_lsr(self, *args):
+        return self.shift(args, lambda v, c: v >> c)
+
+    def op_asr(self, *args):
+        return self.shift(args, lambda v, c: s16(v) >> c)
+
+    def logic(self, args, function):
+        if args[0].startswith('#'):
+            a, b, dst = self.literal(args[0]), self.w[self.reg(args[1])], args[1]
+        else:
+            a, b, dst = self.w[self.reg(args[0])], self.w[self.reg(args[1])], args[2]
+        result = function(a, b) & 0xffff
+        self.set_nz(result)
+        self.w[self.reg(dst)] = result
+        return 1
+
+    def op_and(self, *args):
+        return self.logic(args, lambda a, b: a & b)
+
+    def op_xor(self, *args):
+        return self.logic(args, lambda a, b: a ^ b)
+
+    def op_add(self, a, b, dst):
+        self.w[self.reg(dst)] = self.add(self.w[self.reg(a)], self.w[self.reg(b)])
+        return 1
+
+    def op_sub(self, a, b, dst):
+        self.w[self.reg(dst)] = self.sub(self.w[self.reg(a)], self.w[self.reg(b)])
+        return 1
+
+    def op_neg(self, src, dst):
+        self.w[self.reg(dst)] = self.sub(0, self.w[self.reg(src)])
+        return 1
+
+    def op_com(self, src, dst):
+        result = (~self.w[self.reg(src)]) & 0xffff
+        self.set_nz(result)
+        self.w[self.reg(dst)] = result
+        return 1
+
+    def op_inc(self, src, dst):
+        self.w[self.reg(dst)] = self.add(self.w[self.reg(src)], 1)
+        return 1
+
+    def op_dec(self, src, dst):
+        self.w[self.reg(dst)] = self.sub(self.w[self.reg(src)], 1)
+        return 1
+
+    def op_cp(self, a, b):
+        self.sub(self.w[self.reg(a)], self.w[self.reg(b)])
+        return 1
+
+    def bit(self, src, bit):
+        n = self.literal(bit)
+        if src.upper() == 'SR':
+            return next((self.flags[f] for f, b in SR_BITS.items() if b == n), 0)
+        return (self.w[self.reg(src)] >> n) & 1
+
+    def op_btsc(self, src, bit):
+        return 1, self.bit(src, bit) == 0
+
+    def op_btss(self, src, bit):
+        return 1, self.bit(src, bit) == 1
+
+    def compare(self, a, b):
+        return s16(self.w[self.reg(a)]), s16(self.w[self.reg(b)])
+
+    def op_cpseq(self, a, b):
+        x, y = self.compare(a, b)
+        return 1, x == y
+
+    def op_cpsne(self, a, b):
+        x, y = self.compare(a, b)
+        return 1, x != y
+
+    def op_cpsgt(self, a, b):
+        x, y = self.compare(a, b)
+        return 1, x > y
+
+    def op_cpslt(self, a, b):
+        x, y = self.compare(a, b)
+        return 1, x < y
+
+    def op_bra(self, *args):
+        if len(args) == 1:
+            return 1, True
+        f = self.flags
+        conditions = {
+            'z': f['Z'], 'nz': not f['Z'], 'c': f['C'], 'nc': not f['C'],
+            'geu': f['C'], 'ltu': not f['C'], 'gtu': f['C'] and not f['Z'], 'leu': not f['C'] or f['Z'],
+            'n': f['N'], 'nn': not f['N'], 'ov': f['OV'], 'nov': not f['OV'],
+            'ge': f['N'] == f['OV'], 'lt': f['N'] != f['OV'],
+            'gt': not f['Z'] and f['N'] == f['OV'], 'le': f['Z'] or f['N'] != f['OV'],
+        }
+        condition = args[0].lower()
+        if condition not in conditions:
+            raise AsmError('bra %s is not modelled' % condition)
+        return 1, bool(conditions[condition])
+
+    def op_goto(self, label):
+        return 2, True
+
+    def op_call(self, label):
+        return 2
+
+    def op_return(self):
+        return 3
+
+
+def build_models(cc, source):
+    """the C versions, compiled for the host"""
+    directory = tempfile.mkdtemp()
+    library = os.path.join(directory, 'libmathq15.so')
+    try:
+        subprocess.run([cc, '-O2', '-shared', '-fPIC', '-I', os.path.dirname(os.path.abspath(source)),
+                        '-I', FIRMWARE, '-o', library, source], check=True)
+    except (OSError, subprocess.CalledProcessError) as e:
+        sys.exit('%s: %s' % (source, e))
+
+    lib = ctypes.CDLL(library)
+    one = {'q15_abs': ctypes.c_int16, 'q15_sqrt': ctypes.c_int16, 'q15_sin90': ctypes.c_uint16}
+    for name in ('q15_mul', 'q15_div', 'q15_add', 'q15_abs', 'q15_sqrt', 'q15_sin90'):
+        function = getattr(lib, name)
+        function.restype = ctypes.c_int16
+        if name in one:
+            function.argtypes = [one[name]]
+        else:
+            function.argtypes = [ctypes.c_int16, ctypes.c_int16]
+
+    table = (ctypes.c_int16 * SINE_TABLE_ENTRIES).in_dll(lib, 'sine_table')
+    return lib, list(table)
+
+
+def inputs_of(name, pairs, seed):
+    """every input of a one operand routine, corners and random pairs of
+    the others"""
+    if name in ('q15_abs', 'q15_sqrt'):
+        return [(x,) for x in range(-32768, 32768)]
+    if name == 'q15_sin90':
+        return [(x,) for x in range(65536)]
+
+    generator = random.Random(seed)
+    cases = [(a, b) for a in CORNERS for b in CORNERS]
+    cases += [(generator.randint(-32768, 32767), generator.randint(-32768, 32767)) for _ in range(pairs)]
+    return cases
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('--asm', default=os.path.join(FIRMWARE, 'libmathq15_xc16.s'))
+    parser.add_argument('--source', default=os.path.join(FIRMWARE, 'libmathq15.c'))
+    parser.add_argument('--cc', default='cc')
+    parser.add_argument('--pairs', type=int, default=100000,
+                        help='random operand pairs of each two operand routine')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    lib, sine_table = build_models(args.cc, args.source)
+    machine = Machine(args.asm, sine_table)
+
+    print('%-10s %8s %10s %7s %7s %7s' % ('routine', 'inputs', 'mismatches', 'min', 'mean', 'max'))
+    failed = False
+    for name in ('q15_mul', 'q15_div', 'q15_add', 'q15_abs', 'q15_sqrt', 'q15_sin90'):
+        if not machine.has(name):
+            print('%-10s not in %s' % (name, os.path.basename(args.asm)))
+            continue
+
+        model = getattr(lib, name)
+        mismatches = 0
+        low, high, total, runs = None, 0, 0, 0
+        cases = inputs_of(name, args.pairs, args.seed)
+        for operands in cases:
+            expected = model(*operands)
+            try:
+                result, cycles = machine.run(name, *operands)
+            except AsmError as e:
+                # an overflowing div.sd leaves w0 undefined
+                if mismatches < 5:
+                    print('  %s%s: %s, the C version gives %d' % (name, operands, e, expected))
+                mismatches += 1
+                continue
+
+            if result != expected:
+                if mismatches < 5:
+                    print('  %s%s = %d, the C version gives %d' % (name, operands, result, expected))
+                mismatches += 1
+
+            low = cycles if low is None else min(low, cycles)
+            high = max(high, cycles)
+            total += cycles
+            runs += 1
+
+        failed |= mismatches > 0
+        print('%-10s %8d %10d %7d %7.1f %7d' % (name, len(cases), mismatches, low or 0,
+                                                total / runs if runs else 0.0, high))
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,498 @@
+#!/usr/bin/env python3
+"""
+Host-side decoder for the fan controller telemetry stream.
+
+Frames are [SYNC][type][seq][length][payload...][crc low][crc high], with a
+CRC-16/CCITT-FALSE over type, seq, length and payload.  See
+firmware/telemetry.h for the message definitions.
+
+Usage:
+    telemetry.py monitor /dev/ttyUSB0
+    telemetry.py set-target /dev/ttyUSB0 <fan> <duty 0.0-1.0> [--save]
+    telemetry.py set-rate /dev/ttyUSB0 <period ms>
+    telemetry.py set-rpm /dev/ttyUSB0 <fan> <rpm, 0 follows the input>
+    telemetry.py autotune /dev/ttyUSB0 [<fan> ...]
+    telemetry.py characterize /dev/ttyUSB0 [<fan> ...]
+    telemetry.py set-demand /dev/ttyUSB0 <demand 0.0-1.0> [--fans <fan> ...] [--timeout <ms>] [--clear]
+    telemetry.py set-policy /dev/ttyUSB0 max|blend|priority [--fans <fan> ...] [--weights <w> <w> <w> <w>]
+    telemetry.py dump-trace /dev/ttyUSB0 <file>
+    telemetry.py dump-blackbox /dev/ttyUSB0 [--raw <file>]
+    telemetry.py decode-blackbox <file>
+    telemetry.py loopback
+
+'loopback' opens a pseudo-terminal with a stand-in device behind it that
+streams status frames and answers commands, so that the decoder and any
+other host tooling can be exercised without hardware.
+"""
+
+import argparse
+import os
+import pty
+import select
+import struct
+import sys
+import termios
+import threading
+import time
+import tty
+
+SYNC = 0xa5
+MAX_PAYLOAD = 48
+
+MSG_STATUS = 0x01
+MSG_SCHED = 0x02
+MSG_TRACE = 0x03
+MSG_PROFILE = 0x04
+MSG_BLACKBOX = 0x05
+MSG_ACK = 0x7f
+CMD_SET_TARGET = 0x81
+CMD_SET_RATE = 0x82
+CMD_TRACE_DUMP = 0x83
+CMD_AUTOTUNE = 0x84
+CMD_SET_RPM = 0x85
+CMD_CHARACTERIZE = 0x86
+CMD_SET_DEMAND = 0x87
+CMD_SET_POLICY = 0x88
+CMD_BLACKBOX_DUMP = 0x89
+
+PROFILE_REGIONS = ['task{}'.format(i) for i in range(10)] + [
+    'eeprom_write', 'isr_cct3', 'isr_cn', 'isr_u1tx', 'isr_u1rx']
+
+NUM_OF_FANS = 4
+POLICIES = ['max', 'blend', 'priority']
+FAN_STATES = ['INIT', 'FAN_START', 'NORMAL', 'FAN_ADJ', 'FAN_TUNE', 'FAN_SWEEP']
+STALL_STATES = ['ok', 'kick', 'recover', 'backoff', 'FAULT']
+
+# black box records, see firmware/blackbox.h
+BBOX_RECORD_SIZE = 8
+BBOX_RPM_SHIFT = 5
+BBOX_DC_SHIFT = 7
+BBOX_RESET, BBOX_STALL, BBOX_INPUT_LOSS, BBOX_CHECK_FAIL, BBOX_KEY_RPM, BBOX_KEY_DC, BBOX_DELTA = range(1, 8)
+RESET_CAUSES = [(0x8000, 'trap'), (0x4000, 'illegal opcode'), (0x0400, 'deep sleep'), (0x0200, 'clock fail'),
+                (0x0080, 'mclr'), (0x0040, 'software'), (0x0010, 'watchdog'), (0x0002, 'brown-out'),
+                (0x0001, 'power-on')]
+
+
+def crc16(data, crc=0xffff):
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if (crc & 0x8000) else (crc << 1)
+            crc &= 0xffff
+    return crc
+
+
+def encode(msg_type, seq, payload=b''):
+    body = bytes([msg_type, seq & 0xff, len(payload)]) + payload
+    return bytes([SYNC]) + body + struct.pack('<H', crc16(body))
+
+
+class Decoder:
+    """ feed() bytes in any sized pieces, complete frames are returned as
+    (type, seq, payload) tuples; bad frames and sequence gaps are counted """
+
+    def __init__(self):
+        self.buf = bytearray()
+        self.crc_errors = 0
+        self.dropped = 0
+        self.last_seq = None
+
+    def feed(self, data):
+        self.buf += data
+        frames = []
+
+        while True:
+            start = self.buf.find(SYNC)
+            if start < 0:
+                self.buf.clear()
+                break
+            del self.buf[:start]
+
+            if len(self.buf) < 4:
+                break
+            length = self.buf[3]
+            if length > MAX_PAYLOAD:
+                del self.buf[0]
+                continue
+            if len(self.buf) < length + 6:
+                break
+
+            body = bytes(self.buf[1:4 + length])
+            crc, = struct.unpack_from('<H', self.buf, 4 + length)
+            if crc != crc16(body):
+                # resynchronize on the next sync byte
+                self.crc_errors += 1
+                del self.buf[0]
+                continue
+
+            del self.buf[:length + 6]
+            msg_type, seq = body[0], body[1]
+            if self.last_seq is not None:
+                self.dropped += (seq - self.last_seq - 1) & 0xff
+            self.last_seq = seq
+            frames.append((msg_type, seq, body[3:]))
+
+        return frames
+
+
+def describe(msg_type, payload):
+    if msg_type == MSG_STATUS:
+        t, state, input_dc, faults = struct.unpack_from('<IBhB', payload)
+        fans = []
+        for i in range(NUM_OF_FANS):
+            dc, target, rpm, stall = struct.unpack_from('<hhHB', payload, 8 + 7 * i)
+            fans.append('fan{}: {:5.1f}%/{:5.1f}% {:5d}rpm {}'.format(
+                i, 100.0 * dc / 32768, 100.0 * target / 32768, rpm,
+                STALL_STATES[stall] if stall < len(STALL_STATES) else stall))
+        state = FAN_STATES[state] if state < len(FAN_STATES) else state
+        return '{:10d}ms {:9s} in:{:5.1f}% faults:{:#04x} | {}'.format(
+            t, state, 100.0 * input_dc / 32768, faults, ' | '.join(fans))
+
+    if msg_type == MSG_SCHED:
+        names = ['ctl', 'ctl_skip', 'pwm', 'pwm_skip', 'late', 'max_late', 'fast_wcet_us']
+        values = struct.unpack_from('<6IH', payload)
+        return 'sched ' + ' '.join('{}:{}'.format(n, v) for n, v in zip(names, values))
+
+    if msg_type == MSG_TRACE:
+        offset, total = struct.unpack_from('<HH', payload)
+        return 'trace {}-{} of {}'.format(offset, offset + len(payload) - 4, total)
+
+    if msg_type == MSG_BLACKBOX:
+        offset, total = struct.unpack_from('<HH', payload)
+        return 'blackbox {}-{} of {}'.format(offset, offset + len(payload) - 4, total)
+
+    if msg_type == MSG_PROFILE:
+        region, count, worst = struct.unpack_from('<BIH', payload)
+        bins = struct.unpack_from('<8H', payload, 7)
+        name = PROFILE_REGIONS[region] if region < len(PROFILE_REGIONS) else str(region)
+        # durations are in 0.5us timer counts, bin n holds those under 4us << n
+        return 'profile {} n:{} max:{:.1f}us hist:{}'.format(
+            name, count, worst / 2.0, '/'.join(str(b) for b in bins))
+
+    if msg_type == MSG_ACK:
+        return 'ack cmd:{:#04x} {}'.format(payload[0], 'ok' if payload[1] == 0 else 'REJECTED')
+
+    return 'type {:#04x}: {}'.format(msg_type, payload.hex())
+
+
+def open_port(path, baud=115200):
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(fd)
+    attrs = termios.tcgetattr(fd)
+    speed = getattr(termios, 'B{}'.format(baud))
+    attrs[4] = attrs[5] = speed
+    termios.tcsetattr(fd, termios.TCSANOW, attrs)
+    return fd
+
+
+def monitor(fd, count=None):
+    decoder = Decoder()
+    seen = 0
+    while count is None or seen < count:
+        frames = decoder.feed(os.read(fd, 256))
+        for msg_type, seq, payload in frames:
+            print('[{:3d}] {}'.format(seq, describe(msg_type, payload)))
+            seen += 1
+    print('crc errors: {}, dropped frames: {}'.format(decoder.crc_errors, decoder.dropped))
+
+
+def command(fd, msg_type, payload):
+    os.write(fd, encode(msg_type, 0, payload))
+
+    decoder = Decoder()
+    deadline = time.time() + 1.0
+    while time.time() < deadline:
+        if select.select([fd], [], [], 0.1)[0]:
+            for rx_type, _, rx_payload in decoder.feed(os.read(fd, 256)):
+                if rx_type == MSG_ACK and rx_payload[0] == msg_type:
+                    print(describe(rx_type, rx_payload))
+                    return rx_payload[1] == 0
+    print('no response')
+    return False
+
+
+def dump_trace(fd, path):
+    """ requests the trace recorder contents, which may be replayed with
+    the simulator (sim/fansim --replay) """
+    data = collect(fd, CMD_TRACE_DUMP, MSG_TRACE, 'trace')
+    if data is None:
+        return False
+
+    with open(path, 'wb') as f:
+        f.write(data)
+    print('{} bytes written to {}'.format(len(data), path))
+    return True
+
+
+def dump_blackbox(fd, path=None):
+    """ requests the black box log, oldest record first, and prints it """
+    data = collect(fd, CMD_BLACKBOX_DUMP, MSG_BLACKBOX, 'black box')
+    if data is None:
+        return False
+
+    if path:
+        with open(path, 'wb') as f:
+            f.write(data)
+    for line in decode_blackbox(data):
+        print(line)
+    return True
+
+
+def collect(fd, cmd, msg, name):
+    """ the chunks of a dump in order, or None when one goes missing """
+    os.write(fd, encode(cmd, 0))
+
+    decoder = Decoder()
+    data = bytearray()
+    total = None
+    deadline = time.time() + 5.0
+    while time.time() < deadline and (total is None or len(data) < total):
+        if select.select([fd], [], [], 0.1)[0]:
+            for msg_type, _, payload in decoder.feed(os.read(fd, 256)):
+                if msg_type != msg:
+                    continue
+                offset, total = struct.unpack_from('<HH', payload)
+                if offset != len(data):
+                    print('{} chunk at {} missing, expected {}'.format(name, offset, len(data)))
+                    return None
+                data += payload[4:]
+
+    if total is None or len(data) < total:
+        print('incomplete {}'.format(name))
+        return None
+
+    return bytes(data)
+
+
+def bbox_check(data):
+    """ CRC-8, polynomial 0x07, over the record less its check byte """
+    crc = 0xff
+    for byte in data[1:]:
+        crc ^= byte
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xff if crc & 0x80 else (crc << 1) & 0xff
+    return crc
+
+
+def decode_blackbox(data):
+    """ a line per record of a black box dump; summaries are absolute in a
+    pair of records and otherwise signed nibble changes from the last """
+    rpm = dc = None
+    lines = []
+    for pos in range(0, len(data) - BBOX_RECORD_SIZE + 1, BBOX_RECORD_SIZE):
+        record = data[pos:pos + BBOX_RECORD_SIZE]
+        header, hour, first, second = struct.unpack('<4H', record)
+        if header in (0x0000, 0xffff):
+            continue
+
+        kind, detail = header >> 12, (header >> 8) & 0x0f
+        text = None
+        if bbox_check(record) != header & 0xff:
+            rpm = dc = None
+            text = 'corrupt record'
+        elif kind == BBOX_RESET:
+            causes = [n for bit, n in RESET_CAUSES if first & bit] or ['unknown']
+            text = '{} reset, {} ({:#06x})'.format('warm' if detail else 'cold', ', '.join(causes), first)
+        elif kind == BBOX_STALL:
+            text = 'stall fan{} at {:.1f}%'.format(detail, 100.0 * first / 32768)
+        elif kind == BBOX_INPUT_LOSS:
+            text = 'input lost at {:.1f}%'.format(100.0 * first / 32768)
+        elif kind == BBOX_CHECK_FAIL:
+            text = '{} corrupt records found from slot {}'.format(detail, first)
+        elif kind in (BBOX_KEY_RPM, BBOX_KEY_DC):
+            values = list(struct.pack('<HH', first, second))
+            if kind == BBOX_KEY_RPM:
+                rpm = values
+                continue        # the duty cycle half follows
+            dc = values
+        elif kind == BBOX_DELTA:
+            if rpm is not None and dc is not None:
+                nibble = lambda word, i: (((word >> (4 * i)) & 0x0f) ^ 0x08) - 0x08
+                rpm = [(r + nibble(first, i)) & 0xff for i, r in enumerate(rpm)]
+                dc = [(d + nibble(second, i)) & 0xff for i, d in enumerate(dc)]
+        else:
+            text = 'type {}'.format(kind)
+
+        if text is None:
+            if rpm is None or dc is None:
+                text = 'summary, no earlier absolute summary'
+            else:
+                text = 'summary ' + ' | '.join('fan{}: {:4d}rpm {:5.1f}%'.format(
+                    i, r << BBOX_RPM_SHIFT, 100.0 * (d << BBOX_DC_SHIFT) / 32768)
+                    for i, (r, d) in enumerate(zip(rpm, dc)))
+        lines.append('hour {:5d}  {}'.format(hour, text))
+    return lines
+
+
+class StandIn(threading.Thread):
+    """ a minimal device model behind a pty: it streams status frames at the
+    commanded rate and applies SET_TARGET/SET_RATE commands """
+
+    def __init__(self, fd):
+        super().__init__(daemon=True)
+        self.fd = fd
+        self.seq = 0
+        self.period = 0.1
+        self.targets = [32767] * NUM_OF_FANS
+        self.start_time = time.time()
+
+    def send(self, msg_type, payload):
+        os.write(self.fd, encode(msg_type, self.seq, payload))
+        self.seq += 1
+
+    def status(self):
+        t = int((time.time() - self.start_time) * 1000)
+        payload = struct.pack('<IBhB', t, 2, 24000, 0)
+        for target in self.targets:
+            dc = target * 24000 // 32768
+            payload += struct.pack('<hhHB', dc, target, dc * 3000 // 32768, 0)
+        return payload
+
+    def run(self):
+        decoder = Decoder()
+        next_status = time.time()
+        while True:
+            timeout = max(0.0, next_status - time.time()) if self.period else 0.1
+            if select.select([self.fd], [], [], timeout)[0]:
+                for msg_type, _, payload in decoder.feed(os.read(self.fd, 256)):
+                    ok = False
+                    if msg_type == CMD_SET_TARGET and len(payload) == 4 and payload[0] < NUM_OF_FANS:
+                        self.targets[payload[0]] = struct.unpack_from('<h', payload, 1)[0]
+                        ok = True
+                    elif msg_type in (CMD_AUTOTUNE, CMD_SET_RPM, CMD_CHARACTERIZE, CMD_SET_DEMAND, CMD_SET_POLICY):
+                        ok = True
+                    elif msg_type == CMD_SET_RATE and len(payload) == 2:
+                        period, = struct.unpack('<H', payload)
+                        self.period = period / 1000.0
+                        ok = True
+                    self.send(MSG_ACK, bytes([msg_type, 0 if ok else 1]))
+
+            if self.period and time.time() >= next_status:
+                self.send(MSG_STATUS, self.status())
+                next_status = time.time() + self.period
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--baud', type=int, default=115200)
+    sub = parser.add_subparsers(dest='cmd', required=True)
+
+    p = sub.add_parser('monitor')
+    p.add_argument('port')
+    p.add_argument('--count', type=int)
+
+    p = sub.add_parser('set-target')
+    p.add_argument('port')
+    p.add_argument('fan', type=int)
+    p.add_argument('duty', type=float)
+    p.add_argument('--save', action='store_true')
+
+    p = sub.add_parser('set-rate')
+    p.add_argument('port')
+    p.add_argument('period', type=int)
+
+    p = sub.add_parser('set-rpm')
+    p.add_argument('port')
+    p.add_argument('fan', type=int)
+    p.add_argument('rpm', type=int)
+
+    p = sub.add_parser('autotune')
+    p.add_argument('port')
+    p.add_argument('fans', type=int, nargs='*', help='all fans when none are given')
+
+    p = sub.add_parser('characterize')
+    p.add_argument('port')
+    p.add_argument('fans', type=int, nargs='*', help='all fans when none are given')
+
+    p = sub.add_parser('set-demand')
+    p.add_argument('port')
+    p.add_argument('demand', type=float)
+    p.add_argument('--fans', type=int, nargs='+', help='all fans when none are given')
+    p.add_argument('--timeout', type=int, default=0, help='ms the demand holds for, 0 until replaced')
+    p.add_argument('--clear', action='store_true')
+
+    p = sub.add_parser('set-policy')
+    p.add_argument('port')
+    p.add_argument('policy', choices=POLICIES)
+    p.add_argument('--fans', type=int, nargs='+', help='all fans when none are given')
+    p.add_argument('--weights', type=int, nargs=4, default=[1, 1, 1, 1],
+                   help='blend weights of the motherboard, temperature, host and failsafe sources')
+
+    p = sub.add_parser('dump-trace')
+    p.add_argument('port')
+    p.add_argument('file')
+
+    p = sub.add_parser('dump-blackbox')
+    p.add_argument('port')
+    p.add_argument('--raw', help='also save the records to a file')
+
+    p = sub.add_parser('decode-blackbox')
+    p.add_argument('file', help='records saved by dump-blackbox --raw')
+
+    sub.add_parser('loopback')
+
+    args = parser.parse_args()
+
+    if args.cmd == 'loopback':
+        master, slave = pty.openpty()
+        tty.setraw(master)
+        StandIn(master).start()
+        print('stand-in device on {}, ctrl-c to stop'.format(os.ttyname(slave)))
+        try:
+            while True:
+                time.sleep(1)
+        except KeyboardInterrupt:
+            return 0
+
+    if args.cmd == 'decode-blackbox':
+        with open(args.file, 'rb') as f:
+            for line in decode_blackbox(f.read()):
+                print(line)
+        return 0
+
+    fd = open_port(args.port, args.baud)
+    if args.cmd == 'monitor':
+        try:
+            monitor(fd, args.count)
+        except KeyboardInterrupt:
+            pass
+        return 0
+
+    if args.cmd == 'set-target':
+        duty = max(0, min(32767, int(args.duty * 32768)))
+        payload = struct.pack('<BhB', args.fan, duty, 1 if args.save else 0)
+        return 0 if command(fd, CMD_SET_TARGET, payload) else 1
+
+    if args.cmd == 'dump-trace':
+        return 0 if dump_trace(fd, args.file) else 1
+
+    if args.cmd == 'dump-blackbox':
+        return 0 if dump_blackbox(fd, args.raw) else 1
+
+    if args.cmd == 'set-rate':
+        return 0 if command(fd, CMD_SET_RATE, struct.pack('<H', args.period)) else 1
+
+    if args.cmd == 'set-rpm':
+        return 0 if command(fd, CMD_SET_RPM, struct.pack('<BH', args.fan, args.rpm)) else 1
+
+    if args.cmd == 'autotune':
+        mask = sum(1 << f for f in args.fans) if args.fans else (1 << NUM_OF_FANS) - 1
+        return 0 if command(fd, CMD_AUTOTUNE, bytes([mask])) else 1
+
+    if args.cmd == 'set-demand':
+        mask = sum(1 << f for f in args.fans) if args.fans else (1 << NUM_OF_FANS) - 1
+        demand = 0xffff if args.clear else max(0, min(32767, int(args.demand * 32768)))
+        return 0 if command(fd, CMD_SET_DEMAND, struct.pack('<BHH', mask, demand, args.timeout)) else 1
+
+    if args.cmd == 'set-policy':
+        mask = sum(1 << f for f in args.fans) if args.fans else (1 << NUM_OF_FANS) - 1
+        payload = bytes([mask, POLICIES.index(args.policy)] + args.weights)
+        return 0 if command(fd, CMD_SET_POLICY, payload) else 1
+
+    if args.cmd == 'characterize':
+        mask = sum(1 << f for f in args.fans) if args.fans else (1 << NUM_OF_FANS) - 1
+        return 0 if command(fd, CMD_CHARACTERIZE, bytes([mask])) else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())